@@ -26,6 +26,7 @@
 #include "apk_print.h"
 #include "apk_io.h"
 #include "apk_fs.h"
+#include "apk_nproc.h"
 
 static struct apk_ctx ctx;
 static struct apk_database db;
@@ -59,10 +60,12 @@ static void version(struct apk_out *out, const char *prefix)
 	OPT(OPT_GLOBAL_force_refresh,		"force-refresh") \
 	OPT(OPT_GLOBAL_help,			APK_OPT_SH("h") "help") \
 	OPT(OPT_GLOBAL_interactive,		APK_OPT_AUTO APK_OPT_SH("i") "interactive") \
+	OPT(OPT_GLOBAL_jobs,			APK_OPT_ARG "jobs") \
 	OPT(OPT_GLOBAL_keys_dir,		APK_OPT_ARG "keys-dir") \
 	OPT(OPT_GLOBAL_legacy_info,		APK_OPT_BOOL "legacy-info") \
 	OPT(OPT_GLOBAL_logfile,			APK_OPT_BOOL "logfile") \
 	OPT(OPT_GLOBAL_network,			APK_OPT_BOOL "network") \
+	OPT(OPT_GLOBAL_parallel_downloads,	APK_OPT_ARG "parallel-downloads") \
 	OPT(OPT_GLOBAL_preserve_env,		APK_OPT_BOOL "preserve-env") \
 	OPT(OPT_GLOBAL_pretty_print,		APK_OPT_AUTO "pretty-print") \
 	OPT(OPT_GLOBAL_preupgrade_depends,	APK_OPT_ARG "preupgrade-depends") \
@@ -76,6 +79,7 @@ static void version(struct apk_out *out, const char *prefix)
 	OPT(OPT_GLOBAL_repository_config,	APK_OPT_ARG "repository-config") \
 	OPT(OPT_GLOBAL_root,			APK_OPT_ARG APK_OPT_SH("p") "root") \
 	OPT(OPT_GLOBAL_root_tmpfs,		APK_OPT_AUTO "root-tmpfs") \
+	OPT(OPT_GLOBAL_solver_stats,		"solver-stats") \
 	OPT(OPT_GLOBAL_sync,			APK_OPT_AUTO "sync") \
 	OPT(OPT_GLOBAL_timeout,			APK_OPT_ARG "timeout") \
 	OPT(OPT_GLOBAL_update_cache,		APK_OPT_SH("U") "update-cache") \
@@ -86,6 +90,18 @@ static void version(struct apk_out *out, const char *prefix)
 
 APK_OPTIONS(optgroup_global_desc, GLOBAL_OPTIONS);
 
+static int parse_jobs(const char *optarg, unsigned int *jobs)
+{
+	unsigned long val;
+	char *end;
+
+	if (!isdigit((unsigned char) optarg[0])) return -EINVAL;
+	val = strtoul(optarg, &end, 10);
+	if (*end || val < 1 || val > APK_MAX_JOBS) return -EINVAL;
+	*jobs = val;
+	return 0;
+}
+
 static int optgroup_global_parse(struct apk_ctx *ac, int opt, const char *optarg)
 {
 	struct apk_out *out = &ac->out;
@@ -147,6 +163,8 @@ static int optgroup_global_parse(struct apk_ctx *ac, int opt, const char *optarg
 	case OPT_GLOBAL_interactive:
 		ac->interactive = APK_OPTARG_VAL(optarg);
 		break;
+	case OPT_GLOBAL_jobs:
+		return parse_jobs(optarg, &ac->jobs);
 	case OPT_GLOBAL_keys_dir:
 		ac->keys_dir = optarg;
 		break;
@@ -159,6 +177,8 @@ static int optgroup_global_parse(struct apk_ctx *ac, int opt, const char *optarg
 	case OPT_GLOBAL_network:
 		apk_opt_set_flag_invert(optarg, APK_NO_NETWORK, &ac->flags);
 		break;
+	case OPT_GLOBAL_parallel_downloads:
+		return parse_jobs(optarg, &ac->parallel_downloads);
 	case OPT_GLOBAL_preserve_env:
 		apk_opt_set_flag(optarg, APK_PRESERVE_ENV, &ac->flags);
 		break;
@@ -198,6 +218,9 @@ static int optgroup_global_parse(struct apk_ctx *ac, int opt, const char *optarg
 	case OPT_GLOBAL_root_tmpfs:
 		ac->root_tmpfs = APK_OPTARG_VAL(optarg);
 		break;
+	case OPT_GLOBAL_solver_stats:
+		ac->flags |= APK_SOLVER_STATS;
+		break;
 	case OPT_GLOBAL_sync:
 		ac->sync = APK_OPTARG_VAL(optarg);
 		break;
@@ -229,9 +252,13 @@ static int optgroup_global_parse(struct apk_ctx *ac, int opt, const char *optarg
 	OPT(OPT_COMMIT_clean_protected,		APK_OPT_BOOL "clean-protected") \
 	OPT(OPT_COMMIT_commit_hooks,		APK_OPT_BOOL "commit-hooks") \
 	OPT(OPT_COMMIT_initramfs_diskless_boot,	"initramfs-diskless-boot") \
+	OPT(OPT_COMMIT_journal,			APK_OPT_BOOL "journal") \
 	OPT(OPT_COMMIT_overlay_from_stdin,	"overlay-from-stdin") \
+	OPT(OPT_COMMIT_parallel_extract,	APK_OPT_BOOL "parallel-extract") \
+	OPT(OPT_COMMIT_prefetch,		APK_OPT_BOOL "prefetch") \
 	OPT(OPT_COMMIT_scripts,			APK_OPT_BOOL "scripts") \
-	OPT(OPT_COMMIT_simulate,		APK_OPT_BOOL APK_OPT_SH("s") "simulate")
+	OPT(OPT_COMMIT_simulate,		APK_OPT_BOOL APK_OPT_SH("s") "simulate") \
+	OPT(OPT_COMMIT_solver_cache,		APK_OPT_BOOL "solver-cache")
 
 APK_OPTIONS(optgroup_commit_desc, COMMIT_OPTIONS);
 
@@ -250,15 +277,27 @@ static int optgroup_commit_parse(struct apk_ctx *ac, int opt, const char *optarg
 		ac->force |= APK_FORCE_OVERWRITE | APK_FORCE_OLD_APK
 			|  APK_FORCE_BROKEN_WORLD | APK_FORCE_NON_REPOSITORY;
 		break;
+	case OPT_COMMIT_journal:
+		apk_opt_set_flag(optarg, APK_JOURNAL, &ac->flags);
+		break;
 	case OPT_COMMIT_overlay_from_stdin:
 		ac->flags |= APK_OVERLAY_FROM_STDIN;
 		break;
+	case OPT_COMMIT_parallel_extract:
+		apk_opt_set_flag(optarg, APK_PARALLEL_EXTRACT, &ac->flags);
+		break;
+	case OPT_COMMIT_prefetch:
+		apk_opt_set_flag(optarg, APK_PREFETCH, &ac->flags);
+		break;
 	case OPT_COMMIT_scripts:
 		apk_opt_set_flag_invert(optarg, APK_NO_SCRIPTS, &ac->flags);
 		break;
 	case OPT_COMMIT_simulate:
 		apk_opt_set_flag(optarg, APK_SIMULATE, &ac->flags);
 		break;
+	case OPT_COMMIT_solver_cache:
+		apk_opt_set_flag(optarg, APK_SOLVER_CACHE, &ac->flags);
+		break;
 	default:
 		return -ENOTSUP;
 	}
@@ -636,6 +675,8 @@ int main(int argc, char **argv)
 
 	apk_crypto_init();
 	apk_ctx_init(&ctx);
+	ctx.jobs = min(apk_get_nproc(), APK_MAX_JOBS);
+	ctx.parallel_downloads = 4;
 	ctx.on_tty = isatty(STDOUT_FILENO);
 	ctx.interactive = (access("/etc/apk/interactive", F_OK) == 0) ? APK_AUTO : APK_NO;
 	ctx.pretty_print = APK_AUTO;
@@ -446,6 +446,24 @@ const struct adb_object_schema schema_pkginfo_array = {
 	.fields = ADB_ARRAY_ITEM(schema_pkginfo),
 };
 
+const struct adb_object_schema schema_reverse_dependency = {
+	.kind = ADB_KIND_OBJECT,
+	.num_fields = ADBI_RDEP_MAX,
+	.num_compare = ADBI_RDEP_NAME,
+	.fields = ADB_OBJECT_FIELDS(ADBI_RDEP_MAX) {
+		ADB_FIELD(ADBI_RDEP_NAME,	"name",		scalar_string),
+		ADB_FIELD(ADBI_RDEP_DEPENDS,	"depends",	schema_string_array),
+		ADB_FIELD(ADBI_RDEP_INSTALL_IF,	"install-if",	schema_string_array),
+		ADB_FIELD(ADBI_RDEP_REQUIRED,	"required",	scalar_int),
+	},
+};
+
+const struct adb_object_schema schema_reverse_dependency_array = {
+	.kind = ADB_KIND_ARRAY,
+	.num_fields = 128,
+	.fields = ADB_ARRAY_ITEM(schema_reverse_dependency),
+};
+
 const struct adb_object_schema schema_index = {
 	.kind = ADB_KIND_OBJECT,
 	.num_fields = ADBI_NDX_MAX,
@@ -453,6 +471,7 @@ const struct adb_object_schema schema_index = {
 		ADB_FIELD(ADBI_NDX_DESCRIPTION,	"description",	scalar_string),
 		ADB_FIELD(ADBI_NDX_PACKAGES,	"packages",	schema_pkginfo_array),
 		ADB_FIELD(ADBI_NDX_PKGNAME_SPEC,"pkgname-spec",	scalar_string),
+		ADB_FIELD(ADBI_NDX_REVERSE_DEPS,"reverse-dependencies",	schema_reverse_dependency_array),
 	},
 };
 
@@ -85,7 +85,15 @@ struct adb_data_package {
 #define ADBI_NDX_DESCRIPTION	0x01
 #define ADBI_NDX_PACKAGES	0x02
 #define ADBI_NDX_PKGNAME_SPEC	0x03
-#define ADBI_NDX_MAX		0x04
+#define ADBI_NDX_REVERSE_DEPS	0x04
+#define ADBI_NDX_MAX		0x05
+
+/* Reverse dependencies of a name in the index */
+#define ADBI_RDEP_NAME		0x01
+#define ADBI_RDEP_DEPENDS	0x02
+#define ADBI_RDEP_INSTALL_IF	0x03
+#define ADBI_RDEP_REQUIRED	0x04
+#define ADBI_RDEP_MAX		0x05
 
 /* Installed DB */
 #define ADBI_IDB_PACKAGES	0x01
@@ -98,6 +106,7 @@ extern const struct adb_object_schema
 	schema_xattr_array,
 	schema_acl, schema_file, schema_file_array, schema_dir, schema_dir_array,
 	schema_string_array, schema_scripts, schema_package, schema_package_adb_array,
+	schema_reverse_dependency, schema_reverse_dependency_array,
 	schema_index, schema_idb;
 
 /* */
@@ -14,6 +14,13 @@
 
 extern apk_blob_t apk_atom_null;
 
+/* The blob of an atom is unique for its contents, and is stored with its
+ * apk_blob_hash() so that it needs not to be hashed again. */
+struct apk_atom {
+	unsigned long hash;
+	apk_blob_t blob;
+};
+
 struct apk_atom_pool {
 	struct apk_balloc *ba;
 	struct apk_hash hash;
@@ -22,3 +29,9 @@ struct apk_atom_pool {
 void apk_atom_init(struct apk_atom_pool *, struct apk_balloc *ba);
 void apk_atom_free(struct apk_atom_pool *);
 apk_blob_t *apk_atomize_dup(struct apk_atom_pool *atoms, apk_blob_t blob);
+
+static inline unsigned long apk_atom_hash(apk_blob_t *atom)
+{
+	if (atom == &apk_atom_null) return apk_blob_hash(*atom);
+	return container_of(atom, struct apk_atom, blob)->hash;
+}
@@ -14,10 +14,14 @@ struct apk_balloc {
 	struct hlist_head pages_head;
 	size_t page_size;
 	uintptr_t cur, end;
+	size_t reserve;
+	size_t num_pages, num_huge_pages, allocated, used;
+	unsigned int hugepages : 1;
 };
 
 void apk_balloc_init(struct apk_balloc *ba, size_t page_size);
 void apk_balloc_destroy(struct apk_balloc *ba);
+void apk_balloc_reserve(struct apk_balloc *ba, size_t size);
 void *apk_balloc_aligned(struct apk_balloc *ba, size_t size, size_t align);
 void *apk_balloc_aligned0(struct apk_balloc *ba, size_t size, size_t align);
 apk_blob_t apk_balloc_dup(struct apk_balloc *ba, apk_blob_t b);
@@ -29,6 +29,11 @@
 #define APK_NO_CHROOT			BIT(11)
 #define APK_NO_LOGFILE			BIT(12)
 #define APK_PRESERVE_ENV		BIT(13)
+#define APK_JOURNAL			BIT(14)
+#define APK_SOLVER_CACHE		BIT(15)
+#define APK_SOLVER_STATS		BIT(16)
+#define APK_PARALLEL_EXTRACT		BIT(17)
+#define APK_PREFETCH			BIT(18)
 
 #define APK_FORCE_OVERWRITE		BIT(0)
 #define APK_FORCE_OLD_APK		BIT(1)
@@ -64,7 +69,7 @@ struct apk_database;
 struct apk_ctx {
 	struct apk_balloc ba;
 	unsigned int flags, force, open_flags;
-	unsigned int lock_wait, cache_max_age;
+	unsigned int lock_wait, cache_max_age, jobs, parallel_downloads;
 	struct apk_out out;
 	struct adb_compression_spec compspec;
 	const char *root;
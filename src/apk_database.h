@@ -179,6 +179,43 @@ struct apk_ipkg_creator {
 	int files_unsorted;
 };
 
+struct apk_db_lazy_files {
+	struct apk_package *pkg;
+	apk_blob_t files;
+	bool text;
+};
+APK_ARRAY(apk_db_lazy_files_array, struct apk_db_lazy_files);
+
+struct apk_db_journal_entry {
+	struct apk_digest id;
+	apk_blob_t record;
+};
+APK_ARRAY(apk_db_journal_entry_array, struct apk_db_journal_entry);
+
+#define APK_DB_PREFETCH_DOWNLOAD	BIT(0)
+#define APK_DB_PREFETCH_STAGE		BIT(1)
+
+struct apk_db_prefetch {
+	struct apk_package *pkg;
+	pid_t pid;
+	int fd, staged_fd;
+	struct apk_out_capture cap;
+};
+APK_ARRAY(apk_db_prefetch_array, struct apk_db_prefetch);
+
+struct apk_db_scripts {
+	int fd;
+	uint64_t end;
+	bool rewrite;
+};
+
+struct apk_db_journal {
+	apk_blob_t data;
+	off_t size, base_size;
+	struct apk_db_journal_entry_array *entries;
+	struct apk_package_array *packages;
+};
+
 struct apk_database {
 	struct apk_ctx *ctx;
 	struct apk_balloc ba_names;
@@ -192,6 +229,7 @@ struct apk_database {
 	apk_blob_t *noarch;
 	unsigned long cache_remount_flags;
 	unsigned int local_repos, available_repos;
+	unsigned int rdepends_repos;
 	unsigned int pending_triggers;
 	unsigned int extract_flags;
 	unsigned int active_layers;
@@ -205,16 +243,17 @@ struct apk_database {
 	unsigned int write_arch : 1;
 	unsigned int script_dirs_checked : 1;
 	unsigned int open_complete : 1;
+	unsigned int rdepends_loaded : 1;
 	unsigned int compat_newfeatures : 1;
 	unsigned int compat_notinstallable : 1;
 	unsigned int compat_depversions : 1;
 	unsigned int sorted_names : 1;
 	unsigned int sorted_installed_packages : 1;
-	unsigned int scripts_tar : 1;
 	unsigned int indent_level : 1;
 	unsigned int root_proc_ok : 1;
 	unsigned int root_dev_ok : 1;
 	unsigned int need_unshare : 1;
+	unsigned int scripts_run : 1;
 
 	struct apk_dependency_array *world;
 	struct apk_id_cache *id_cache;
@@ -229,9 +268,12 @@ struct apk_database {
 	struct apk_string_array *filename_array;
 	struct apk_package_tmpl overlay_tmpl;
 	struct apk_ipkg_creator ic;
+	struct apk_db_prefetch_array *prefetch;
 
 	struct {
 		unsigned stale, updated, unavailable;
+		struct apk_package_array *packages;
+		struct apk_name_array *names;
 	} repositories;
 
 	struct {
@@ -246,6 +288,11 @@ struct apk_database {
 		struct list_head triggers;
 		struct apk_hash dirs;
 		struct apk_hash files;
+		struct apk_db_lazy_files_array *lazy_files;
+		struct apk_istream *lazy_snapshot[APK_DB_LAYER_NUM];
+		struct apk_db_journal journal[APK_DB_LAYER_NUM];
+		struct apk_db_scripts scripts[APK_DB_LAYER_NUM];
+		int files_error;
 		struct {
 			uint64_t bytes;
 			unsigned files;
@@ -264,6 +311,8 @@ static inline int apk_name_cmp_display(const struct apk_name *a, const struct ap
 struct apk_provider_array *apk_name_sorted_providers(struct apk_name *);
 
 struct apk_name *apk_db_get_name(struct apk_database *db, apk_blob_t name);
+struct apk_name *apk_db_get_name_atom(struct apk_database *db, apk_blob_t *name);
+struct apk_name *apk_db_query_name_atom(struct apk_database *db, apk_blob_t *name);
 struct apk_name *apk_db_query_name(struct apk_database *db, apk_blob_t name);
 int apk_db_get_tag_id(struct apk_database *db, apk_blob_t tag);
 
@@ -279,6 +328,7 @@ struct apk_db_dir *apk_db_dir_get(struct apk_database *db, apk_blob_t name);
 struct apk_db_dir *apk_db_dir_query(struct apk_database *db, apk_blob_t name);
 struct apk_db_file *apk_db_file_query(struct apk_database *db,
 				      apk_blob_t dir, apk_blob_t name);
+int apk_db_load_files(struct apk_database *db);
 
 const char *apk_db_layer_name(int layer);
 void apk_db_init(struct apk_database *db, struct apk_ctx *ctx);
@@ -288,6 +338,7 @@ int apk_db_write_config(struct apk_database *db);
 int apk_db_permanent(struct apk_database *db);
 int apk_db_check_world(struct apk_database *db, struct apk_dependency_array *world);
 int apk_db_fire_triggers(struct apk_database *db);
+int apk_db_read_script(struct apk_database *db, struct apk_installed_package *ipkg, unsigned int type);
 int apk_db_run_script(struct apk_database *db, const char *hook_type, const char *package_name, int fd, char **argv, const char *logpfx);
 int apk_db_cache_active(struct apk_database *db);
 static inline time_t apk_db_url_since(struct apk_database *db, time_t since) {
@@ -306,6 +357,7 @@ struct apk_package *apk_db_get_pkg_by_name(struct apk_database *db, apk_blob_t f
 struct apk_package *apk_db_get_file_owner(struct apk_database *db, apk_blob_t filename);
 
 int apk_db_index_read(struct apk_database *db, struct apk_istream *is, int repo);
+void apk_db_load_rdepends(struct apk_database *db);
 int apk_db_index_read_file(struct apk_database *db, const char *file, int repo);
 
 int apk_db_repository_check(struct apk_database *db);
@@ -322,6 +374,8 @@ typedef void (*apk_cache_item_cb)(struct apk_database *db, int static_cache,
 				  struct apk_package *pkg);
 int apk_db_cache_foreach_item(struct apk_database *db, apk_cache_item_cb cb);
 
+int apk_db_prefetch_pkg(struct apk_database *db, struct apk_package *pkg, unsigned int flags);
+void apk_db_prefetch_cancel(struct apk_database *db);
 int apk_db_install_pkg(struct apk_database *db, struct apk_package *oldpkg, struct apk_package *newpkg, struct apk_progress *prog);
 
 struct apk_name_array *apk_db_sorted_names(struct apk_database *db);
@@ -144,6 +144,7 @@ static inline int IS_ERR(const void *ptr) { return (unsigned long)ptr >= (unsign
 #define APK_MAX_SCRIPT_SIZE	262144	/* package install script size 256kb */
 #define APK_MAX_REPOS		32	/* see struct apk_package */
 #define APK_MAX_TAGS		16	/* see solver; unsigned short */
+#define APK_MAX_JOBS		256	/* worker processes */
 
 static inline uint64_t apk_calc_installed_size(uint64_t size)
 {
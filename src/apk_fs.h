@@ -44,6 +44,7 @@ struct apk_fsdir_ops {
 	int (*file_extract)(struct apk_ctx *, const struct apk_file_info *, struct apk_istream *, unsigned int, apk_blob_t);
 	int (*file_control)(struct apk_fsdir *, apk_blob_t, int);
 	int (*file_info)(struct apk_fsdir *, apk_blob_t, unsigned int, struct apk_file_info *);
+	int (*file_check_staged)(struct apk_ctx *, const struct apk_file_info *, unsigned int, apk_blob_t);
 };
 
 #define APK_FSEXTRACTF_NO_CHOWN		0x0001
@@ -52,6 +53,8 @@ struct apk_fsdir_ops {
 #define APK_FSEXTRACTF_NO_DEVICES	0x0008
 
 int apk_fs_extract(struct apk_ctx *, const struct apk_file_info *, struct apk_istream *, unsigned int, apk_blob_t);
+bool apk_fs_can_stage(const struct apk_file_info *);
+int apk_fs_check_staged(struct apk_ctx *, const struct apk_file_info *, unsigned int, apk_blob_t);
 
 void apk_fsdir_get(struct apk_fsdir *, apk_blob_t dir, unsigned int extract_flags, struct apk_ctx *ac, apk_blob_t pkgctx);
 
@@ -29,20 +29,40 @@ struct apk_hash_ops {
 	int		(*compare)(apk_blob_t itemkey, apk_blob_t key);
 	int		(*compare_item)(apk_hash_item item, apk_blob_t key);
 	void		(*delete_item)(apk_hash_item item);
+	unsigned int	open_addressing : 1;
 };
 
 typedef struct hlist_node apk_hash_node;
 APK_ARRAY(apk_hash_array, struct hlist_head);
 
+struct apk_hash_table;
+
+/* Items are chained to buckets through the apk_hash_node embedded in them,
+ * or with open_addressing set in ops, stored in a table of item pointers. */
 struct apk_hash {
 	const struct apk_hash_ops *ops;
-	struct apk_hash_array *buckets;
+	union {
+		struct apk_hash_array *buckets;
+		struct apk_hash_table *table;
+	};
 	int num_items;
+	int num_foreach;
+	unsigned long num_lookups, num_misses;
+};
+
+/* For chained tables the chains are the bucket lists. For open addressing
+ * tables the buckets are the slots, and the chain of an item is the number
+ * of groups probed to find it. */
+struct apk_hash_stats {
+	size_t items, buckets, used_buckets;
+	size_t max_chain, total_chain;
+	unsigned long lookups, misses;
 };
 
 void apk_hash_init(struct apk_hash *h, const struct apk_hash_ops *ops,
 		   int num_buckets);
 void apk_hash_free(struct apk_hash *h);
+void apk_hash_get_stats(struct apk_hash *h, struct apk_hash_stats *st);
 
 int apk_hash_foreach(struct apk_hash *h, apk_hash_enumerator_f e, void *ctx);
 apk_hash_item apk_hash_get_hashed(struct apk_hash *h, apk_blob_t key, unsigned long hash);
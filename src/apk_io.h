@@ -101,6 +101,7 @@ struct apk_istream *apk_istream_from_fd_url_if_modified(int atfd, const char *ur
 static inline int apk_istream_error(struct apk_istream *is, int err) { if (is->err >= 0 && err) is->err = err; return is->err < 0 ? is->err : 0; }
 void apk_istream_set_progress(struct apk_istream *is, struct apk_progress *p);
 apk_blob_t apk_istream_mmap(struct apk_istream *is);
+int apk_istream_mapped_range(struct apk_istream *is, uint64_t size, int *fd, off_t *offset);
 ssize_t apk_istream_read_max(struct apk_istream *is, void *ptr, size_t size);
 int apk_istream_read(struct apk_istream *is, void *ptr, size_t size);
 void *apk_istream_peek(struct apk_istream *is, size_t len);
@@ -137,6 +138,7 @@ void apk_io_url_init(struct apk_out *out);
 void apk_io_url_set_timeout(int timeout);
 void apk_io_url_set_redirect_callback(void (*cb)(int, const char *));
 void apk_io_url_check_certificate(bool);
+void apk_io_url_close_connections(void);
 struct apk_istream *apk_io_url_istream(const char *url, time_t since);
 
 struct apk_segment_istream {
@@ -172,7 +174,15 @@ struct apk_ostream {
 	int rc;
 };
 
+struct apk_digest_ostream {
+	struct apk_ostream os;
+	struct apk_digest_ctx *dctx;
+	uint64_t size;
+};
+
 struct apk_ostream *apk_ostream_counter(off_t *);
+struct apk_ostream *apk_ostream_digest(struct apk_digest_ostream *dos, struct apk_digest_ctx *dctx);
+struct apk_ostream *apk_ostream_to_blob(apk_blob_t *b);
 struct apk_ostream *apk_ostream_to_fd(int fd);
 struct apk_ostream *apk_ostream_to_file(int atfd, const char *file, mode_t mode);
 struct apk_ostream *apk_ostream_to_file_safe(int atfd, const char *file, mode_t mode);
@@ -57,10 +57,12 @@ struct apk_installed_package {
 	struct list_head trigger_pkgs_list;
 	struct apk_db_dir_instance_array *diris;
 	apk_blob_t script[APK_SCRIPT_MAX];
+	uint64_t script_offset[APK_SCRIPT_MAX];	// in scripts db, zero if not written yet
 	struct apk_string_array *triggers;
 	struct apk_string_array *pending_triggers;
 	struct apk_dependency_array *replaces;
 
+	uint8_t fdb_digest[APK_DIGEST_LENGTH_SHA1];
 	unsigned short replaces_priority;
 	unsigned repository_tag : 6;
 	unsigned run_all_triggers : 1;
@@ -69,10 +71,10 @@ struct apk_installed_package {
 	unsigned broken_xattr : 1;
 	unsigned sha256_160 : 1;
 	unsigned to_be_removed : 1;
+	unsigned fdb_dirty : 1;		// fdb_digest needs to be recalculated
 };
 
 struct apk_package {
-	apk_hash_node hash_node;
 	struct apk_name *name;
 	struct apk_installed_package *ipkg;
 	struct apk_dependency_array *depends, *install_if, *provides, *recommends;
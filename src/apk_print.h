@@ -56,6 +56,18 @@ void apk_out_fmt(struct apk_out *, const char *prefix, const char *format, ...)
 	__attribute__ ((format (printf, 3, 4)));
 void apk_out_log_argv(struct apk_out *, char **argv);
 
+/* Captures the output of a forked worker to be written out by the parent
+ * when it collects the worker, so that the output of concurrent workers is
+ * not interleaved */
+struct apk_out_capture {
+	int fd[2];
+};
+#define APK_OUT_CAPTURE_INIT (struct apk_out_capture) { .fd = { -1, -1 } }
+void apk_out_capture_init(struct apk_out_capture *c);
+void apk_out_capture_start(struct apk_out_capture *c, struct apk_out *out);
+void apk_out_capture_flush(struct apk_out_capture *c, struct apk_out *out);
+void apk_out_capture_free(struct apk_out_capture *c);
+
 struct apk_progress {
 	struct apk_out *out;
 	const char *stage;
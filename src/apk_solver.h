@@ -21,10 +21,23 @@ struct apk_change {
 };
 APK_ARRAY(apk_change_array, struct apk_change);
 
+/* Time spent in each solver phase, in nanoseconds, and the amount of work done */
+struct apk_solver_stats {
+	uint64_t discover_ns, resolve_ns, changeset_ns;
+	unsigned long names_discovered;
+	unsigned long queued_dirty, queued_unresolved;
+	unsigned long names_reconsidered;
+	unsigned long provider_comparisons;
+	unsigned long packages_disqualified;
+	unsigned long reverse_dep_fanouts;
+	unsigned int cached : 1;
+};
+
 struct apk_changeset {
 	int num_install, num_remove, num_adjust;
 	int num_total_changes;
 	struct apk_change_array *changes;
+	struct apk_solver_stats stats;
 };
 
 #define APK_SOLVERF_UPGRADE		0x0001
@@ -25,6 +25,7 @@ struct apk_solver_name_state {
 		};
 	};
 	int order_id;
+	unsigned int queue_index;
 	unsigned short requirers;
 	unsigned short merge_depends;
 	unsigned short merge_provides;
@@ -42,6 +43,7 @@ struct apk_solver_name_state {
 	unsigned has_auto_selectable : 1;
 	unsigned iif_needed : 1;
 	unsigned resolvenow : 1;
+	unsigned queue_selectable : 1;
 };
 
 struct apk_solver_package_state {
@@ -13,6 +13,9 @@
 int apk_tar_parse(struct apk_istream *,
 		  apk_archive_entry_parser parser, void *ctx,
 		  struct apk_id_cache *);
+typedef int (*apk_tar_index_entry)(void *ctx, const char *name, uint64_t offset, uint64_t size);
+int apk_tar_index(int fd, apk_tar_index_entry cb, void *ctx, uint64_t *end);
 int apk_tar_write_entry(struct apk_ostream *, const struct apk_file_info *ae,
 			const char *data);
+size_t apk_tar_header_size(const struct apk_file_info *ae);
 int apk_tar_write_padding(struct apk_ostream *, int size);
@@ -427,6 +427,7 @@ static int audit_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *ar
 		apk_err(out, "audit does not support usermode!");
 		return -ENOSYS;
 	}
+	apk_db_load_files(db);
 
 	actx->verbosity = apk_out_verbosity(&db->ctx->out);
 	atctx.apknew_suffix = APK_BLOB_STR(ac->apknew_suffix);
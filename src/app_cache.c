@@ -106,6 +106,8 @@ static void cache_clean_item(struct apk_database *db, int static_cache, int dirf
 	struct apk_out *out = &db->ctx->out;
 
 	if (strcmp(name, "installed") == 0) return;
+	if (strcmp(name, "repositories.cache") == 0) return;
+	if (strcmp(name, "solver.cache") == 0) return;
 	if (pkg) {
 		if (db->ctx->flags & APK_PURGE) {
 			if (apk_db_permanent(db) || !pkg->ipkg) goto delete;
@@ -153,6 +153,7 @@ static int del_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *arg
 	struct apk_dependency_array *orig_world = apk_array_bclone(db->world, &db->ba_deps);
 	int r = 0;
 
+	apk_db_load_rdepends(db);
 	apk_change_array_init(&changeset.changes);
 	ctx->genid = apk_foreach_genid();
 	apk_dependency_array_init(&ctx->world);
@@ -118,6 +118,7 @@ static int fix_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *arg
 	if (ctx->errors) return ctx->errors;
 
 	if (ctx->fix_directory_permissions) {
+		apk_db_load_files(db);
 		apk_hash_foreach(&db->installed.dirs, fix_directory_permissions, ctx);
 		if (db->num_dir_update_errors) {
 			apk_err(&ac->out, "Failed to fix directory permissions");
@@ -158,6 +158,7 @@ static void print_rdep_pkg(struct apk_package *pkg0, struct apk_dependency *dep0
 
 static void info_print_required_by(struct apk_database *db, struct apk_package *pkg)
 {
+	apk_db_load_rdepends(db);
 	if (verbosity == 1) printf(PKG_VER_FMT " is required by:\n", PKG_VER_PRINTF(pkg));
 	if (verbosity > 1) printf("%s: ", pkg->name->name);
 	apk_pkg_foreach_reverse_dependency(
@@ -171,6 +172,7 @@ static void info_print_rinstall_if(struct apk_database *db, struct apk_package *
 {
 	char *separator = verbosity > 1 ? " " : "\n";
 
+	apk_db_load_rdepends(db);
 	if (verbosity == 1) printf(PKG_VER_FMT " affects auto-installation of:\n", PKG_VER_PRINTF(pkg));
 	if (verbosity > 1) printf("%s: ", pkg->name->name);
 
@@ -195,6 +197,7 @@ static void info_print_contents(struct apk_database *db, struct apk_package *pkg
 
 	if (verbosity == 1) printf(PKG_VER_FMT " contains:\n", PKG_VER_PRINTF(pkg));
 
+	apk_db_load_files(db);
 	apk_array_foreach_item(diri, ipkg->diris) {
 		apk_array_foreach_item(file, diri->files) {
 			if (verbosity > 1) printf("%s: ", pkg->name->name);
@@ -32,6 +32,7 @@ static void process_package(struct apk_database *db, struct apk_package *pkg)
 	if (ipkg == NULL)
 		return;
 
+	apk_db_load_files(db);
 	if (apk_out_verbosity(out) > 1) {
 		prefix1 = pkg->name->name;
 		prefix2 = ": ";
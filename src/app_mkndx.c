@@ -249,6 +249,106 @@ static int find_package(struct adb_obj *pkgs, apk_blob_t path, int64_t filesize,
 	return -APKE_PACKAGE_NOT_FOUND;
 }
 
+struct mkndx_rdep {
+	apk_blob_t name, rname;
+	adb_val_t name_val, rname_val;
+	uint8_t install_if : 1;
+	uint8_t required : 1;
+	uint8_t first : 1;
+	uint8_t duplicate : 1;
+};
+APK_ARRAY(mkndx_rdep_array, struct mkndx_rdep);
+
+static int mkndx_rdep_cmp(const void *pa, const void *pb)
+{
+	const struct mkndx_rdep *a = pa, *b = pb;
+	int r = apk_blob_sort(a->name, b->name);
+	if (r) return r;
+	if (a->install_if != b->install_if) return a->install_if - b->install_if;
+	return apk_blob_sort(a->rname, b->rname);
+}
+
+static void mkndx_add_rdeps(struct mkndx_rdep_array **rdeps, struct adb_obj *deps,
+			    adb_val_t rname, bool install_if)
+{
+	struct adb_obj dep;
+
+	for (int i = ADBI_FIRST; i <= adb_ra_num(deps); i++) {
+		adb_ro_obj(deps, i, &dep);
+		mkndx_rdep_array_add(rdeps, (struct mkndx_rdep) {
+			.name = adb_ro_blob(&dep, ADBI_DEP_NAME),
+			.rname = adb_r_blob(deps->db, rname),
+			.name_val = adb_ro_val(&dep, ADBI_DEP_NAME),
+			.rname_val = rname,
+			.install_if = install_if,
+			.required = !install_if && !(adb_ro_int(&dep, ADBI_DEP_MATCH) & APK_VERSION_CONFLICT),
+		});
+	}
+}
+
+/* Writes the reverse dependency table: for each name depended on, the
+ * names of the packages, and the names they provide, which depend on it
+ * or have it in install_if. apk uses it instead of building the same
+ * data from the packages. */
+static void mkndx_write_reverse_deps(struct mkndx_ctx *ctx, struct adb_obj *ndx)
+{
+	struct mkndx_rdep_array *rdeps;
+	struct adb_obj pkginfo, deps, provides, dep;
+	struct adb_obj table, rdep, depends, install_if;
+	unsigned int i, j, num;
+	bool required;
+
+	mkndx_rdep_array_init(&rdeps);
+	for (i = ADBI_FIRST; i <= adb_ra_num(&ctx->pkgs); i++) {
+		adb_r_obj(&ctx->db, adb_ro_val(&ctx->pkgs, i), &pkginfo, &schema_pkginfo);
+		adb_ro_obj(&pkginfo, ADBI_PI_PROVIDES, &provides);
+		for (j = ADBI_FIRST - 1; j <= adb_ra_num(&provides); j++) {
+			adb_val_t rname = adb_ro_val(&pkginfo, ADBI_PI_NAME);
+			if (j >= ADBI_FIRST) rname = adb_ro_val(adb_ro_obj(&provides, j, &dep), ADBI_DEP_NAME);
+			mkndx_add_rdeps(&rdeps, adb_ro_obj(&pkginfo, ADBI_PI_DEPENDS, &deps), rname, false);
+			mkndx_add_rdeps(&rdeps, adb_ro_obj(&pkginfo, ADBI_PI_INSTALL_IF, &deps), rname, true);
+		}
+	}
+	num = apk_array_len(rdeps);
+	if (num == 0) goto done;
+
+	/* The blobs point to the database being written, so group the
+	 * entries before writing anything */
+	apk_array_qsort(rdeps, mkndx_rdep_cmp);
+	rdeps->item[0].first = 1;
+	for (i = 1; i < num; i++) {
+		struct mkndx_rdep *prev = &rdeps->item[i-1], *cur = &rdeps->item[i];
+		if (apk_blob_compare(prev->name, cur->name) != 0) cur->first = 1;
+		else if (prev->install_if == cur->install_if && apk_blob_compare(prev->rname, cur->rname) == 0)
+			cur->duplicate = 1;
+	}
+
+	adb_wo_alloca(&table, &schema_reverse_dependency_array, &ctx->db);
+	adb_wo_alloca(&rdep, &schema_reverse_dependency, &ctx->db);
+	adb_wo_alloca(&depends, &schema_string_array, &ctx->db);
+	adb_wo_alloca(&install_if, &schema_string_array, &ctx->db);
+	for (i = 0; i < num; i = j) {
+		required = false;
+		for (j = i; j < num && (j == i || !rdeps->item[j].first); j++) {
+			struct mkndx_rdep *rd = &rdeps->item[j];
+			required |= rd->required;
+			if (rd->duplicate) continue;
+			adb_wa_append(rd->install_if ? &install_if : &depends, rd->rname_val);
+		}
+		adb_wo_val(&rdep, ADBI_RDEP_NAME, rdeps->item[i].name_val);
+		adb_wo_arr(&rdep, ADBI_RDEP_DEPENDS, &depends);
+		adb_wo_arr(&rdep, ADBI_RDEP_INSTALL_IF, &install_if);
+		if (required) adb_wo_int(&rdep, ADBI_RDEP_REQUIRED, 1);
+		adb_wa_append_obj(&table, &rdep);
+	}
+	adb_wo_arr(ndx, ADBI_NDX_REVERSE_DEPS, &table);
+	adb_wo_free(&depends);
+	adb_wo_free(&install_if);
+	adb_wo_free(&table);
+done:
+	mkndx_rdep_array_free(&rdeps);
+}
+
 static int mkndx_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *args)
 {
 	struct mkndx_ctx *ctx = pctx;
@@ -353,6 +453,7 @@ static int mkndx_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *a
 	numpkgs = adb_ra_num(&ctx->pkgs);
 	adb_wo_blob(&ndx, ADBI_NDX_DESCRIPTION, APK_BLOB_STR(ctx->description));
 	if (ctx->pkgname_spec_set) adb_wo_blob(&ndx, ADBI_NDX_PKGNAME_SPEC, ctx->pkgname_spec);
+	mkndx_write_reverse_deps(ctx, &ndx);
 	adb_wo_obj(&ndx, ADBI_NDX_PACKAGES, &ctx->pkgs);
 	adb_w_rootobj(&ndx);
 
@@ -123,6 +123,8 @@ static int search_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *
 		ctx->print_package = print_package_name;
 	if (ctx->print_result == NULL)
 		ctx->print_result = ctx->print_package;
+	if (ctx->print_result == print_rdepends)
+		apk_db_load_rdepends(db);
 
 	ac->query.match |= BIT(APK_Q_FIELD_NAME) | BIT(APK_Q_FIELD_PROVIDES);
 	apk_package_array_init(&pkgs);
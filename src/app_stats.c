@@ -7,10 +7,34 @@
  */
 
 #include <stdio.h>
+#include <sys/resource.h>
 #include "apk_defines.h"
 #include "apk_applet.h"
 #include "apk_database.h"
 
+struct stats_ctx {
+	unsigned int internals : 1;
+};
+
+#define STATS_OPTIONS(OPT) \
+	OPT(OPT_STATS_internals,	"internals")
+
+APK_OPTIONS(stats_options_desc, STATS_OPTIONS);
+
+static int stats_parse_option(void *pctx, struct apk_ctx *ac, int opt, const char *optarg)
+{
+	struct stats_ctx *ctx = (struct stats_ctx *) pctx;
+
+	switch (opt) {
+	case OPT_STATS_internals:
+		ctx->internals = 1;
+		break;
+	default:
+		return -ENOTSUP;
+	}
+	return 0;
+}
+
 static int list_count(struct list_head *h)
 {
 	struct list_head *n;
@@ -22,11 +46,69 @@ static int list_count(struct list_head *h)
 	return c;
 }
 
-static int stats_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *args)
+static void stats_hash(struct apk_out *out, const char *name, struct apk_hash *h)
+{
+	struct apk_hash_stats st;
+
+	apk_hash_get_stats(h, &st);
+	apk_out(out,
+		"    %s:\n"
+		"      items: %zu\n"
+		"      buckets: %zu\n"
+		"      used-buckets: %zu\n"
+		"      max-chain: %zu\n"
+		"      avg-chain: %.2f\n"
+		"      lookups: %lu\n"
+		"      misses: %lu",
+		name, st.items, st.buckets, st.used_buckets, st.max_chain,
+		st.used_buckets ? (double) st.total_chain / st.used_buckets : 0.0,
+		st.lookups, st.misses);
+}
+
+static void stats_balloc(struct apk_out *out, const char *name, struct apk_balloc *ba)
+{
+	size_t unused = ba->end > ba->cur ? ba->end - ba->cur : 0;
+
+	/* The unused tail of the current page is still available,
+	 * everything else not handed out is waste */
+	apk_out(out,
+		"    %s:\n"
+		"      pages: %zu\n"
+		"      huge-pages: %zu\n"
+		"      bytes: %zu\n"
+		"      used: %zu\n"
+		"      waste: %zu",
+		name, ba->num_pages, ba->num_huge_pages, ba->allocated, ba->used,
+		ba->allocated - ba->used - min(unused, ba->allocated - ba->used));
+}
+
+static void stats_internals(struct apk_out *out, struct apk_ctx *ac)
+{
+	struct apk_database *db = ac->db;
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) ru.ru_maxrss = 0;
+	apk_out(out, "internals:\n  peak-rss: %ld\n  hash:", ru.ru_maxrss * 1024);
+	stats_hash(out, "names", &db->available.names);
+	stats_hash(out, "packages", &db->available.packages);
+	stats_hash(out, "dirs", &db->installed.dirs);
+	stats_hash(out, "files", &db->installed.files);
+	stats_hash(out, "atoms", &db->atoms.hash);
+	apk_out(out, "  balloc:");
+	stats_balloc(out, "names", &db->ba_names);
+	stats_balloc(out, "packages", &db->ba_pkgs);
+	stats_balloc(out, "files", &db->ba_files);
+	stats_balloc(out, "deps", &db->ba_deps);
+	stats_balloc(out, "context", &ac->ba);
+}
+
+static int stats_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *args)
 {
+	struct stats_ctx *ctx = (struct stats_ctx *) pctx;
 	struct apk_out *out = &ac->out;
 	struct apk_database *db = ac->db;
 
+	apk_db_load_files(db);
 	apk_out(out,
 		"installed:\n"
 		"  packages: %d\n"
@@ -49,12 +131,16 @@ static int stats_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *ar
 		db->available.packages.num_items,
 		db->atoms.hash.num_items
 		);
+	if (ctx->internals) stats_internals(out, ac);
 	return 0;
 }
 
 static struct apk_applet stats_applet = {
 	.name = "stats",
 	.open_flags = APK_OPENF_READ,
+	.options_desc = stats_options_desc,
+	.context_size = sizeof(struct stats_ctx),
+	.parse = stats_parse_option,
 	.main = stats_main,
 };
 
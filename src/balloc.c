@@ -7,11 +7,15 @@
  */
 
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "apk_defines.h"
 #include "apk_balloc.h"
 
+#define APK_BALLOC_HUGE_PAGE_SIZE	(2*1024*1024)
+
 struct apk_balloc_page {
 	struct hlist_node pages_list;
+	size_t map_size;	// zero if allocated with malloc
 };
 
 void apk_balloc_init(struct apk_balloc *ba, size_t page_size)
@@ -24,23 +28,59 @@ void apk_balloc_destroy(struct apk_balloc *ba)
 	struct apk_balloc_page *p;
 	struct hlist_node *pn, *pc;
 
-	hlist_for_each_entry_safe(p, pc, pn, &ba->pages_head, pages_list)
-		free(p);
+	hlist_for_each_entry_safe(p, pc, pn, &ba->pages_head, pages_list) {
+		if (p->map_size) munmap(p, p->map_size);
+		else free(p);
+	}
 	memset(ba, 0, sizeof *ba);
 }
 
+/* Makes the next page large enough for 'size' more bytes, so that data
+ * expected to be allocated together ends up in one page. */
+void apk_balloc_reserve(struct apk_balloc *ba, size_t size)
+{
+	ba->reserve += size;
+}
+
+/* Pages spanning at least a huge page are mapped separately, so that the
+ * kernel can back them with huge pages. */
+static struct apk_balloc_page *apk_balloc_map_page(struct apk_balloc *ba, size_t *page_size)
+{
+	struct apk_balloc_page *bp;
+	size_t map_size = ROUND_UP(*page_size + sizeof *bp, APK_BALLOC_HUGE_PAGE_SIZE);
+
+	if (!ba->hugepages || *page_size < APK_BALLOC_HUGE_PAGE_SIZE) return NULL;
+	bp = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (bp == MAP_FAILED) return NULL;
+#ifdef MADV_HUGEPAGE
+	madvise(bp, map_size, MADV_HUGEPAGE);
+#endif
+	bp->map_size = map_size;
+	ba->num_huge_pages++;
+	*page_size = map_size;
+	return bp;
+}
+
 void *apk_balloc_aligned(struct apk_balloc *ba, size_t size, size_t align)
 {
 	uintptr_t ptr = ROUND_UP(ba->cur, align);
 	if (ptr + size > ba->end) {
-		size_t page_size = max(ba->page_size, size);
-		struct apk_balloc_page *bp = malloc(page_size + sizeof(struct apk_balloc_page));
+		size_t page_size = max(max(ba->page_size, size), ba->reserve);
+		struct apk_balloc_page *bp = apk_balloc_map_page(ba, &page_size);
+		if (!bp) {
+			bp = malloc(page_size + sizeof(struct apk_balloc_page));
+			bp->map_size = 0;
+		}
+		ba->reserve = 0;
 		hlist_add_head(&bp->pages_list, &ba->pages_head);
 		ba->cur = (intptr_t)bp + sizeof *bp;
 		ba->end = (intptr_t)bp + page_size;
+		ba->num_pages++;
+		ba->allocated += page_size;
 		ptr = ROUND_UP(ba->cur, align);
 	}
 	ba->cur = ptr + size;
+	ba->used += size;
 	return (void *) ptr;
 }
 
@@ -8,6 +8,9 @@
  */
 
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "apk_defines.h"
 #include "apk_database.h"
 #include "apk_package.h"
@@ -313,6 +316,97 @@ static int run_commit_hooks(struct apk_database *db, int type)
 		NULL);
 }
 
+#ifdef __linux__
+#define SYNC_MAX_FS 32
+
+/* Collects a directory fd for each filesystem written during the commit
+ * so that only those get synced. Falls back to sync() if this fails, or
+ * if a script or commit hook ran, as those may have written anywhere. */
+struct sync_ctx {
+	struct apk_database *db;
+	unsigned int num_fs;
+	bool fallback;
+	dev_t dev[SYNC_MAX_FS];
+	int fd[SYNC_MAX_FS];
+};
+
+static bool sync_has_fs(struct sync_ctx *ctx, dev_t dev)
+{
+	for (unsigned int i = 0; i < ctx->num_fs; i++)
+		if (ctx->dev[i] == dev) return true;
+	return false;
+}
+
+static void sync_add_fd(struct sync_ctx *ctx, int fd)
+{
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0 || ctx->num_fs >= SYNC_MAX_FS) {
+		ctx->fallback = true;
+	} else if (!sync_has_fs(ctx, st.st_dev)) {
+		ctx->dev[ctx->num_fs] = st.st_dev;
+		ctx->fd[ctx->num_fs++] = fd;
+		return;
+	}
+	if (fd >= 0) close(fd);
+}
+
+static void sync_add_path(struct sync_ctx *ctx, const char *name)
+{
+	char path[PATH_MAX], *slash;
+	struct stat st;
+
+	if (apk_fmt(path, sizeof path, "%s", name[0] ? name : ".") < 0) goto fallback;
+	// Removed directories are accounted to their nearest existing parent
+	while (fstatat(ctx->db->root_fd, path, &st, 0) != 0) {
+		if ((errno != ENOENT && errno != ENOTDIR) || strcmp(path, ".") == 0) goto fallback;
+		slash = strrchr(path, '/');
+		if (slash) *slash = 0;
+		else strcpy(path, ".");
+	}
+	if (!sync_has_fs(ctx, st.st_dev))
+		sync_add_fd(ctx, openat(ctx->db->root_fd, path, O_RDONLY | O_CLOEXEC));
+	return;
+fallback:
+	ctx->fallback = true;
+}
+
+static int sync_add_dir(apk_hash_item item, void *pctx)
+{
+	struct sync_ctx *ctx = pctx;
+	struct apk_db_dir *dir = item;
+
+	if (dir->modified) sync_add_path(ctx, dir->name);
+	return 0;
+}
+
+static void sync_filesystems(struct apk_database *db)
+{
+	struct sync_ctx ctx = { .db = db };
+
+	if (db->scripts_run) {
+		sync();
+		return;
+	}
+	sync_add_path(&ctx, "");
+	sync_add_path(&ctx, "lib/apk/db");
+	sync_add_path(&ctx, "etc/apk");
+	if (db->cache_fd >= 0) sync_add_fd(&ctx, dup(db->cache_fd));
+	apk_hash_foreach(&db->installed.dirs, sync_add_dir, &ctx);
+
+	for (unsigned int i = 0; i < ctx.num_fs; i++) {
+		if (!ctx.fallback && syncfs(ctx.fd[i]) != 0) ctx.fallback = true;
+		close(ctx.fd[i]);
+	}
+	if (ctx.fallback) sync();
+}
+#else
+static void sync_filesystems(struct apk_database *db)
+{
+	sync();
+}
+#endif
+
 static void sync_if_needed(struct apk_database *db)
 {
 	struct apk_ctx *ac = db->ctx;
@@ -320,7 +414,7 @@ static void sync_if_needed(struct apk_database *db)
 	if (ac->sync == APK_NO) return;
 	if (ac->sync == APK_AUTO && (ac->root_set || db->usermode || !running_on_host())) return;
 	apk_out_progress_note(&ac->out, "syncing disks...");
-	sync();
+	sync_filesystems(db);
 }
 
 static int calc_precision(unsigned int num)
@@ -333,67 +427,208 @@ static int calc_precision(unsigned int num)
 	return precision;
 }
 
+static bool precache_needed(struct apk_database *db, struct apk_change *change, bool changes_only)
+{
+	struct apk_package *pkg = change->new_pkg;
+
+	if (changes_only && pkg == change->old_pkg) return false;
+	if (!pkg || pkg->cached || (pkg->repos & db->local_repos) || !pkg->installed_size) return false;
+	return apk_db_select_repo(db, pkg) != NULL;
+}
+
+static void precache_start(struct apk_database *db, struct progress *prog, struct apk_package *pkg, unsigned int num)
+{
+	apk_msg(&db->ctx->out, "(%*i/%i) Downloading " PKG_VER_FMT,
+		prog->total_changes_digits, num,
+		prog->total.packages,
+		PKG_VER_PRINTF(pkg));
+}
+
+static int precache_finish(struct apk_database *db, struct progress *prog, struct apk_package *pkg, int r)
+{
+	prog->done.bytes += pkg->size;
+	prog->done.packages++;
+	prog->done.changes++;
+	if (!r || r == -APKE_FILE_UNCHANGED) return 0;
+	apk_err(&db->ctx->out, PKG_VER_FMT ": %s", PKG_VER_PRINTF(pkg), apk_error_str(r));
+	return 1;
+}
+
+struct download_worker {
+	struct apk_package *pkg;
+	pid_t pid;
+	int status;
+	bool done;
+	struct apk_out_capture cap;
+};
+
+/* Lives in memory shared with the worker */
+struct download_slot {
+	struct apk_progress prog;
+	int result;
+};
+
+static void download_worker(struct apk_database *db, struct download_worker *w, struct download_slot *slot)
+{
+	struct apk_package *pkg = w->pkg;
+	struct apk_out *out = &db->ctx->out;
+
+	apk_out_capture_start(&w->cap, out);
+	apk_progress_start(&slot->prog, out, "download", pkg->size);
+	slot->result = apk_cache_download(db, apk_db_select_repo(db, pkg), pkg, &slot->prog);
+	fflush(NULL);
+	_exit(0);
+}
+
+static int download_result(struct apk_database *db, struct download_worker *w, struct download_slot *slot)
+{
+	int r;
+
+	if (w->pid > 0 && WIFEXITED(w->status) && WEXITSTATUS(w->status) == 0) {
+		apk_out_capture_flush(&w->cap, &db->ctx->out);
+		r = slot->result;
+		if (r != -APKE_FILE_UNCHANGED) w->pkg->cached = 1;
+		return r;
+	}
+	apk_out_capture_free(&w->cap);
+	return apk_cache_download(db, apk_db_select_repo(db, w->pkg), w->pkg, NULL);
+}
+
+/* Downloads up to max_jobs packages concurrently in forked workers. The
+ * workers report the bytes received and the result via shared memory, and
+ * the caller aggregates the progress and reports the errors and the output
+ * of the workers in order. The caller blocks on the oldest worker, and
+ * collects the others that are done with it. Returns a negative value if
+ * the workers could not be set up. */
+static int precache_parallel(struct apk_database *db, struct progress *prog, struct apk_package_array *pkgs, unsigned int max_jobs)
+{
+	unsigned int i, n = apk_array_len(pkgs), first = 0, next = 0, running = 0;
+	size_t slots_size = n * sizeof(struct download_slot);
+	struct download_slot *slots;
+	struct download_worker *w;
+	uint64_t inflight;
+	int errors = 0;
+
+	slots = mmap(NULL, slots_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (slots == MAP_FAILED) return -errno;
+	w = calloc(n, sizeof *w);
+	if (!w) {
+		munmap(slots, slots_size);
+		return -ENOMEM;
+	}
+
+	apk_io_url_close_connections();
+	while (first < n) {
+		for (; next < n && running < max_jobs; next++) {
+			w[next].pkg = pkgs->item[next];
+			precache_start(db, prog, w[next].pkg, next + 1);
+			fflush(NULL);
+			apk_out_capture_init(&w[next].cap);
+			w[next].pid = fork();
+			if (w[next].pid == 0) download_worker(db, &w[next], &slots[next]);
+			if (w[next].pid > 0) running++;
+		}
+
+		inflight = 0;
+		for (i = first; i < next; i++) {
+			if (w[i].done) continue;
+			if (w[i].pid > 0) {
+				pid_t pid;
+				while ((pid = waitpid(w[i].pid, &w[i].status, i == first ? 0 : WNOHANG)) < 0 && errno == EINTR);
+				if (pid == 0) {
+					inflight += slots[i].prog.cur_progress;
+					continue;
+				}
+				running--;
+			}
+			errors += precache_finish(db, prog, w[i].pkg, download_result(db, &w[i], &slots[i]));
+			w[i].done = true;
+		}
+		while (first < next && w[first].done) first++;
+
+		apk_progress_update(&prog->prog, apk_progress_weight(prog->done.bytes + inflight, prog->done.packages));
+	}
+
+	munmap(slots, slots_size);
+	free(w);
+	return errors;
+}
+
 int apk_solver_precache_changeset(struct apk_database *db, struct apk_changeset *changeset, bool changes_only)
 {
 	struct progress prog = { 0 };
 	struct apk_out *out = &db->ctx->out;
-	struct apk_package *pkg;
-	struct apk_repository *repo;
-	int r, errors = 0;
+	struct apk_package_array *pkgs;
+	unsigned int max_jobs = db->ctx->parallel_downloads;
+	int r, errors = -1;
 
+	apk_package_array_init(&pkgs);
 	apk_array_foreach(change, changeset->changes) {
-		pkg = change->new_pkg;
-		if (changes_only && pkg == change->old_pkg) continue;
-		if (!pkg || pkg->cached || (pkg->repos & db->local_repos) || !pkg->installed_size) continue;
-		if (!apk_db_select_repo(db, pkg)) continue;
-		prog.total.bytes += pkg->size;
+		if (!precache_needed(db, change, changes_only)) continue;
+		apk_package_array_add(&pkgs, change->new_pkg);
+		prog.total.bytes += change->new_pkg->size;
 		prog.total.packages++;
 		prog.total.changes++;
 	}
-	if (!prog.total.packages) return 0;
+	if (!prog.total.packages) goto done;
 
 	prog.total_changes_digits = calc_precision(prog.total.packages);
 	apk_msg(out, "Downloading %d packages...", prog.total.packages);
 
 	apk_progress_start(&prog.prog, out, "download", apk_progress_weight(prog.total.bytes, prog.total.packages));
-	apk_array_foreach(change, changeset->changes) {
-		pkg = change->new_pkg;
-		if (changes_only && pkg == change->old_pkg) continue;
-		if (!pkg || pkg->cached || (pkg->repos & db->local_repos) || !pkg->installed_size) continue;
-		if (!(repo = apk_db_select_repo(db, pkg))) continue;
-
-		apk_msg(out, "(%*i/%i) Downloading " PKG_VER_FMT,
-			prog.total_changes_digits, prog.done.packages+1,
-			prog.total.packages,
-			PKG_VER_PRINTF(pkg));
-
-		apk_progress_item_start(&prog.prog, apk_progress_weight(prog.done.bytes, prog.done.packages), pkg->size);
-		r = apk_cache_download(db, repo, pkg, &prog.prog);
-		if (r && r != -APKE_FILE_UNCHANGED) {
-			apk_err(out, PKG_VER_FMT ": %s", PKG_VER_PRINTF(pkg), apk_error_str(r));
-			errors++;
+	if (max_jobs > 1 && prog.total.packages > 1 && !(db->ctx->flags & APK_SIMULATE))
+		errors = precache_parallel(db, &prog, pkgs, max_jobs);
+	if (errors < 0) {
+		errors = 0;
+		apk_array_foreach_item(pkg, pkgs) {
+			precache_start(db, &prog, pkg, prog.done.packages + 1);
+			apk_progress_item_start(&prog.prog, apk_progress_weight(prog.done.bytes, prog.done.packages), pkg->size);
+			r = apk_cache_download(db, apk_db_select_repo(db, pkg), pkg, &prog.prog);
+			apk_progress_item_end(&prog.prog);
+			errors += precache_finish(db, &prog, pkg, r);
 		}
-		apk_progress_item_end(&prog.prog);
-		prog.done.bytes += pkg->size;
-		prog.done.packages++;
-		prog.done.changes++;
 	}
 	apk_progress_end(&prog.prog);
-
-	if (errors) return -errors;
+done:
+	apk_package_array_free(&pkgs);
+	if (errors > 0) return -errors;
 	return prog.done.packages;
 }
 
+/* Packages to download with --prefetch, and to extract with
+ * --parallel-extract, ahead of their turn in the install. The packages
+ * which the install would stream from a remote repository are downloaded
+ * only with --prefetch, as they are held in memory until installed. */
+static unsigned int change_prefetch_flags(struct apk_database *db, struct apk_change *change)
+{
+	struct apk_package *pkg = change->new_pkg;
+	struct apk_repository *repo;
+	unsigned int flags = 0;
+
+	if (!pkg || !pkg->installed_size) return 0;
+	if (pkg == change->old_pkg && !change->reinstall) return 0;
+	if (!(repo = apk_db_select_repo(db, pkg))) return 0;
+	if (db->ctx->flags & APK_PARALLEL_EXTRACT) flags |= APK_DB_PREFETCH_STAGE;
+	if (repo->is_remote && !(pkg->repos & db->local_repos)) {
+		/* without the download the install would fetch it again */
+		if (!(db->ctx->flags & APK_PREFETCH)) return 0;
+		flags |= APK_DB_PREFETCH_DOWNLOAD;
+	}
+	return flags;
+}
+
 int apk_solver_commit_changeset(struct apk_database *db,
 				struct apk_changeset *changeset,
 				struct apk_dependency_array *world)
 {
 	struct apk_out *out = &db->ctx->out;
 	struct progress prog = { 0 };
+	struct apk_change *prefetch, *prefetch_end;
 	char buf[64];
 	apk_blob_t humanized;
 	uint64_t download_size = 0;
 	int64_t size_diff = 0;
+	unsigned int prefetch_depth = 0;
 	int r, errors = 0, pkg_diff = 0;
 
 	assert(world);
@@ -401,6 +636,10 @@ int apk_solver_commit_changeset(struct apk_database *db,
 		apk_err(out, "Not committing changes due to missing repository tags.");
 		return -1;
 	}
+	if (!(db->ctx->flags & APK_SIMULATE) && apk_db_load_files(db) < 0) {
+		apk_err(out, "Not committing changes due to errors in the installed database.");
+		return -1;
+	}
 
 	if (changeset->changes == NULL)
 		goto all_done;
@@ -478,8 +717,22 @@ int apk_solver_commit_changeset(struct apk_database *db,
 
 	/* Go through changes */
 	db->indent_level = 1;
+	prefetch = changeset->changes->item;
+	prefetch_end = &prefetch[apk_array_len(changeset->changes)];
+	if (db->ctx->flags & APK_SIMULATE)
+		prefetch_depth = 0;
+	else if (db->ctx->flags & APK_PARALLEL_EXTRACT)
+		prefetch_depth = db->ctx->jobs;
+	else if (db->ctx->flags & APK_PREFETCH)
+		prefetch_depth = db->ctx->parallel_downloads ?: 1;
 	apk_progress_start(&prog.prog, out, "install", apk_progress_weight(prog.total.bytes, prog.total.packages));
 	apk_array_foreach(change, changeset->changes) {
+		if (prefetch <= change) prefetch = change + 1;
+		for (; prefetch < prefetch_end && apk_array_len(db->prefetch) < prefetch_depth; prefetch++) {
+			unsigned int flags = change_prefetch_flags(db, prefetch);
+			if (flags) apk_db_prefetch_pkg(db, prefetch->new_pkg, flags);
+		}
+
 		r = change->old_pkg &&
 			(change->old_pkg->ipkg->broken_files ||
 			 change->old_pkg->ipkg->broken_script);
@@ -491,13 +744,17 @@ int apk_solver_commit_changeset(struct apk_database *db,
 					r = apk_db_install_pkg(db, change->old_pkg, change->new_pkg, &prog.prog) != 0;
 				apk_progress_item_end(&prog.prog);
 			}
-			if (change->new_pkg && change->new_pkg->ipkg)
+			if (change->new_pkg && change->new_pkg->ipkg &&
+			    change->new_pkg->ipkg->repository_tag != change->new_repository_tag) {
 				change->new_pkg->ipkg->repository_tag = change->new_repository_tag;
+				change->new_pkg->ipkg->fdb_dirty = 1;
+			}
 		}
 		errors += r;
 		count_change(change, &prog.done);
 	}
 	apk_progress_end(&prog.prog);
+	apk_db_prefetch_cancel(db);
 	db->indent_level = 0;
 
 	errors += db->num_dir_update_errors;
@@ -507,13 +764,14 @@ all_done:
 	apk_dependency_array_copy(&db->world, world);
 	if (apk_db_write_config(db) != 0) errors++;
 	run_commit_hooks(db, POST_COMMIT_HOOK);
+	// The preupgrade commit is synced too, as the main commit may not
+	// complete
+	sync_if_needed(db);
 
 	if (!db->performing_preupgrade) {
 		char buf2[32];
 		const char *msg = "OK:";
 
-		sync_if_needed(db);
-
 		if (errors) msg = apk_fmts(buf2, sizeof buf2, "%d error%s;",
 				errors, errors > 1 ? "s" : "") ?: "ERRORS;";
 
@@ -527,6 +785,7 @@ all_done:
 		humanized = apk_fmt_human_size(buf, sizeof buf, installed_bytes, 1);
 
 		if (apk_out_verbosity(out) > 1) {
+			apk_db_load_files(db);
 			apk_msg(out, "%s %d packages, %d dirs, %d files, " BLOB_FMT,
 				msg,
 				installed_packages,
@@ -893,6 +1152,8 @@ void apk_solver_print_errors(struct apk_database *db,
 	struct apk_out *out = &db->ctx->out;
 	struct print_state ps;
 
+	apk_db_load_rdepends(db);
+
 	/* ERROR: unsatisfiable dependencies:
 	 *   name:
 	 *     required by: a b c d e
@@ -28,6 +28,8 @@ void apk_ctx_init(struct apk_ctx *ac)
 	ac->out.err = stderr;
 	ac->out.verbosity = 1;
 	ac->cache_max_age = 4*60*60; /* 4 hours default */
+	ac->jobs = 1; /* no worker processes forked unless enabled */
+	ac->parallel_downloads = 1;
 	apk_id_cache_init(&ac->id_cache, -1);
 	ac->root_fd = -1;
 	ac->legacy_info = 1;
@@ -18,7 +18,9 @@
 #include <signal.h>
 #include <fnmatch.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #ifdef __linux__
 # include <stdarg.h>
@@ -78,6 +80,7 @@ static const struct apk_hash_ops pkg_name_hash_ops = {
 	.hash_key = apk_blob_hash,
 	.compare = apk_blob_compare,
 	.delete_item = (apk_hash_delete_f) pkg_name_free,
+	.open_addressing = 1,
 };
 
 static apk_blob_t pkg_info_get_key(apk_hash_item item)
@@ -95,10 +98,10 @@ static unsigned long csum_hash(apk_blob_t csum)
 }
 
 static const struct apk_hash_ops pkg_info_hash_ops = {
-	.node_offset = offsetof(struct apk_package, hash_node),
 	.get_key = pkg_info_get_key,
 	.hash_key = csum_hash,
 	.compare = apk_blob_compare,
+	.open_addressing = 1,
 };
 
 static apk_blob_t apk_db_dir_get_key(apk_hash_item item)
@@ -156,6 +159,7 @@ static const struct apk_hash_ops file_hash_ops = {
 	.hash_key = apk_db_file_hash_key,
 	.hash_item = apk_db_file_hash_item,
 	.compare_item = apk_db_file_compare_item,
+	.open_addressing = 1,
 };
 
 struct apk_name *apk_db_query_name(struct apk_database *db, apk_blob_t name)
@@ -163,10 +167,9 @@ struct apk_name *apk_db_query_name(struct apk_database *db, apk_blob_t name)
 	return (struct apk_name *) apk_hash_get(&db->available.names, name);
 }
 
-struct apk_name *apk_db_get_name(struct apk_database *db, apk_blob_t name)
+static struct apk_name *apk_db_get_name_hashed(struct apk_database *db, apk_blob_t name, unsigned long hash)
 {
 	struct apk_name *pn;
-	unsigned long hash = apk_hash_from_key(&db->available.names, name);
 
 	pn = (struct apk_name *) apk_hash_get_hashed(&db->available.names, name, hash);
 	if (pn != NULL)
@@ -182,11 +185,29 @@ struct apk_name *apk_db_get_name(struct apk_database *db, apk_blob_t name)
 	apk_name_array_init(&pn->rdepends);
 	apk_name_array_init(&pn->rinstall_if);
 	apk_hash_insert_hashed(&db->available.names, pn, hash);
+	if (!db->open_complete) apk_name_array_add(&db->repositories.names, pn);
 	db->sorted_names = 0;
 
 	return pn;
 }
 
+struct apk_name *apk_db_get_name(struct apk_database *db, apk_blob_t name)
+{
+	return apk_db_get_name_hashed(db, name, apk_hash_from_key(&db->available.names, name));
+}
+
+/* The names are hashed with apk_blob_hash(), so the hash of the atom
+ * can be used as is */
+struct apk_name *apk_db_get_name_atom(struct apk_database *db, apk_blob_t *name)
+{
+	return apk_db_get_name_hashed(db, *name, apk_atom_hash(name));
+}
+
+struct apk_name *apk_db_query_name_atom(struct apk_database *db, apk_blob_t *name)
+{
+	return (struct apk_name *) apk_hash_get_hashed(&db->available.names, *name, apk_atom_hash(name));
+}
+
 static int cmp_provider(const void *a, const void *b)
 {
 	const struct apk_provider *pa = a, *pb = b;
@@ -296,6 +317,7 @@ struct apk_db_dir *apk_db_dir_ref(struct apk_db_dir *dir)
 struct apk_db_dir *apk_db_dir_query(struct apk_database *db,
 				    apk_blob_t name)
 {
+	apk_db_load_files(db);
 	return (struct apk_db_dir *) apk_hash_get(&db->installed.dirs, name);
 }
 
@@ -429,6 +451,7 @@ struct apk_db_file *apk_db_file_query(struct apk_database *db,
 {
 	struct apk_db_file_hash_key key;
 
+	apk_db_load_files(db);
 	key = (struct apk_db_file_hash_key) {
 		.dirname = apk_blob_trim_end(dir, '/'),
 		.filename = name,
@@ -599,7 +622,7 @@ struct apk_package *apk_db_pkg_add(struct apk_database *db, struct apk_package_t
 		apk_provider_array_add(&idb->name->providers, APK_PROVIDER_FROM_PACKAGE(idb));
 		apk_array_foreach(dep, idb->provides)
 			apk_provider_array_add(&dep->name->providers, APK_PROVIDER_FROM_PROVIDES(idb, dep));
-		if (db->open_complete)
+		if (db->rdepends_loaded)
 			apk_db_pkg_rdepends(db, idb);
 	} else {
 		old_repos = idb->repos;
@@ -607,6 +630,7 @@ struct apk_package *apk_db_pkg_add(struct apk_database *db, struct apk_package_t
 		if (!idb->filename_ndx) idb->filename_ndx = pkg->filename_ndx;
 	}
 	if (idb->repos && !old_repos) {
+		if (!db->open_complete) apk_package_array_add(&db->repositories.packages, idb);
 		pkg->name->has_repository_providers = 1;
 		apk_array_foreach(dep, idb->provides)
 			dep->name->has_repository_providers = 1;
@@ -903,6 +927,99 @@ err:
 	return apk_istream_close(is);
 }
 
+static int apk_db_ipkg_read_field(struct apk_database *db, struct apk_installed_package *ipkg, int field, apk_blob_t *l)
+{
+	int i;
+
+	switch (field) {
+	case 'g':
+		apk_blob_foreach_word(tag, *l)
+			apk_blobptr_array_add(&ipkg->pkg->tags, apk_atomize_dup(&db->atoms, tag));
+		break;
+	case 'r':
+		apk_blob_pull_deps(l, db, &ipkg->replaces, false);
+		break;
+	case 'q':
+		ipkg->replaces_priority = apk_blob_pull_uint(l, 10);
+		break;
+	case 's':
+		ipkg->repository_tag = apk_db_get_tag_id(db, *l);
+		break;
+	case 'f':
+		for (i = 0; i < l->len; i++) {
+			switch (l->ptr[i]) {
+			case 'f': ipkg->broken_files = 1; break;
+			case 's': ipkg->broken_script = 1; break;
+			case 'x': ipkg->broken_xattr = 1; break;
+			case 'S': ipkg->sha256_160 = 1; break;
+			default:
+				if (!(db->ctx->force & APK_FORCE_OLD_APK))
+					return -APKE_FORMAT_NOT_SUPPORTED;
+			}
+		}
+		break;
+	default:
+		return -APKE_FORMAT_NOT_SUPPORTED;
+	}
+	return 0;
+}
+
+/* Parses a directory or file entry of the installed database. Returns zero if
+ * the entry was handled, a positive value if the field is not a directory or
+ * file entry, and a negative value if the entry is invalid. */
+static int apk_db_fdb_read_file_entry(struct apk_database *db, struct apk_package *pkg, int field, apk_blob_t l,
+				      struct apk_db_dir_instance **diri, struct apk_db_file **file)
+{
+	struct apk_db_acl *acl;
+	struct apk_digest file_digest, xattr_digest;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+
+	switch (field) {
+	case 'F':
+		if (pkg->name == NULL) return -1;
+		if (*diri) apk_db_dir_apply_diri_permissions(db, *diri);
+		*diri = apk_db_diri_get(db, l, pkg);
+		break;
+	case 'a':
+		if (*file == NULL) return -1;
+	case 'M':
+		if (*diri == NULL) return -1;
+		uid = apk_blob_pull_uint(&l, 10);
+		apk_blob_pull_char(&l, ':');
+		gid = apk_blob_pull_uint(&l, 10);
+		apk_blob_pull_char(&l, ':');
+		mode = apk_blob_pull_uint(&l, 8);
+		if (apk_blob_pull_blob_match(&l, APK_BLOB_STR(":")))
+			apk_blob_pull_digest(&l, &xattr_digest);
+		else
+			apk_digest_reset(&xattr_digest);
+
+		acl = apk_db_acl_atomize_digest(db, mode, uid, gid, &xattr_digest);
+		if (field == 'M')
+			(*diri)->acl = acl;
+		else
+			(*file)->acl = acl;
+		break;
+	case 'R':
+		if (*diri == NULL) return -1;
+		*file = apk_db_file_get(db, *diri, l);
+		break;
+	case 'Z':
+		if (*file == NULL) return -1;
+		apk_blob_pull_digest(&l, &file_digest);
+		if (file_digest.alg == APK_DIGEST_SHA1 && pkg->ipkg->sha256_160)
+			apk_digest_set(&file_digest, APK_DIGEST_SHA256_160);
+		apk_dbf_digest_set(*file, file_digest.alg, file_digest.data);
+		break;
+	default:
+		return 1;
+	}
+	if (APK_BLOB_IS_NULL(l)) return -1;
+	return 0;
+}
+
 static int apk_db_fdb_read(struct apk_database *db, struct apk_istream *is, int repo, unsigned layer)
 {
 	struct apk_out *out = &db->ctx->out;
@@ -910,12 +1027,7 @@ static int apk_db_fdb_read(struct apk_database *db, struct apk_istream *is, int
 	struct apk_installed_package *ipkg = NULL;
 	struct apk_db_dir_instance *diri = NULL;
 	struct apk_db_file *file = NULL;
-	struct apk_db_acl *acl;
-	struct apk_digest file_digest, xattr_digest;
 	apk_blob_t token = APK_BLOB_STR("\n"), l;
-	mode_t mode;
-	uid_t uid;
-	gid_t gid;
 	int field, r, lineno = 0;
 
 	if (IS_ERR(is)) return PTR_ERR(is);
@@ -966,77 +1078,17 @@ static int apk_db_fdb_read(struct apk_database *db, struct apk_istream *is, int
 		if (repo != APK_REPO_DB_INSTALLED || ipkg == NULL) continue;
 
 		/* Check FDB special entries */
-		switch (field) {
-		case 'g':
-			apk_blob_foreach_word(tag, l)
-				apk_blobptr_array_add(&tmpl.pkg.tags, apk_atomize_dup(&db->atoms, tag));
-			break;
-		case 'F':
-			if (tmpl.pkg.name == NULL) goto bad_entry;
-			if (diri) apk_db_dir_apply_diri_permissions(db, diri);
-			diri = apk_db_diri_get(db, l, &tmpl.pkg);
-			break;
-		case 'a':
-			if (file == NULL) goto bad_entry;
-		case 'M':
-			if (diri == NULL) goto bad_entry;
-			uid = apk_blob_pull_uint(&l, 10);
-			apk_blob_pull_char(&l, ':');
-			gid = apk_blob_pull_uint(&l, 10);
-			apk_blob_pull_char(&l, ':');
-			mode = apk_blob_pull_uint(&l, 8);
-			if (apk_blob_pull_blob_match(&l, APK_BLOB_STR(":")))
-				apk_blob_pull_digest(&l, &xattr_digest);
-			else
-				apk_digest_reset(&xattr_digest);
-
-			acl = apk_db_acl_atomize_digest(db, mode, uid, gid, &xattr_digest);
-			if (field == 'M')
-				diri->acl = acl;
-			else
-				file->acl = acl;
-			break;
-		case 'R':
-			if (diri == NULL) goto bad_entry;
-			file = apk_db_file_get(db, diri, l);
-			break;
-		case 'Z':
-			if (file == NULL) goto bad_entry;
-			apk_blob_pull_digest(&l, &file_digest);
-			if (file_digest.alg == APK_DIGEST_SHA1 && ipkg->sha256_160)
-				apk_digest_set(&file_digest, APK_DIGEST_SHA256_160);
-			apk_dbf_digest_set(file, file_digest.alg, file_digest.data);
-			break;
-		case 'r':
-			apk_blob_pull_deps(&l, db, &ipkg->replaces, false);
-			break;
-		case 'q':
-			ipkg->replaces_priority = apk_blob_pull_uint(&l, 10);
-			break;
-		case 's':
-			ipkg->repository_tag = apk_db_get_tag_id(db, l);
-			break;
-		case 'f':
-			for (r = 0; r < l.len; r++) {
-				switch (l.ptr[r]) {
-				case 'f': ipkg->broken_files = 1; break;
-				case 's': ipkg->broken_script = 1; break;
-				case 'x': ipkg->broken_xattr = 1; break;
-				case 'S': ipkg->sha256_160 = 1; break;
-				default:
-					if (!(db->ctx->force & APK_FORCE_OLD_APK))
-						goto old_apk_tools;
-				}
-			}
-			break;
-		default:
-			if (r != 0 && !(db->ctx->force & APK_FORCE_OLD_APK))
-				goto old_apk_tools;
-			/* Installed. So mark the package as installable. */
-			tmpl.pkg.filename_ndx = 0;
+		r = apk_db_fdb_read_file_entry(db, &tmpl.pkg, field, l, &diri, &file);
+		if (r < 0) goto bad_entry;
+		if (r == 0) continue;
+		if (apk_db_ipkg_read_field(db, ipkg, field, &l) == 0) {
+			if (APK_BLOB_IS_NULL(l)) goto bad_entry;
 			continue;
 		}
-		if (APK_BLOB_IS_NULL(l)) goto bad_entry;
+		if (!(db->ctx->force & APK_FORCE_OLD_APK))
+			goto old_apk_tools;
+		/* Installed. So mark the package as installable. */
+		tmpl.pkg.filename_ndx = 0;
 	}
 	if (is->err < 0) goto err_fmt;
 	goto done;
@@ -1054,6 +1106,21 @@ done:
 	return apk_istream_close(is);
 }
 
+/* Loads the directory and file entries of an installed package */
+static int apk_db_fdb_read_files(struct apk_database *db, apk_blob_t b, struct apk_package *pkg)
+{
+	struct apk_db_dir_instance *diri = NULL;
+	struct apk_db_file *file = NULL;
+
+	apk_blob_foreach_token(l, b, APK_BLOB_STRLIT("\n")) {
+		if (l.len < 2 || l.ptr[1] != ':') return -APKE_V2DB_FORMAT;
+		if (apk_db_fdb_read_file_entry(db, pkg, l.ptr[0], APK_BLOB_PTR_LEN(l.ptr + 2, l.len - 2), &diri, &file) != 0)
+			return -APKE_V2DB_FORMAT;
+	}
+	if (diri) apk_db_dir_apply_diri_permissions(db, diri);
+	return 0;
+}
+
 int apk_db_index_read(struct apk_database *db, struct apk_istream *is, int repo)
 {
 	return apk_db_fdb_read(db, is, repo, APK_DB_LAYER_ROOT);
@@ -1090,20 +1157,18 @@ err:
 	return apk_ostream_error(os);
 }
 
-static int apk_db_fdb_write(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_ostream *os)
+static int apk_db_fdb_write_header(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_ostream *os)
 {
 	struct apk_package *pkg = ipkg->pkg;
 	char buf[1024+PATH_MAX];
 	apk_blob_t bbuf = APK_BLOB_BUF(buf);
-	int r = 0;
-
-	if (IS_ERR(os)) return PTR_ERR(os);
+	int r;
 
 	r = apk_pkg_write_index_header(pkg, os);
-	if (r < 0) goto err;
+	if (r < 0) return r;
 
 	r = write_blobs(os, "g:", pkg->tags);
-	if (r < 0) goto err;
+	if (r < 0) return r;
 
 	if (apk_array_len(ipkg->replaces) != 0) {
 		apk_blob_push_blob(&bbuf, APK_BLOB_STR("r:"));
@@ -1132,6 +1197,22 @@ static int apk_db_fdb_write(struct apk_database *db, struct apk_installed_packag
 			apk_blob_push_blob(&bbuf, APK_BLOB_STR("S"));
 		apk_blob_push_blob(&bbuf, APK_BLOB_STR("\n"));
 	}
+	bbuf = apk_blob_pushed(APK_BLOB_BUF(buf), bbuf);
+	if (APK_BLOB_IS_NULL(bbuf)) return -ENOBUFS;
+	return apk_ostream_write(os, bbuf.ptr, bbuf.len);
+}
+
+static int apk_db_fdb_write(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_ostream *os)
+{
+	char buf[1024+PATH_MAX];
+	apk_blob_t bbuf = APK_BLOB_BUF(buf);
+	int r = 0;
+
+	if (IS_ERR(os)) return PTR_ERR(os);
+
+	r = apk_db_fdb_write_header(db, ipkg, os);
+	if (r < 0) goto err;
+
 	apk_array_foreach_item(diri, ipkg->diris) {
 		apk_blob_push_blob(&bbuf, APK_BLOB_STR("F:"));
 		apk_blob_push_blob(&bbuf, APK_BLOB_PTR_LEN(diri->dir->name, diri->dir->namelen));
@@ -1179,194 +1260,1085 @@ err:
 	return r;
 }
 
-static int apk_db_scriptdb_write(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_ostream *os)
-{
-	struct apk_package *pkg = ipkg->pkg;
-	struct apk_file_info fi;
-	char filename[256];
-	apk_blob_t bfn;
-	int r, i;
+/* The installed database journal records the changes made to the installed
+ * database since it was last written in full. It consists of entries in the
+ * installed database format. An entry replaces any earlier entry of the same
+ * package, and an entry with only the C: line removes the package. The
+ * journal is replayed over the installed database when it is opened. It is
+ * merged into the installed database when it grows large compared to it, or
+ * when a commit is done with journaling disabled.
+ *
+ * The journal starts with a J: header entry identifying the installed
+ * database it was started on by its size, inode and modification time. A
+ * journal left behind from an earlier installed database is ignored. */
+#define APK_DB_JOURNAL_FILE		"installed.journal"
 
-	if (IS_ERR(os)) return PTR_ERR(os);
+static apk_blob_t apk_db_journal_header(apk_blob_t buf, struct stat *st)
+{
+	apk_blob_t b = buf;
 
-	for (i = 0; i < APK_SCRIPT_MAX; i++) {
-		if (!ipkg->script[i].ptr) continue;
+	apk_blob_push_blob(&b, APK_BLOB_STRLIT("J:"));
+	apk_blob_push_uint(&b, st->st_size, 10);
+	apk_blob_push_blob(&b, APK_BLOB_STRLIT(":"));
+	apk_blob_push_uint(&b, st->st_ino, 10);
+	apk_blob_push_blob(&b, APK_BLOB_STRLIT(":"));
+	apk_blob_push_uint(&b, st->st_mtim.tv_sec, 10);
+	apk_blob_push_blob(&b, APK_BLOB_STRLIT("."));
+	apk_blob_push_uint(&b, st->st_mtim.tv_nsec, 10);
+	apk_blob_push_blob(&b, APK_BLOB_STRLIT("\n\n"));
+	return apk_blob_pushed(buf, b);
+}
 
-		fi = (struct apk_file_info) {
-			.name = filename,
-			.size = ipkg->script[i].len,
-			.mode = 0755 | S_IFREG,
-			.mtime = pkg->build_time,
-		};
-		/* The scripts db expects file names in format:
-		 * pkg-version.<hexdump of package checksum>.action */
-		bfn = APK_BLOB_BUF(filename);
-		apk_blob_push_blob(&bfn, APK_BLOB_STR(pkg->name->name));
-		apk_blob_push_blob(&bfn, APK_BLOB_STR("-"));
-		apk_blob_push_blob(&bfn, *pkg->version);
-		apk_blob_push_blob(&bfn, APK_BLOB_STR("."));
-		apk_blob_push_hash_hex(&bfn, apk_pkg_hash_blob(pkg));
-		apk_blob_push_blob(&bfn, APK_BLOB_STR("."));
-		apk_blob_push_blob(&bfn, APK_BLOB_STR(apk_script_types[i]));
-		apk_blob_push_blob(&bfn, APK_BLOB_PTR_LEN("", 1));
+static bool apk_db_record_id(apk_blob_t b, struct apk_digest *id)
+{
+	apk_blob_t l;
 
-		r = apk_tar_write_entry(os, &fi, ipkg->script[i].ptr);
-		if (r < 0) {
-			apk_ostream_cancel(os, -APKE_V2DB_FORMAT);
-			break;
+	while (b.len && b.ptr[0] == '\n') b.ptr++, b.len--;
+	for (;;) {
+		if (!apk_blob_split(b, APK_BLOB_STRLIT("\n"), &l, &b)) {
+			l = b;
+			b = APK_BLOB_PTR_LEN(b.ptr + b.len, 0);
+		}
+		if (l.len == 0) return false;
+		if (l.len > 2 && l.ptr[0] == 'C' && l.ptr[1] == ':') {
+			l.ptr += 2;
+			l.len -= 2;
+			apk_blob_pull_digest(&l, id);
+			return id->alg != APK_DIGEST_NONE;
 		}
 	}
+}
 
-	return r;
+static int journal_entry_id_cmp(const void *p1, const void *p2)
+{
+	const struct apk_db_journal_entry *e1 = p1, *e2 = p2;
+	if (e1->id.alg != e2->id.alg) return (int)e1->id.alg - (int)e2->id.alg;
+	return memcmp(e1->id.data, e2->id.data, e1->id.len);
 }
 
-static int apk_read_script_archive_entry(void *ctx,
-					 const struct apk_file_info *ae,
-					 struct apk_istream *is)
+static int journal_entry_sort_cmp(const void *p1, const void *p2)
 {
-	struct apk_database *db = (struct apk_database *) ctx;
-	struct apk_package *pkg;
-	char *fncsum, *fnaction;
-	struct apk_digest digest;
-	apk_blob_t blob;
-	int type;
+	const struct apk_db_journal_entry *e1 = p1, *e2 = p2;
+	return journal_entry_id_cmp(p1, p2) ?: (e1->record.ptr > e2->record.ptr) - (e1->record.ptr < e2->record.ptr);
+}
 
-	if (!S_ISREG(ae->mode))
-		return 0;
+static int journal_entry_order_cmp(const void *p1, const void *p2)
+{
+	const struct apk_db_journal_entry *e1 = p1, *e2 = p2;
+	return (e1->record.ptr > e2->record.ptr) - (e1->record.ptr < e2->record.ptr);
+}
 
-	/* The scripts db expects file names in format:
-	 * pkgname-version.<hexdump of package checksum>.action */
-	fnaction = memrchr(ae->name, '.', strlen(ae->name));
-	if (fnaction == NULL || fnaction == ae->name)
-		return 0;
-	fncsum = memrchr(ae->name, '.', fnaction - ae->name - 1);
-	if (fncsum == NULL)
-		return 0;
-	fnaction++;
-	fncsum++;
+/* Checks if the journal has an entry for the package of database entry b */
+static bool apk_db_journal_replaces(struct apk_db_journal *j, apk_blob_t b)
+{
+	struct apk_db_journal_entry key;
 
-	/* Parse it */
-	type = apk_script_type(fnaction);
-	if (type == APK_SCRIPT_INVALID)
+	if (apk_array_len(j->entries) == 0) return false;
+	if (!apk_db_record_id(b, &key.id)) return false;
+	return bsearch(&key, j->entries->item, apk_array_len(j->entries),
+		       apk_array_item_size(j->entries), journal_entry_id_cmp) != NULL;
+}
+
+/* Reads the journal, and indexes the latest entry of each package */
+static int apk_db_journal_read(struct apk_database *db, int fd, unsigned layer)
+{
+	struct apk_db_journal *j = &db->installed.journal[layer];
+	struct apk_db_journal_entry e;
+	struct stat st;
+	char buf[128];
+	apk_blob_t b, rec, hdr = APK_BLOB_NULL;
+	int i, n, r;
+
+	if (fstatat(fd, "installed", &st, 0) == 0) {
+		j->base_size = st.st_size;
+		hdr = apk_db_journal_header(APK_BLOB_BUF(buf), &st);
+	}
+	r = apk_blob_from_file(fd, APK_DB_JOURNAL_FILE, &j->data);
+	if (r == -ENOENT) return 0;
+	if (r < 0) return r;
+	if (j->data.len == 0) return 0;
+
+	/* A journal of another installed database is ignored, and merged
+	 * away on next commit */
+	if (APK_BLOB_IS_NULL(hdr) || !apk_blob_starts_with(j->data, hdr)) {
+		apk_warn(&db->ctx->out, "%s: not written for the current installed database, ignoring",
+			APK_DB_JOURNAL_FILE);
+		j->size = -1;
 		return 0;
-	blob = APK_BLOB_PTR_PTR(fncsum, fnaction - 2);
-	apk_blob_pull_digest(&blob, &digest);
+	}
 
-	/* Attach script */
-	pkg = apk_db_get_pkg(db, &digest);
-	if (pkg != NULL && pkg->ipkg != NULL)
-		apk_ipkg_add_script(pkg->ipkg, is, type, ae->size);
+	/* A partially written entry at the end is ignored, and the journal
+	 * is merged on next commit */
+	b = APK_BLOB_PTR_LEN(j->data.ptr + hdr.len, j->data.len - hdr.len);
+	while (apk_blob_split(b, APK_BLOB_STRLIT("\n\n"), &rec, &b)) {
+		if (!apk_db_record_id(rec, &e.id)) return -APKE_V2DB_FORMAT;
+		e.record = APK_BLOB_PTR_LEN(rec.ptr, rec.len + 2);
+		apk_db_journal_entry_array_add(&j->entries, e);
+	}
+	j->size = b.ptr - j->data.ptr;
 
+	apk_array_qsort(j->entries, journal_entry_sort_cmp);
+	for (i = n = 0; i < apk_array_len(j->entries); i++) {
+		if (i + 1 < apk_array_len(j->entries) &&
+		    journal_entry_id_cmp(&j->entries->item[i], &j->entries->item[i+1]) == 0)
+			continue;
+		j->entries->item[n++] = j->entries->item[i];
+	}
+	apk_array_truncate(j->entries, n);
 	return 0;
 }
 
-static int apk_db_triggers_write(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_ostream *os)
+/* Adds the packages from the journal in the order they were committed. The
+ * file entries are queued to be loaded after the installed database ones. */
+static int apk_db_journal_replay(struct apk_database *db, unsigned layer)
 {
-	char buf[APK_BLOB_DIGEST_BUF];
-	apk_blob_t bfn;
+	struct apk_db_journal *j = &db->installed.journal[layer];
+	struct apk_istream is;
+	struct apk_package *pkg;
+	struct apk_digest digest;
+	apk_blob_t header, files;
+	char *buf;
+	int r = 0;
 
-	if (IS_ERR(os)) return PTR_ERR(os);
-	if (apk_array_len(ipkg->triggers) == 0) return 0;
+	apk_array_qsort(j->entries, journal_entry_order_cmp);
+	apk_array_foreach(e, j->entries) {
+		if (apk_blob_chr(e->record, '\n') == e->record.ptr + e->record.len - 2) continue;
 
-	bfn = APK_BLOB_BUF(buf);
-	apk_blob_push_hash(&bfn, apk_pkg_hash_blob(ipkg->pkg));
-	bfn = apk_blob_pushed(APK_BLOB_BUF(buf), bfn);
-	apk_ostream_write(os, bfn.ptr, bfn.len);
+		if (apk_blob_split(e->record, APK_BLOB_STRLIT("\nF:"), &header, &files)) {
+			header.len++;
+			files.ptr -= 2;
+			files.len += 2;
+		} else {
+			header = e->record;
+			files = APK_BLOB_NULL;
+		}
 
-	apk_array_foreach_item(trigger, ipkg->triggers) {
-		apk_ostream_write(os, " ", 1);
-		apk_ostream_write_string(os, trigger);
+		/* Terminate the header part with an empty line */
+		buf = malloc(header.len + 1);
+		if (!buf) return -ENOMEM;
+		memcpy(buf, header.ptr, header.len);
+		buf[header.len] = '\n';
+		r = apk_db_fdb_read(db, apk_istream_from_blob(&is, APK_BLOB_PTR_LEN(buf, header.len + 1)), APK_REPO_DB_INSTALLED, layer);
+		free(buf);
+		if (r < 0) return r;
+
+		pkg = apk_db_get_pkg(db, &e->id);
+		if (!pkg || !pkg->ipkg) return -APKE_V2DB_FORMAT;
+		apk_digest_calc(&digest, APK_DIGEST_SHA1, e->record.ptr, e->record.len);
+		memcpy(pkg->ipkg->fdb_digest, digest.data, sizeof pkg->ipkg->fdb_digest);
+		pkg->ipkg->fdb_dirty = 0;
+		if (!APK_BLOB_IS_NULL(files)) {
+			apk_db_lazy_files_array_add(&db->installed.lazy_files, (struct apk_db_lazy_files) {
+				.pkg = pkg,
+				.files = files,
+				.text = true,
+			});
+		}
 	}
-	apk_ostream_write(os, "\n", 1);
 	return 0;
 }
 
-static void apk_db_pkg_add_triggers(struct apk_database *db, struct apk_installed_package *ipkg, apk_blob_t triggers)
+static void apk_db_journal_set_packages(struct apk_database *db, unsigned layer)
 {
-	apk_blob_foreach_word(word, triggers)
-		apk_string_array_add(&ipkg->triggers, apk_blob_cstr(word));
+	struct apk_db_journal *j = &db->installed.journal[layer];
+	struct apk_installed_package *ipkg;
 
-	if (apk_array_len(ipkg->triggers) != 0 &&
-	    !list_hashed(&ipkg->trigger_pkgs_list))
-		list_add_tail(&ipkg->trigger_pkgs_list,
-			      &db->installed.triggers);
+	apk_array_truncate(j->packages, 0);
+	list_for_each_entry(ipkg, &db->installed.packages, installed_pkgs_list)
+		if (ipkg->pkg->layer == layer) apk_package_array_add(&j->packages, ipkg->pkg);
 }
 
-static int apk_db_add_trigger(struct apk_database *db, apk_blob_t l)
+static int apk_db_journal_write_removed(struct apk_database *db, unsigned layer, struct apk_ostream *os)
 {
-	struct apk_digest digest;
-	struct apk_package *pkg;
+	struct apk_db_journal *j = &db->installed.journal[layer];
+	char buf[APK_BLOB_DIGEST_BUF + 4];
+	apk_blob_t b;
 
-	apk_blob_pull_digest(&l, &digest);
-	apk_blob_pull_char(&l, ' ');
-	pkg = apk_db_get_pkg(db, &digest);
-	if (pkg && pkg->ipkg) apk_db_pkg_add_triggers(db, pkg->ipkg, l);
-	return 0;
+	apk_array_foreach_item(pkg, j->packages) {
+		if (pkg->ipkg && pkg->layer == layer) continue;
+		b = APK_BLOB_BUF(buf);
+		apk_blob_push_blob(&b, APK_BLOB_STRLIT("C:"));
+		apk_blob_push_hash(&b, apk_pkg_hash_blob(pkg));
+		apk_blob_push_blob(&b, APK_BLOB_STRLIT("\n\n"));
+		b = apk_blob_pushed(APK_BLOB_BUF(buf), b);
+		if (APK_BLOB_IS_NULL(b)) return apk_ostream_cancel(os, -ENOBUFS);
+		apk_ostream_write_blob(os, b);
+	}
+	return apk_ostream_error(os);
 }
 
-static int apk_db_read_layer(struct apk_database *db, unsigned layer)
+/* Checks that the journal can be appended to: it needs to end with a
+ * complete entry, and to not have grown too large */
+static bool apk_db_journal_appendable(struct apk_database *db, int fd, unsigned layer, uint64_t size)
 {
-	apk_blob_t blob, world;
-	int r, fd, ret = 0, flags = db->ctx->open_flags;
-
-	/* Read:
-	 * 1. world
-	 * 2. installed packages db
-	 * 3. triggers db
-	 * 4. scripts db
-	 */
-
-	fd = openat(db->root_fd, apk_db_layer_name(layer), O_RDONLY | O_CLOEXEC);
-	if (fd < 0) return -errno;
-
-	if (!(flags & APK_OPENF_NO_WORLD)) {
-		if (layer == APK_DB_LAYER_ROOT)
-			ret = apk_blob_from_file(db->root_fd, apk_world_file, &world);
-		else
-			ret = apk_blob_from_file(fd, "world", &world);
+	struct apk_db_journal *j = &db->installed.journal[layer];
+	struct stat st;
 
-		if (!ret) {
-			blob = apk_blob_trim(world);
-			ret = apk_blob_pull_deps(&blob, db, &db->world, true);
-			free(world.ptr);
-		} else if (layer == APK_DB_LAYER_ROOT) {
-			ret = -ENOENT;
-		}
+	if (fstatat(fd, APK_DB_JOURNAL_FILE, &st, 0) < 0) {
+		if (errno != ENOENT) return false;
+		st.st_size = 0;
 	}
+	if (st.st_size != j->size) return false;
+	return j->size + size <= j->base_size / 4;
+}
 
-	if (!(flags & APK_OPENF_NO_INSTALLED)) {
-		r = apk_db_fdb_read(db, apk_istream_from_file(fd, "installed"), APK_REPO_DB_INSTALLED, layer);
-		if (!ret && r != -ENOENT) ret = r;
-		r = apk_db_parse_istream(db, apk_istream_from_file(fd, "triggers"), apk_db_add_trigger);
-		if (!ret && r != -ENOENT) ret = r;
+/* Opens the journal for appending, and starts a new journal with the header.
+ * The writes are synchronous so that the entries are on disk when the commit
+ * completes, like the installed database written with rename would be. */
+static struct apk_ostream *apk_db_journal_append(struct apk_database *db, int fd, unsigned layer)
+{
+	struct apk_db_journal *j = &db->installed.journal[layer];
+	struct apk_ostream *os;
+	struct stat st;
+	char buf[128];
+	int jfd;
+
+	if (j->size == 0 && fstatat(fd, "installed", &st, 0) < 0) return ERR_PTR(-errno);
+	jfd = openat(fd, APK_DB_JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT | O_DSYNC | O_CLOEXEC, 0644);
+	if (jfd < 0) return ERR_PTR(-errno);
+	os = apk_ostream_to_fd(jfd);
+	if (j->size == 0 && !IS_ERR(os)) {
+		fsync(fd);
+		apk_ostream_write_blob(os, apk_db_journal_header(APK_BLOB_BUF(buf), &st));
 	}
+	return os;
+}
 
-	if (!(flags & APK_OPENF_NO_SCRIPTS)) {
-		struct apk_istream *is = apk_istream_from_file(fd, "scripts.tar");
-		if (!IS_ERR(is) || PTR_ERR(is) != -ENOENT) db->scripts_tar = 1;
-		else is = apk_istream_gunzip(apk_istream_from_file(fd, "scripts.tar.gz"));
+static int apk_db_fdb_digest(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_digest_ctx *dctx,
+			     uint8_t *digest, uint64_t *size)
+{
+	struct apk_digest_ostream dos;
+	struct apk_digest d;
+	int r;
 
-		r = apk_tar_parse(is, apk_read_script_archive_entry, db, db->id_cache);
-		if (!ret && r != -ENOENT) ret = r;
-	}
+	apk_digest_ctx_reset(dctx);
+	r = apk_db_fdb_write(db, ipkg, apk_ostream_digest(&dos, dctx));
+	if (r < 0) return r;
+	r = apk_digest_ctx_final(dctx, &d);
+	if (r < 0) return r;
+	memcpy(digest, d.data, APK_DIGEST_LENGTH_SHA1);
+	*size = dos.size;
+	return 0;
+}
 
-	close(fd);
-	return ret;
+/* The installed database snapshot is a host local binary copy of the text
+ * installed database. It is written along with the text database, and used
+ * only as long as the text database is the exact file it was created with.
+ * Values are in native byte order. After the header each package is stored
+ * as its index header lines terminated by an empty line, followed by:
+ *   the SHA-1 of the package's text database entry,
+ *   uint32_t num_diris, and for each directory instance:
+ *     struct apk_db_snapshot_diri, [acl], name, and for each file:
+ *       struct apk_db_snapshot_file, [acl], name, digest
+ * An acl index of zero refers to the default acl, and an index one above
+ * the highest seen so far in the package is followed by the acl definition,
+ * so that each package can be loaded independently. The file ends with the
+ * magic value. The header also has the number of directory instances and
+ * files, to size the allocator for them before they are loaded. */
+#define APK_DB_SNAPSHOT_FILE		"installed.snapshot"
+#define APK_DB_SNAPSHOT_MAGIC		0x70616e73	// snap
+#define APK_DB_SNAPSHOT_VERSION		3
+
+struct apk_db_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t installed_size;
+	uint64_t installed_ino;
+	int64_t installed_mtime_sec;
+	int64_t installed_mtime_nsec;
+	uint32_t num_packages;
+	uint32_t num_diris;
+	uint64_t num_files;
+};
+
+struct apk_db_snapshot_acl {
+	uint32_t mode, uid, gid;
+	uint8_t xattr_hash_len;
+} __attribute__((packed));
+
+struct apk_db_snapshot_diri {
+	uint32_t acl;
+	uint32_t num_files;
+	uint16_t namelen;
+} __attribute__((packed));
+
+struct apk_db_snapshot_file {
+	uint32_t acl;
+	uint8_t namelen;
+	uint8_t digest_alg;
+} __attribute__((packed));
+
+APK_ARRAY(apk_db_acl_array, struct apk_db_acl *);
+
+static void apk_db_snapshot_header_init(struct apk_db_snapshot_header *hdr, struct stat *st)
+{
+	*hdr = (struct apk_db_snapshot_header) {
+		.magic = APK_DB_SNAPSHOT_MAGIC,
+		.version = APK_DB_SNAPSHOT_VERSION,
+		.installed_size = st->st_size,
+		.installed_ino = st->st_ino,
+		.installed_mtime_sec = st->st_mtim.tv_sec,
+		.installed_mtime_nsec = st->st_mtim.tv_nsec,
+	};
 }
 
-static int apk_db_index_write_nr_cache(struct apk_database *db)
+static uint32_t apk_db_snapshot_push_acl(apk_blob_t *b, struct apk_db_acl_array **acls, struct apk_db_acl *acl, struct apk_db_acl *default_acl)
 {
-	struct apk_ostream *os = NULL;
+	struct apk_db_snapshot_acl sacl;
 
-	if (apk_db_permanent(db) || !apk_db_cache_active(db)) return 0;
+	if (acl == default_acl) return 0;
+	for (int i = 0; i < apk_array_len(*acls); i++)
+		if ((*acls)->item[i] == acl) return i + 1;
+	apk_db_acl_array_add(acls, acl);
 
-	/* Write list of installed non-repository packages to
-	 * cached index file */
-	struct apk_package_array *pkgs = apk_db_sorted_installed_packages(db);
-	apk_array_foreach_item(pkg, pkgs) {
-		if (apk_db_pkg_available(db, pkg)) continue;
-		if (pkg->cached || pkg->filename_ndx || !pkg->installed_size) {
-			if (!os) {
+	sacl = (struct apk_db_snapshot_acl) {
+		.mode = acl->mode,
+		.uid = acl->uid,
+		.gid = acl->gid,
+		.xattr_hash_len = acl->xattr_hash_len,
+	};
+	apk_blob_push_blob(b, APK_BLOB_STRUCT(sacl));
+	apk_blob_push_blob(b, apk_acl_digest_blob(acl));
+	return apk_array_len(*acls);
+}
+
+static int apk_db_snapshot_write_pkg(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_ostream *os, struct apk_db_acl_array **acls)
+{
+	char buf[1024+PATH_MAX];
+	apk_blob_t bbuf;
+	uint32_t num_diris = apk_array_len(ipkg->diris);
+	int r;
+
+	apk_array_truncate(*acls, 0);
+	r = apk_db_fdb_write_header(db, ipkg, os);
+	if (r < 0) return r;
+	apk_ostream_write(os, "\n", 1);
+	apk_ostream_write(os, ipkg->fdb_digest, sizeof ipkg->fdb_digest);
+	apk_ostream_write(os, &num_diris, sizeof num_diris);
+
+	apk_array_foreach_item(diri, ipkg->diris) {
+		struct apk_db_snapshot_diri sdiri = {
+			.num_files = apk_array_len(diri->files),
+			.namelen = diri->dir->namelen,
+		};
+		char acldef[sizeof(struct apk_db_snapshot_acl) + APK_DIGEST_LENGTH_MAX];
+		apk_blob_t abuf = APK_BLOB_BUF(acldef);
+
+		sdiri.acl = apk_db_snapshot_push_acl(&abuf, acls, diri->acl, apk_default_acl_dir);
+		bbuf = APK_BLOB_BUF(buf);
+		apk_blob_push_blob(&bbuf, APK_BLOB_STRUCT(sdiri));
+		apk_blob_push_blob(&bbuf, apk_blob_pushed(APK_BLOB_BUF(acldef), abuf));
+		apk_blob_push_blob(&bbuf, APK_BLOB_PTR_LEN(diri->dir->name, diri->dir->namelen));
+
+		apk_array_foreach_item(file, diri->files) {
+			struct apk_db_snapshot_file sfile = {
+				.namelen = file->namelen,
+				.digest_alg = file->digest_alg,
+			};
+
+			abuf = APK_BLOB_BUF(acldef);
+			sfile.acl = apk_db_snapshot_push_acl(&abuf, acls, file->acl, apk_default_acl_file);
+			apk_blob_push_blob(&bbuf, APK_BLOB_STRUCT(sfile));
+			apk_blob_push_blob(&bbuf, apk_blob_pushed(APK_BLOB_BUF(acldef), abuf));
+			apk_blob_push_blob(&bbuf, APK_BLOB_PTR_LEN(file->name, file->namelen));
+			apk_blob_push_blob(&bbuf, apk_dbf_digest_blob(file));
+
+			bbuf = apk_blob_pushed(APK_BLOB_BUF(buf), bbuf);
+			if (APK_BLOB_IS_NULL(bbuf)) return -ENOBUFS;
+			r = apk_ostream_write(os, bbuf.ptr, bbuf.len);
+			if (r < 0) return r;
+			bbuf = APK_BLOB_BUF(buf);
+		}
+
+		bbuf = apk_blob_pushed(APK_BLOB_BUF(buf), bbuf);
+		if (APK_BLOB_IS_NULL(bbuf)) return -ENOBUFS;
+		r = apk_ostream_write(os, bbuf.ptr, bbuf.len);
+		if (r < 0) return r;
+	}
+	return apk_ostream_error(os);
+}
+
+static int apk_db_snapshot_write(struct apk_database *db, int fd, unsigned layer, struct apk_package_array *pkgs)
+{
+	struct apk_db_snapshot_header hdr;
+	struct apk_db_acl_array *acls;
+	struct apk_ostream *os;
+	struct stat st;
+	uint32_t magic = APK_DB_SNAPSHOT_MAGIC;
+	int r = 0;
+
+	if (fstatat(fd, "installed", &st, 0) < 0) return -errno;
+	apk_db_snapshot_header_init(&hdr, &st);
+	apk_array_foreach_item(pkg, pkgs) {
+		if (pkg->layer != layer) continue;
+		hdr.num_packages++;
+		hdr.num_diris += apk_array_len(pkg->ipkg->diris);
+		apk_array_foreach_item(diri, pkg->ipkg->diris)
+			hdr.num_files += apk_array_len(diri->files);
+	}
+
+	os = apk_ostream_to_file(fd, APK_DB_SNAPSHOT_FILE, 0644);
+	if (IS_ERR(os)) return PTR_ERR(os);
+
+	apk_db_acl_array_init(&acls);
+	apk_ostream_write(os, &hdr, sizeof hdr);
+	apk_array_foreach_item(pkg, pkgs) {
+		if (pkg->layer != layer) continue;
+		r = apk_db_snapshot_write_pkg(db, pkg->ipkg, os, &acls);
+		if (r < 0) break;
+	}
+	apk_db_acl_array_free(&acls);
+	if (r < 0) apk_ostream_cancel(os, r);
+	apk_ostream_write(os, &magic, sizeof magic);
+	return apk_ostream_close(os);
+}
+
+static apk_blob_t apk_db_snapshot_pull(apk_blob_t *b, size_t len)
+{
+	apk_blob_t r;
+
+	if (APK_BLOB_IS_NULL(*b) || b->len < len) {
+		*b = APK_BLOB_NULL;
+		return APK_BLOB_NULL;
+	}
+	r = APK_BLOB_PTR_LEN(b->ptr, len);
+	b->ptr += len;
+	b->len -= len;
+	return r;
+}
+
+static struct apk_db_acl *apk_db_snapshot_pull_acl(struct apk_database *db, apk_blob_t *b, uint32_t ndx,
+	struct apk_db_acl_array **acls, struct apk_db_acl *default_acl, bool apply)
+{
+	struct apk_db_snapshot_acl sacl;
+	struct apk_db_acl *acl = default_acl;
+	apk_blob_t v;
+
+	if (ndx == 0) return default_acl;
+	if (ndx <= apk_array_len(*acls)) return (*acls)->item[ndx-1];
+	if (ndx != apk_array_len(*acls) + 1) goto err;
+
+	v = apk_db_snapshot_pull(b, sizeof sacl);
+	if (APK_BLOB_IS_NULL(v)) return NULL;
+	memcpy(&sacl, v.ptr, sizeof sacl);
+	if (sacl.xattr_hash_len > APK_DIGEST_LENGTH_MAX) goto err;
+	v = apk_db_snapshot_pull(b, sacl.xattr_hash_len);
+	if (APK_BLOB_IS_NULL(v)) return NULL;
+
+	if (apply) acl = __apk_db_acl_atomize(db, sacl.mode, sacl.uid, sacl.gid, sacl.xattr_hash_len, (uint8_t *) v.ptr);
+	apk_db_acl_array_add(acls, acl);
+	return acl;
+err:
+	*b = APK_BLOB_NULL;
+	return NULL;
+}
+
+static int apk_db_snapshot_parse_files(struct apk_database *db, apk_blob_t *b, struct apk_package *pkg, struct apk_db_acl_array **acls)
+{
+	struct apk_db_dir_instance *diri = NULL;
+	struct apk_db_file *file;
+	struct apk_db_snapshot_diri sdiri;
+	struct apk_db_snapshot_file sfile;
+	struct apk_db_acl *acl;
+	apk_blob_t v, name;
+	uint32_t num_diris;
+
+	apk_array_truncate(*acls, 0);
+	v = apk_db_snapshot_pull(b, sizeof num_diris);
+	if (APK_BLOB_IS_NULL(v)) return -APKE_V2DB_FORMAT;
+	memcpy(&num_diris, v.ptr, sizeof num_diris);
+
+	for (uint32_t i = 0; i < num_diris; i++) {
+		v = apk_db_snapshot_pull(b, sizeof sdiri);
+		if (APK_BLOB_IS_NULL(v)) return -APKE_V2DB_FORMAT;
+		memcpy(&sdiri, v.ptr, sizeof sdiri);
+		acl = apk_db_snapshot_pull_acl(db, b, sdiri.acl, acls, apk_default_acl_dir, pkg != NULL);
+		name = apk_db_snapshot_pull(b, sdiri.namelen);
+		if (APK_BLOB_IS_NULL(name)) return -APKE_V2DB_FORMAT;
+
+		if (pkg) {
+			if (diri) apk_db_dir_apply_diri_permissions(db, diri);
+			diri = apk_db_diri_get(db, name, pkg);
+			diri->acl = acl;
+		}
+
+		for (uint32_t j = 0; j < sdiri.num_files; j++) {
+			v = apk_db_snapshot_pull(b, sizeof sfile);
+			if (APK_BLOB_IS_NULL(v)) return -APKE_V2DB_FORMAT;
+			memcpy(&sfile, v.ptr, sizeof sfile);
+			acl = apk_db_snapshot_pull_acl(db, b, sfile.acl, acls, apk_default_acl_file, pkg != NULL);
+			name = apk_db_snapshot_pull(b, sfile.namelen);
+			v = apk_db_snapshot_pull(b, apk_digest_alg_len(sfile.digest_alg));
+			if (APK_BLOB_IS_NULL(v)) return -APKE_V2DB_FORMAT;
+			if (!pkg) continue;
+
+			file = apk_db_file_get(db, diri, name);
+			file->acl = acl;
+			apk_dbf_digest_set(file, sfile.digest_alg, (uint8_t *) v.ptr);
+		}
+	}
+	if (diri) apk_db_dir_apply_diri_permissions(db, diri);
+	return 0;
+}
+
+/* Loads the package headers from the snapshot. The directory and file
+ * entries are only validated, and queued to be loaded when needed with
+ * apk_db_load_files(). */
+static int apk_db_snapshot_parse(struct apk_database *db, apk_blob_t b, unsigned layer, bool apply)
+{
+	struct apk_out *out = &db->ctx->out;
+	struct apk_package_tmpl tmpl;
+	struct apk_installed_package *ipkg;
+	struct apk_package *pkg;
+	struct apk_db_acl_array *acls;
+	apk_blob_t l, files, digest;
+	bool skip, named;
+	int field, r = 0;
+
+	apk_db_acl_array_init(&acls);
+	if (apply) apk_pkgtmpl_init(&tmpl, db);
+
+	while (b.len > 0) {
+		ipkg = NULL;
+		named = false;
+		skip = !apply || apk_db_journal_replaces(&db->installed.journal[layer], b);
+		if (apply) tmpl.pkg.layer = layer;
+
+		for (;;) {
+			if (!apk_blob_split(b, APK_BLOB_STRLIT("\n"), &l, &b)) goto err_fmt;
+			if (l.len == 0) break;
+			if (l.len < 2 || l.ptr[1] != ':') goto err_fmt;
+			if (l.ptr[0] == 'P' && l.len > 2) named = true;
+			if (skip) continue;
+			field = l.ptr[0];
+			l.ptr += 2;
+			l.len -= 2;
+
+			r = apk_pkgtmpl_add_info(&tmpl, field, l);
+			if (r == 0) continue;
+			if (r == 1 && ipkg == NULL) ipkg = apk_db_ipkg_create(db, &tmpl.pkg);
+			if (ipkg == NULL) continue;
+			if (apk_db_ipkg_read_field(db, ipkg, field, &l) == 0) {
+				if (APK_BLOB_IS_NULL(l)) goto err_fmt;
+				continue;
+			}
+			if (!(db->ctx->force & APK_FORCE_OLD_APK)) goto old_apk_tools;
+			tmpl.pkg.filename_ndx = 0;
+		}
+
+		digest = apk_db_snapshot_pull(&b, sizeof ipkg->fdb_digest);
+		files = b;
+		if (apk_db_snapshot_parse_files(db, &b, NULL, &acls) < 0) goto err_fmt;
+		if (APK_BLOB_IS_NULL(digest) || !named) goto err_fmt;
+		if (skip) continue;
+
+		files.len = b.ptr - files.ptr;
+		if (!tmpl.pkg.name) goto err_fmt;
+		if (ipkg == NULL) ipkg = apk_db_ipkg_create(db, &tmpl.pkg);
+		pkg = apk_db_pkg_add(db, &tmpl);
+		if (pkg == NULL) goto err_fmt;
+		if (pkg->ipkg == ipkg) {
+			memcpy(ipkg->fdb_digest, digest.ptr, sizeof ipkg->fdb_digest);
+			ipkg->fdb_dirty = 0;
+			apk_db_lazy_files_array_add(&db->installed.lazy_files, (struct apk_db_lazy_files) {
+				.pkg = pkg,
+				.files = files,
+			});
+		}
+	}
+	r = 0;
+	goto done;
+
+old_apk_tools:
+	apk_err(out, "This apk-tools is too old to handle installed packages");
+err_fmt:
+	r = -APKE_V2DB_FORMAT;
+done:
+	if (apply) apk_pkgtmpl_free(&tmpl);
+	apk_db_acl_array_free(&acls);
+	return r;
+}
+
+/* Returns zero if the installed database was loaded from the snapshot, and
+ * a positive value if the snapshot is missing, stale or otherwise unusable
+ * and the text database needs to be parsed instead. The snapshot is fully
+ * validated before any package is added, and a failure after that leaves
+ * some packages loaded, so it fails the read instead of falling back. */
+static int apk_db_snapshot_read(struct apk_database *db, int fd, unsigned layer)
+{
+	struct apk_db_snapshot_header hdr, expected;
+	struct apk_istream *is;
+	struct stat st;
+	apk_blob_t b;
+	uint32_t magic;
+	int r = 1;
+
+	if (fstatat(fd, "installed", &st, 0) < 0) return 1;
+	apk_db_snapshot_header_init(&expected, &st);
+
+	is = apk_istream_from_file_mmap(fd, APK_DB_SNAPSHOT_FILE);
+	if (IS_ERR(is)) return 1;
+
+	b = apk_istream_mmap(is);
+	if (b.len < sizeof hdr + sizeof magic) goto err;
+	memcpy(&hdr, b.ptr, sizeof hdr);
+	memcpy(&magic, b.ptr + b.len - sizeof magic, sizeof magic);
+	if (memcmp(&hdr, &expected, offsetof(struct apk_db_snapshot_header, num_packages)) != 0 ||
+	    magic != APK_DB_SNAPSHOT_MAGIC) goto err;
+
+	b = APK_BLOB_PTR_LEN(b.ptr + sizeof hdr, b.len - sizeof hdr - sizeof magic);
+	if (apk_db_snapshot_parse(db, b, layer, false) != 0) goto err;
+
+	/* Keep the snapshot mapped for the queued file entries, and have
+	 * them allocated in as few pages as possible */
+	db->installed.lazy_snapshot[layer] = is;
+	apk_balloc_reserve(&db->ba_files,
+		hdr.num_diris * (sizeof(struct apk_db_dir_instance) + sizeof(struct apk_db_dir) + 32) +
+		hdr.num_files * (sizeof(struct apk_db_file) + sizeof(struct apk_db_file *) + 32));
+	return apk_db_snapshot_parse(db, b, layer, true);
+err:
+	apk_istream_close(is);
+	return r;
+}
+
+static void apk_db_lazy_files_close(struct apk_database *db)
+{
+	for (int i = 0; i < APK_DB_LAYER_NUM; i++) {
+		if (!db->installed.lazy_snapshot[i]) continue;
+		apk_istream_close(db->installed.lazy_snapshot[i]);
+		db->installed.lazy_snapshot[i] = NULL;
+	}
+}
+
+/* Loads the queued file entries. An error is remembered, and the installed
+ * database is not written after it as the file entries would be lost. */
+int apk_db_load_files(struct apk_database *db)
+{
+	struct apk_db_lazy_files_array *lazy_files = db->installed.lazy_files;
+	struct apk_db_acl_array *acls;
+	int r = 0;
+
+	if (apk_array_len(lazy_files) == 0) return db->installed.files_error;
+	apk_db_lazy_files_array_init(&db->installed.lazy_files);
+
+	apk_db_acl_array_init(&acls);
+	apk_array_foreach(lf, lazy_files) {
+		struct apk_installed_package *ipkg = lf->pkg->ipkg;
+		apk_blob_t b = lf->files;
+
+		apk_db_ipkg_creator_reset(&db->ic);
+		apk_db_dir_instance_array_copy(&db->ic.diris, ipkg->diris);
+		if (!r && lf->text) r = apk_db_fdb_read_files(db, b, lf->pkg);
+		else if (!r) r = apk_db_snapshot_parse_files(db, &b, lf->pkg, &acls);
+		apk_db_ipkg_commit(db, ipkg);
+	}
+	apk_db_acl_array_free(&acls);
+	apk_db_lazy_files_array_free(&lazy_files);
+	apk_db_lazy_files_close(db);
+
+	if (r < 0) {
+		apk_err(&db->ctx->out, "Unable to load installed files: %s", apk_error_str(r));
+		db->installed.files_error = r;
+	}
+	return db->installed.files_error;
+}
+
+static void apk_db_script_file_info(struct apk_package *pkg, unsigned int type, uint64_t size,
+				    struct apk_file_info *fi, char *filename, size_t filename_size)
+{
+	apk_blob_t bfn = APK_BLOB_PTR_LEN(filename, filename_size);
+
+	/* The scripts db expects file names in format:
+	 * pkg-version.<hexdump of package checksum>.action */
+	apk_blob_push_blob(&bfn, APK_BLOB_STR(pkg->name->name));
+	apk_blob_push_blob(&bfn, APK_BLOB_STR("-"));
+	apk_blob_push_blob(&bfn, *pkg->version);
+	apk_blob_push_blob(&bfn, APK_BLOB_STR("."));
+	apk_blob_push_hash_hex(&bfn, apk_pkg_hash_blob(pkg));
+	apk_blob_push_blob(&bfn, APK_BLOB_STR("."));
+	apk_blob_push_blob(&bfn, APK_BLOB_STR(apk_script_types[type]));
+	apk_blob_push_blob(&bfn, APK_BLOB_PTR_LEN("", 1));
+
+	*fi = (struct apk_file_info) {
+		.name = filename,
+		.size = size,
+		.mode = 0755 | S_IFREG,
+		.mtime = pkg->build_time,
+	};
+}
+
+static struct apk_package *apk_db_script_pkg(struct apk_database *db, const char *name, int *type)
+{
+	struct apk_package *pkg;
+	const char *fncsum, *fnaction;
+	struct apk_digest digest;
+	apk_blob_t blob;
+
+	/* The scripts db expects file names in format:
+	 * pkgname-version.<hexdump of package checksum>.action */
+	fnaction = memrchr(name, '.', strlen(name));
+	if (fnaction == NULL || fnaction == name)
+		return NULL;
+	fncsum = memrchr(name, '.', fnaction - name - 1);
+	if (fncsum == NULL)
+		return NULL;
+	fnaction++;
+	fncsum++;
+
+	/* Parse it */
+	*type = apk_script_type(fnaction);
+	if (*type == APK_SCRIPT_INVALID)
+		return NULL;
+	blob = APK_BLOB_PTR_PTR((char *) fncsum, (char *) fnaction - 2);
+	apk_blob_pull_digest(&blob, &digest);
+
+	pkg = apk_db_get_pkg(db, &digest);
+	if (pkg == NULL || pkg->ipkg == NULL)
+		return NULL;
+	return pkg;
+}
+
+/* Scripts of the installed packages are read from the scripts db when
+ * they are needed */
+int apk_db_read_script(struct apk_database *db, struct apk_installed_package *ipkg, unsigned int type)
+{
+	struct apk_db_scripts *s = &db->installed.scripts[ipkg->pkg->layer];
+	apk_blob_t *b = &ipkg->script[type];
+	ssize_t n;
+
+	if (b->ptr || !b->len) return 0;
+	if (s->fd < 0) return -EBADF;
+
+	b->ptr = malloc(b->len);
+	if (!b->ptr) return -ENOMEM;
+	n = pread(s->fd, b->ptr, b->len, ipkg->script_offset[type]);
+	if (n == (ssize_t) b->len) return 0;
+	free(b->ptr);
+	b->ptr = NULL;
+	return n < 0 ? -errno : -APKE_EOF;
+}
+
+/* Writes the scripts of ipkg, or only the ones not yet in the scripts db,
+ * and records their offsets counting from pos */
+static int apk_db_scriptdb_write_pkg(struct apk_database *db, struct apk_installed_package *ipkg,
+				     struct apk_ostream *os, uint64_t *pos, bool all)
+{
+	struct apk_file_info fi;
+	char filename[256];
+	int r, i;
+
+	for (i = 0; i < APK_SCRIPT_MAX; i++) {
+		if (!ipkg->script[i].len) continue;
+		if (!all && ipkg->script_offset[i]) continue;
+
+		r = apk_db_read_script(db, ipkg, i);
+		if (r < 0) return apk_ostream_cancel(os, r);
+
+		apk_db_script_file_info(ipkg->pkg, i, ipkg->script[i].len, &fi, filename, sizeof filename);
+		*pos += apk_tar_header_size(&fi);
+		ipkg->script_offset[i] = *pos;
+		*pos += (fi.size + 511) & -512;
+
+		r = apk_tar_write_entry(os, &fi, ipkg->script[i].ptr);
+		if (r < 0) return apk_ostream_cancel(os, -APKE_V2DB_FORMAT);
+	}
+	return 0;
+}
+
+/* The scripts db is an uncompressed tar archive. The offsets of the scripts
+ * are indexed on open, and new scripts are appended to the archive. Entries
+ * of removed packages are left in place until they take more than a quarter
+ * of the archive, and it is rewritten. */
+static int apk_db_scriptdb_write(struct apk_database *db, int fd, unsigned layer, struct apk_package_array *pkgs)
+{
+	struct apk_db_scripts *s = &db->installed.scripts[layer];
+	struct apk_ostream *os;
+	struct apk_file_info fi;
+	char filename[256];
+	uint64_t live = 0, pending = 0, size, pos;
+	apk_blob_t b;
+	int r = 0, wfd;
+
+	apk_array_foreach_item(pkg, pkgs) {
+		struct apk_installed_package *ipkg = pkg->ipkg;
+		if (pkg->layer != layer) continue;
+		for (int i = 0; i < APK_SCRIPT_MAX; i++) {
+			if (!ipkg->script[i].len) continue;
+			apk_db_script_file_info(pkg, i, ipkg->script[i].len, &fi, filename, sizeof filename);
+			size = apk_tar_header_size(&fi) + ((fi.size + 511) & -512);
+			if (ipkg->script_offset[i]) live += size;
+			else pending += size;
+		}
+	}
+
+	if (s->fd >= 0 && !s->rewrite && live <= s->end && s->end - live <= (live + pending) / 4) {
+		if (!pending) return 0;
+
+		os = apk_ostream_to_blob(&b);
+		if (IS_ERR(os)) return PTR_ERR(os);
+		pos = s->end;
+		apk_array_foreach_item(pkg, pkgs) {
+			if (pkg->layer != layer) continue;
+			if (apk_db_scriptdb_write_pkg(db, pkg->ipkg, os, &pos, false) < 0) break;
+		}
+		apk_tar_write_entry(os, NULL, NULL);
+		r = apk_ostream_close(os);
+		if (r < 0) goto err;
+
+		/* The end-of-archive records are replaced last, so that
+		 * an interrupted update is not seen by the readers */
+		wfd = openat(fd, "scripts.tar", O_WRONLY | O_CLOEXEC);
+		if (wfd < 0) r = -errno;
+		else if (pwrite(wfd, b.ptr + 1024, b.len - 1024, s->end + 1024) != (ssize_t)(b.len - 1024) ||
+			 pwrite(wfd, b.ptr, 1024, s->end) != 1024 ||
+			 ftruncate(wfd, s->end + b.len) < 0)
+			r = -errno ?: -EIO;
+		if (wfd >= 0) close(wfd);
+		free(b.ptr);
+		if (r < 0) goto err;
+		s->end = pos;
+		return 0;
+	}
+
+	os = apk_ostream_to_file(fd, "scripts.tar", 0644);
+	if (IS_ERR(os)) {
+		r = PTR_ERR(os);
+		goto err;
+	}
+	pos = 0;
+	apk_array_foreach_item(pkg, pkgs) {
+		if (pkg->layer != layer) continue;
+		if (apk_db_scriptdb_write_pkg(db, pkg->ipkg, os, &pos, true) < 0) break;
+	}
+	apk_tar_write_entry(os, NULL, NULL);
+	r = apk_ostream_close(os);
+	if (r < 0) goto err;
+
+	if (s->fd >= 0) close(s->fd);
+	s->fd = openat(fd, "scripts.tar", O_RDONLY | O_CLOEXEC);
+	s->end = pos;
+	s->rewrite = false;
+	unlinkat(fd, "scripts.tar.gz", 0);
+	return 0;
+err:
+	/* The scripts with updated offsets are in memory */
+	s->rewrite = true;
+	return r;
+}
+
+struct scriptdb_index_ctx {
+	struct apk_database *db;
+	unsigned layer;
+};
+
+static int apk_db_scriptdb_index_entry(void *pctx, const char *name, uint64_t offset, uint64_t size)
+{
+	struct scriptdb_index_ctx *ctx = pctx;
+	struct apk_package *pkg;
+	int type;
+
+	pkg = apk_db_script_pkg(ctx->db, name, &type);
+	if (pkg == NULL || pkg->layer != ctx->layer || size > APK_MAX_SCRIPT_SIZE) return 0;
+
+	free(pkg->ipkg->script[type].ptr);
+	pkg->ipkg->script[type] = APK_BLOB_PTR_LEN(NULL, size);
+	pkg->ipkg->script_offset[type] = offset;
+	return 0;
+}
+
+static int apk_read_script_archive_entry(void *ctx,
+					 const struct apk_file_info *ae,
+					 struct apk_istream *is)
+{
+	struct apk_database *db = (struct apk_database *) ctx;
+	struct apk_package *pkg;
+	int type;
+
+	if (!S_ISREG(ae->mode))
+		return 0;
+
+	/* Attach script */
+	pkg = apk_db_script_pkg(db, ae->name, &type);
+	if (pkg != NULL)
+		apk_ipkg_add_script(pkg->ipkg, is, type, ae->size);
+
+	return 0;
+}
+
+static int apk_db_scriptdb_read(struct apk_database *db, int fd, unsigned layer)
+{
+	struct apk_db_scripts *s = &db->installed.scripts[layer];
+	struct scriptdb_index_ctx ctx = { .db = db, .layer = layer };
+	struct apk_installed_package *ipkg;
+	struct apk_istream *is;
+	struct stat st;
+	int r;
+
+	s->fd = openat(fd, "scripts.tar", O_RDONLY | O_CLOEXEC);
+	if (s->fd < 0 && errno != ENOENT) return -errno;
+	if (s->fd >= 0) {
+		r = apk_tar_index(s->fd, apk_db_scriptdb_index_entry, &ctx, &s->end);
+		if (r == 0) {
+			/* Rewrite the archive if an update was interrupted */
+			if (fstat(s->fd, &st) < 0 || st.st_size != s->end + 1024) s->rewrite = true;
+			return 0;
+		}
+
+		/* Not written by apk, load it completely */
+		close(s->fd);
+		s->fd = -1;
+		list_for_each_entry(ipkg, &db->installed.packages, installed_pkgs_list) {
+			if (ipkg->pkg->layer != layer) continue;
+			for (int i = 0; i < APK_SCRIPT_MAX; i++)
+				if (!ipkg->script[i].ptr) ipkg->script[i] = APK_BLOB_NULL;
+		}
+		is = apk_istream_from_file(fd, "scripts.tar");
+	} else {
+		is = apk_istream_gunzip(apk_istream_from_file(fd, "scripts.tar.gz"));
+	}
+	return apk_tar_parse(is, apk_read_script_archive_entry, db, db->id_cache);
+}
+
+static int apk_db_triggers_write(struct apk_database *db, struct apk_installed_package *ipkg, struct apk_ostream *os)
+{
+	char buf[APK_BLOB_DIGEST_BUF];
+	apk_blob_t bfn;
+
+	if (IS_ERR(os)) return PTR_ERR(os);
+	if (apk_array_len(ipkg->triggers) == 0) return 0;
+
+	bfn = APK_BLOB_BUF(buf);
+	apk_blob_push_hash(&bfn, apk_pkg_hash_blob(ipkg->pkg));
+	bfn = apk_blob_pushed(APK_BLOB_BUF(buf), bfn);
+	apk_ostream_write(os, bfn.ptr, bfn.len);
+
+	apk_array_foreach_item(trigger, ipkg->triggers) {
+		apk_ostream_write(os, " ", 1);
+		apk_ostream_write_string(os, trigger);
+	}
+	apk_ostream_write(os, "\n", 1);
+	return 0;
+}
+
+static void apk_db_pkg_add_triggers(struct apk_database *db, struct apk_installed_package *ipkg, apk_blob_t triggers)
+{
+	apk_blob_foreach_word(word, triggers)
+		apk_string_array_add(&ipkg->triggers, apk_blob_cstr(word));
+
+	if (apk_array_len(ipkg->triggers) != 0 &&
+	    !list_hashed(&ipkg->trigger_pkgs_list))
+		list_add_tail(&ipkg->trigger_pkgs_list,
+			      &db->installed.triggers);
+}
+
+static int apk_db_add_trigger(struct apk_database *db, apk_blob_t l)
+{
+	struct apk_digest digest;
+	struct apk_package *pkg;
+
+	apk_blob_pull_digest(&l, &digest);
+	apk_blob_pull_char(&l, ' ');
+	pkg = apk_db_get_pkg(db, &digest);
+	if (pkg && pkg->ipkg) apk_db_pkg_add_triggers(db, pkg->ipkg, l);
+	return 0;
+}
+
+static int apk_db_fdb_read_installed(struct apk_database *db, int fd, unsigned layer)
+{
+	struct apk_db_journal *j = &db->installed.journal[layer];
+	struct apk_istream is;
+	apk_blob_t b, rec, left;
+	char *end;
+	int r;
+
+	if (apk_array_len(j->entries) == 0)
+		return apk_db_fdb_read(db, apk_istream_from_file(fd, "installed"), APK_REPO_DB_INSTALLED, layer);
+
+	/* Leave out the packages which have newer entries in the journal */
+	r = apk_blob_from_file(fd, "installed", &b);
+	if (r < 0) return r;
+	end = b.ptr;
+	for (left = b; apk_blob_split(left, APK_BLOB_STRLIT("\n\n"), &rec, &left); ) {
+		if (apk_db_journal_replaces(j, rec)) continue;
+		memmove(end, rec.ptr, rec.len + 2);
+		end += rec.len + 2;
+	}
+	memmove(end, left.ptr, left.len);
+	end += left.len;
+
+	r = apk_db_fdb_read(db, apk_istream_from_blob(&is, APK_BLOB_PTR_LEN(b.ptr, end - b.ptr)), APK_REPO_DB_INSTALLED, layer);
+	free(b.ptr);
+	return r;
+}
+
+static int apk_db_read_layer(struct apk_database *db, unsigned layer)
+{
+	apk_blob_t blob, world;
+	int r, fd, ret = 0, flags = db->ctx->open_flags;
+
+	/* Read:
+	 * 1. world
+	 * 2. installed packages db
+	 * 3. triggers db
+	 * 4. scripts db
+	 */
+
+	fd = openat(db->root_fd, apk_db_layer_name(layer), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -errno;
+
+	if (!(flags & APK_OPENF_NO_WORLD)) {
+		if (layer == APK_DB_LAYER_ROOT)
+			ret = apk_blob_from_file(db->root_fd, apk_world_file, &world);
+		else
+			ret = apk_blob_from_file(fd, "world", &world);
+
+		if (!ret) {
+			blob = apk_blob_trim(world);
+			ret = apk_blob_pull_deps(&blob, db, &db->world, true);
+			free(world.ptr);
+		} else if (layer == APK_DB_LAYER_ROOT) {
+			ret = -ENOENT;
+		}
+	}
+
+	if (!(flags & APK_OPENF_NO_INSTALLED)) {
+		r = apk_db_journal_read(db, fd, layer);
+		if (r == 0) r = apk_db_snapshot_read(db, fd, layer);
+		if (r > 0) {
+			/* Keep the file entries in the order they were read */
+			r = apk_db_load_files(db);
+			if (r == 0) r = apk_db_fdb_read_installed(db, fd, layer);
+		}
+		if (r == 0) r = apk_db_journal_replay(db, layer);
+		apk_db_journal_entry_array_free(&db->installed.journal[layer].entries);
+		apk_db_journal_set_packages(db, layer);
+		if (!ret && r != -ENOENT) ret = r;
+		r = apk_db_parse_istream(db, apk_istream_from_file(fd, "triggers"), apk_db_add_trigger);
+		if (!ret && r != -ENOENT) ret = r;
+	}
+
+	if (!(flags & APK_OPENF_NO_SCRIPTS)) {
+		r = apk_db_scriptdb_read(db, fd, layer);
+		if (!ret && r != -ENOENT) ret = r;
+	}
+
+	close(fd);
+	return ret;
+}
+
+static int apk_db_index_write_nr_cache(struct apk_database *db)
+{
+	struct apk_ostream *os = NULL;
+
+	if (apk_db_permanent(db) || !apk_db_cache_active(db)) return 0;
+
+	/* Write list of installed non-repository packages to
+	 * cached index file */
+	struct apk_package_array *pkgs = apk_db_sorted_installed_packages(db);
+	apk_array_foreach_item(pkg, pkgs) {
+		if (apk_db_pkg_available(db, pkg)) continue;
+		if (pkg->cached || pkg->filename_ndx || !pkg->installed_size) {
+			if (!os) {
 				os = apk_ostream_to_file(db->cache_fd, "installed", 0644);
 				if (IS_ERR(os)) return PTR_ERR(os);
 			}
@@ -1460,6 +2432,40 @@ static int load_v2index(struct apk_extract_ctx *ectx, apk_blob_t *desc, struct a
 	return apk_db_index_read(ctx->db, is, ctx->repo);
 }
 
+static void apk_db_add_rdepends_names(struct apk_database *db, struct apk_name_array **a, struct adb_obj *names)
+{
+	struct apk_name *name;
+	bool merge = apk_array_len(*a) != 0;
+	int i;
+
+	/* Names already present from another index are marked and skipped */
+	if (merge) apk_array_foreach_item(n, *a) n->state_int = 1;
+	apk_name_array_resize(a, apk_array_len(*a), apk_array_len(*a) + adb_ra_num(names));
+	for (i = ADBI_FIRST; i <= adb_ra_num(names); i++) {
+		name = apk_db_get_name(db, adb_ro_blob(names, i));
+		if (!name || name->state_int) continue;
+		apk_name_array_add(a, name);
+	}
+	if (merge) apk_array_foreach_item(n, *a) n->state_int = 0;
+}
+
+/* Adds the reverse dependencies from the table in a v3 index */
+static void apk_db_add_reverse_deps(struct apk_database *db, struct adb_obj *rdeps)
+{
+	struct adb_obj rdep, names;
+	struct apk_name *name;
+	int i;
+
+	for (i = ADBI_FIRST; i <= adb_ra_num(rdeps); i++) {
+		adb_ro_obj(rdeps, i, &rdep);
+		name = apk_db_get_name(db, adb_ro_blob(&rdep, ADBI_RDEP_NAME));
+		if (!name) continue;
+		name->is_dependency |= !!adb_ro_int(&rdep, ADBI_RDEP_REQUIRED);
+		apk_db_add_rdepends_names(db, &name->rdepends, adb_ro_obj(&rdep, ADBI_RDEP_DEPENDS, &names));
+		apk_db_add_rdepends_names(db, &name->rinstall_if, adb_ro_obj(&rdep, ADBI_RDEP_INSTALL_IF, &names));
+	}
+}
+
 static int load_v3index(struct apk_extract_ctx *ectx, struct adb_obj *ndx)
 {
 	struct apkindex_ctx *ctx = container_of(ectx, struct apkindex_ctx, ectx);
@@ -1467,7 +2473,7 @@ static int load_v3index(struct apk_extract_ctx *ectx, struct adb_obj *ndx)
 	struct apk_out *out = &db->ctx->out;
 	struct apk_repository *repo = &db->repos[ctx->repo];
 	struct apk_package_tmpl tmpl;
-	struct adb_obj pkgs, pkginfo;
+	struct adb_obj pkgs, pkginfo, rdeps;
 	apk_blob_t pkgname_spec;
 	int i, r = 0, num_broken = 0;
 
@@ -1498,6 +2504,11 @@ static int load_v3index(struct apk_extract_ctx *ectx, struct adb_obj *ndx)
 	}
 
 	apk_pkgtmpl_free(&tmpl);
+	adb_ro_obj(ndx, ADBI_NDX_REVERSE_DEPS, &rdeps);
+	if (r == 0 && adb_ra_num(&rdeps) != 0) {
+		apk_db_add_reverse_deps(db, &rdeps);
+		db->rdepends_repos |= BIT(ctx->repo);
+	}
 	if (num_broken) apk_warn(out, "Repository " BLOB_FMT " has %d packages without hash",
 		BLOB_PRINTF(repo->url_index_printable), num_broken);
 	return r;
@@ -1597,145 +2608,953 @@ static const struct apk_repoparser_ops db_repoparser_ops = {
 	.repository = add_repository_component,
 };
 
-static void open_repository(struct apk_database *db, int repo_num)
+struct apk_repository_open {
+	const char *error_action;
+	unsigned int available_repos;
+	int fd, r, update_error;
+	char url[NAME_MAX];
+};
+
+static void open_repository_prepare(struct apk_database *db, int repo_num, struct apk_repository_open *ro, int update_error)
 {
-	struct apk_out *out = &db->ctx->out;
 	struct apk_repository *repo = &db->repos[repo_num];
-	const char *error_action = "constructing url";
 	unsigned int repo_mask = BIT(repo_num);
-	unsigned int available_repos = 0;
-	char open_url[NAME_MAX];
-	int r, update_error = 0, open_fd = AT_FDCWD;
+	int r;
 
-	error_action = "opening";
-	if (!(db->ctx->flags & APK_NO_NETWORK)) available_repos = repo_mask;
+	*ro = (struct apk_repository_open) {
+		.error_action = "opening",
+		.fd = AT_FDCWD,
+	};
+	if (!(db->ctx->flags & APK_NO_NETWORK)) ro->available_repos = repo_mask;
 
 	if (repo->is_remote && !(db->ctx->flags & APK_NO_CACHE)) {
-		error_action = "opening from cache";
+		ro->error_action = "opening from cache";
 		if (repo->stale) {
-			update_error = apk_cache_download(db, repo, NULL, NULL);
-			switch (update_error) {
+			ro->update_error = update_error;
+			switch (ro->update_error) {
 			case 0:
 				db->repositories.updated++;
 				// Fallthrough
 			case -APKE_FILE_UNCHANGED:
-				update_error = 0;
+				ro->update_error = 0;
 				repo->stale = 0;
 				break;
 			}
 		}
-		r = apk_repo_index_cache_url(db, repo, &open_fd, open_url, sizeof open_url);
+		r = apk_repo_index_cache_url(db, repo, &ro->fd, ro->url, sizeof ro->url);
 	} else {
 		if (repo->is_remote) {
-			error_action = "fetching";
-			apk_out_progress_note(out, "fetch " BLOB_FMT, BLOB_PRINTF(repo->url_index_printable));
+			ro->error_action = "fetching";
 		} else {
-			available_repos = repo_mask;
+			ro->available_repos = repo_mask;
 			db->local_repos |= repo_mask;
 		}
-		r = apk_fmt(open_url, sizeof open_url, BLOB_FMT, BLOB_PRINTF(repo->url_index));
+		r = apk_fmt(ro->url, sizeof ro->url, BLOB_FMT, BLOB_PRINTF(repo->url_index));
+	}
+	if (r < 0) ro->r = r;
+}
+
+static void open_repository_load(struct apk_database *db, int repo_num, struct apk_repository_open *ro)
+{
+	struct apk_out *out = &db->ctx->out;
+	struct apk_repository *repo = &db->repos[repo_num];
+
+	if (ro->r) return;
+	if (repo->is_remote && (db->ctx->flags & APK_NO_CACHE))
+		apk_out_progress_note(out, "fetch " BLOB_FMT, BLOB_PRINTF(repo->url_index_printable));
+	ro->r = load_index(db, apk_istream_from_fd_url(ro->fd, ro->url, apk_db_url_since(db, 0)), repo_num);
+}
+
+static void open_repository_complete(struct apk_database *db, int repo_num, struct apk_repository_open *ro)
+{
+	struct apk_out *out = &db->ctx->out;
+	struct apk_repository *repo = &db->repos[repo_num];
+	unsigned int repo_mask = BIT(repo_num);
+	const char *error_action = ro->error_action;
+	int r = ro->r, update_error = ro->update_error;
+
+	if (r || update_error) {
+		if (repo->is_remote) {
+			if (r) db->repositories.unavailable++;
+			else db->repositories.stale++;
+		}
+		if (update_error)
+			error_action = r ? "updating and opening" : "updating";
+		else
+			update_error = r;
+		apk_warn(out, "%s " BLOB_FMT ": %s",
+			error_action, BLOB_PRINTF(repo->url_index_printable), apk_error_str(update_error));
+	}
+	if (r == 0) {
+		repo->available = 1;
+		db->available_repos |= ro->available_repos;
+		for (unsigned int tag_id = 0, mask = repo->tag_mask; mask; mask >>= 1, tag_id++)
+			if (mask & 1) db->repo_tags[tag_id].allowed_repos |= repo_mask;
+	}
+}
+
+static int add_repository(struct apk_database *db, apk_blob_t line)
+{
+	return apk_repoparser_parse(&db->repoparser, line, true);
+}
+
+static int add_repos_from_file(void *ctx, int dirfd, const char *path, const char *file)
+{
+	struct apk_database *db = (struct apk_database *) ctx;
+	struct apk_out *out = &db->ctx->out;
+	int r;
+
+	apk_repoparser_set_file(&db->repoparser, file);
+	r = apk_db_parse_istream(db, apk_istream_from_file(dirfd, file), add_repository);
+	if (r != 0) {
+		if (dirfd != AT_FDCWD) return 0;
+		apk_err(out, "failed to read repositories: %s: %s", file, apk_error_str(r));
+		return r;
+	}
+	return 0;
+}
+
+static void setup_cache_repository(struct apk_database *db, apk_blob_t cache_dir)
+{
+	db->filename_repository = (struct apk_repository) {};
+	db->cache_repository = (struct apk_repository) {
+		.url_base = cache_dir,
+		.url_printable = cache_dir,
+		.pkgname_spec = db->ctx->default_cachename_spec,
+		.absolute_pkgname = 1,
+	};
+	db->num_repo_tags = 1;
+}
+
+struct rdepends_state {
+	struct apk_name *touched[128];
+	unsigned num_touched;
+};
+
+static void rdepends_touch(struct rdepends_state *st, struct apk_name *rname, int flag)
+{
+	if (!rname->state_int) {
+		if (st->num_touched < ARRAY_SIZE(st->touched))
+			st->touched[st->num_touched] = rname;
+		st->num_touched++;
+	}
+	rname->state_int |= flag;
+}
+
+/* Builds the reverse dependencies contributed by the providers of a name
+ * which are not in the repositories of done, and are in the repositories of
+ * todo, or are any other provider if todo is zero. The reverse dependencies
+ * of the providers in done were already added, and are skipped. */
+static void apk_db_name_rdepends(struct apk_name *name, unsigned int done, unsigned int todo)
+{
+	struct rdepends_state st = { .num_touched = 0 };
+	struct apk_name *rname;
+	bool found = false;
+
+#define rdepends_pending(pkg) (!((pkg)->repos & done) && (!todo || ((pkg)->repos & todo)))
+	apk_array_foreach(p, name->providers) {
+		if (rdepends_pending(p->pkg)) {
+			found = true;
+		} else if (p->pkg->repos & done) {
+			apk_array_foreach(dep, p->pkg->depends)
+				rdepends_touch(&st, dep->name, 1);
+			apk_array_foreach(dep, p->pkg->install_if)
+				rdepends_touch(&st, dep->name, 2);
+		}
+	}
+	if (!found) goto done;
+
+	apk_array_foreach(p, name->providers) {
+		if (!rdepends_pending(p->pkg)) continue;
+		apk_array_foreach(dep, p->pkg->depends) {
+			rname = dep->name;
+			rname->is_dependency |= !apk_dep_conflict(dep);
+			if (!(rname->state_int & 1)) {
+				rdepends_touch(&st, rname, 1);
+				apk_name_array_add(&rname->rdepends, name);
+			}
+		}
+		apk_array_foreach(dep, p->pkg->install_if) {
+			rname = dep->name;
+			if (!(rname->state_int & 2)) {
+				rdepends_touch(&st, rname, 2);
+				apk_name_array_add(&rname->rinstall_if, name);
+			}
+		}
+	}
+#undef rdepends_pending
+
+done:
+	if (st.num_touched > ARRAY_SIZE(st.touched)) {
+		apk_array_foreach(p, name->providers) {
+			apk_array_foreach(dep, p->pkg->depends)
+				dep->name->state_int = 0;
+			apk_array_foreach(dep, p->pkg->install_if)
+				dep->name->state_int = 0;
+		}
+	} else for (unsigned i = 0; i < st.num_touched; i++)
+		st.touched[i]->state_int = 0;
+}
+
+struct rdepends_ctx {
+	unsigned int done, todo;
+};
+
+static int apk_db_name_rdepends_cb(apk_hash_item item, void *pctx)
+{
+	struct rdepends_ctx *ctx = pctx;
+	apk_db_name_rdepends(item, ctx->done, ctx->todo);
+	return 0;
+}
+
+/* The reverse dependencies are needed only by the solver and some applets,
+ * and are built on first use. Those of the repositories in rdepends_repos
+ * were already loaded from the index tables or the repository cache. */
+void apk_db_load_rdepends(struct apk_database *db)
+{
+	struct rdepends_ctx ctx = { .done = db->rdepends_repos };
+
+	if (db->rdepends_loaded) return;
+	apk_hash_foreach(&db->available.names, apk_db_name_rdepends_cb, &ctx);
+	db->rdepends_loaded = 1;
+}
+
+/* The repository cache is a host local binary copy of the packages loaded
+ * from all configured repository indexes, and of the reverse dependencies
+ * built from them. It is keyed by a digest of the architectures, trusted
+ * keys, and the url and contents of each index, and is used only if every
+ * index is available as a local file. Values are in native byte order,
+ * and strings are stored as an uint16_t length followed by the data.
+ * After the header follow:
+ *   for each repository: struct apk_repo_cache_repo, description, pkgname_spec
+ *   for each name: the name
+ *   for each name: struct apk_repo_cache_name, rdepends and rinstall_if
+ *     as uint32_t name indexes
+ *   for each package: struct apk_repo_cache_pkg, digest, version, arch,
+ *     license, origin, maintainer, url, description, commit, tags, and
+ *     for each dependency: struct apk_repo_cache_dep, version
+ * The file ends with the magic value. */
+#define APK_REPO_CACHE_FILE		"repositories.cache"
+#define APK_REPO_CACHE_MAGIC		0x6f706572	// repo
+#define APK_REPO_CACHE_VERSION		1
+
+struct apk_repo_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t key[APK_DIGEST_LENGTH_SHA256];
+	uint32_t num_repos, num_names, num_packages;
+	uint8_t compat_newfeatures, compat_notinstallable, compat_depversions;
+};
+
+struct apk_repo_cache_repo {
+	uint8_t absolute_pkgname;
+} __attribute__((packed));
+
+struct apk_repo_cache_name {
+	uint32_t num_rdepends, num_rinstall_if;
+	uint8_t is_dependency;
+} __attribute__((packed));
+
+struct apk_repo_cache_pkg {
+	uint64_t installed_size, size;
+	int64_t build_time;
+	uint32_t name, repos;
+	uint32_t num_depends, num_install_if, num_provides, num_recommends, num_tags;
+	uint16_t provider_priority;
+	uint8_t uninstallable;
+	uint8_t digest_alg;
+} __attribute__((packed));
+
+struct apk_repo_cache_dep {
+	uint32_t name;
+	uint8_t op;
+	uint8_t broken;
+} __attribute__((packed));
+
+static int apk_repo_cache_key(struct apk_database *db, struct apk_repository_open *ro, struct apk_digest *key)
+{
+	struct apk_trust *trust = apk_ctx_get_trust(db->ctx);
+	struct apk_trust_key *tkey;
+	struct apk_digest_ctx dctx;
+	struct apk_digest d;
+	struct apk_istream *is;
+	const char *fn;
+	apk_blob_t b;
+	uint8_t allow_untrusted = trust->allow_untrusted;
+	int r;
+
+	if (db->num_repos == 0) return -ENOENT;
+	for (unsigned i = 0; i < db->num_repos; i++) {
+		if (ro[i].r) return ro[i].r;
+		if (!apk_url_local_file(ro[i].url, sizeof ro[i].url)) return -ENOENT;
+	}
+
+	r = apk_digest_ctx_init(&dctx, APK_DIGEST_SHA256);
+	if (r < 0) return r;
+
+	apk_array_foreach_item(arch, db->arches) {
+		apk_digest_ctx_update(&dctx, arch->ptr, arch->len);
+		apk_digest_ctx_update(&dctx, "\n", 1);
+	}
+	apk_digest_ctx_update(&dctx, &allow_untrusted, sizeof allow_untrusted);
+	list_for_each_entry(tkey, &trust->trusted_key_list, key_node)
+		apk_digest_ctx_update(&dctx, tkey->key.id, sizeof tkey->key.id);
+
+	for (unsigned i = 0; i < db->num_repos; i++) {
+		fn = apk_url_local_file(ro[i].url, sizeof ro[i].url);
+		is = apk_istream_from_file_mmap(ro[i].fd, fn);
+		if (IS_ERR(is)) {
+			r = PTR_ERR(is);
+			goto err;
+		}
+		b = apk_istream_mmap(is);
+		if (!APK_BLOB_IS_NULL(b)) r = apk_digest_calc(&d, APK_DIGEST_SHA256, b.ptr, b.len);
+		else r = -ENOENT;
+		apk_istream_close(is);
+		if (r < 0) goto err;
+
+		apk_digest_ctx_update(&dctx, db->repos[i].hash.data, db->repos[i].hash.len);
+		apk_digest_ctx_update(&dctx, d.data, d.len);
+	}
+	r = apk_digest_ctx_final(&dctx, key);
+err:
+	apk_digest_ctx_free(&dctx);
+	return r;
+}
+
+static void apk_repo_cache_ref_name(struct apk_name_array **refs, struct apk_name *name)
+{
+	if (name->state_int) return;
+	name->state_int = -1;
+	apk_name_array_add(refs, name);
+}
+
+static void apk_repo_cache_number_name(struct apk_name_array **names, struct apk_name *name)
+{
+	if (name->state_int >= 0) return;
+	apk_name_array_add(names, name);
+	name->state_int = apk_array_len(*names);
+}
+
+/* Returns the names referenced by the packages numbered in their creation
+ * order, so that loading creates them in the same order as the indexes do. */
+static struct apk_name_array *apk_repo_cache_names(struct apk_database *db, struct apk_package_array *pkgs)
+{
+	struct apk_name_array *refs, *names;
+
+	apk_name_array_init(&refs);
+	apk_name_array_init(&names);
+	apk_array_foreach_item(pkg, pkgs) {
+		apk_repo_cache_ref_name(&refs, pkg->name);
+		apk_array_foreach(dep, pkg->depends) apk_repo_cache_ref_name(&refs, dep->name);
+		apk_array_foreach(dep, pkg->install_if) apk_repo_cache_ref_name(&refs, dep->name);
+		apk_array_foreach(dep, pkg->provides) apk_repo_cache_ref_name(&refs, dep->name);
+		apk_array_foreach(dep, pkg->recommends) apk_repo_cache_ref_name(&refs, dep->name);
+	}
+	for (unsigned i = 0; i < apk_array_len(refs); i++) {
+		apk_array_foreach_item(name, refs->item[i]->rdepends) apk_repo_cache_ref_name(&refs, name);
+		apk_array_foreach_item(name, refs->item[i]->rinstall_if) apk_repo_cache_ref_name(&refs, name);
+	}
+	apk_array_foreach_item(name, db->repositories.names) apk_repo_cache_number_name(&names, name);
+	apk_array_foreach_item(name, refs) apk_repo_cache_number_name(&names, name);
+	apk_name_array_free(&refs);
+	return names;
+}
+
+static inline uint32_t apk_repo_cache_name_ndx(struct apk_name *name)
+{
+	return name->state_int - 1;
+}
+
+static void apk_repo_cache_write_str(struct apk_ostream *os, apk_blob_t b)
+{
+	uint16_t len = b.len;
+
+	if (b.len > UINT16_MAX) {
+		apk_ostream_cancel(os, -ENOBUFS);
+		return;
+	}
+	apk_ostream_write(os, &len, sizeof len);
+	if (len) apk_ostream_write(os, b.ptr, len);
+}
+
+static void apk_repo_cache_write_deps(struct apk_ostream *os, struct apk_dependency_array *deps)
+{
+	apk_array_foreach(dep, deps) {
+		struct apk_repo_cache_dep sdep = {
+			.name = apk_repo_cache_name_ndx(dep->name),
+			.op = dep->op,
+			.broken = dep->broken,
+		};
+		apk_ostream_write(os, &sdep, sizeof sdep);
+		apk_repo_cache_write_str(os, *dep->version);
+	}
+}
+
+static void apk_repo_cache_write_names(struct apk_ostream *os, struct apk_name_array *list)
+{
+	apk_array_foreach_item(name, list) {
+		uint32_t ndx = apk_repo_cache_name_ndx(name);
+		apk_ostream_write(os, &ndx, sizeof ndx);
+	}
+}
+
+/* Writes the packages loaded from the given repositories, and the
+ * repositories starting from first_repo. */
+static int apk_repo_cache_serialize(struct apk_database *db, struct apk_ostream *os,
+	struct apk_repo_cache_header *hdr, unsigned first_repo, unsigned num_repos)
+{
+	struct apk_package_array *pkgs = db->repositories.packages;
+	struct apk_name_array *names;
+	uint32_t magic = APK_REPO_CACHE_MAGIC;
+
+	names = apk_repo_cache_names(db, pkgs);
+	hdr->num_repos = num_repos;
+	hdr->num_names = apk_array_len(names);
+	hdr->num_packages = apk_array_len(pkgs);
+	apk_ostream_write(os, hdr, sizeof *hdr);
+
+	for (unsigned i = first_repo; i < first_repo + num_repos; i++) {
+		struct apk_repository *repo = &db->repos[i];
+		struct apk_repo_cache_repo srepo = {
+			.absolute_pkgname = repo->absolute_pkgname,
+		};
+		apk_ostream_write(os, &srepo, sizeof srepo);
+		apk_repo_cache_write_str(os, repo->description);
+		apk_repo_cache_write_str(os, repo->pkgname_spec);
+	}
+
+	apk_array_foreach_item(name, names)
+		apk_repo_cache_write_str(os, APK_BLOB_STR(name->name));
+	apk_array_foreach_item(name, names) {
+		struct apk_repo_cache_name sname = {
+			.num_rdepends = apk_array_len(name->rdepends),
+			.num_rinstall_if = apk_array_len(name->rinstall_if),
+			.is_dependency = name->is_dependency,
+		};
+		apk_ostream_write(os, &sname, sizeof sname);
+		apk_repo_cache_write_names(os, name->rdepends);
+		apk_repo_cache_write_names(os, name->rinstall_if);
+	}
+
+	apk_array_foreach_item(pkg, pkgs) {
+		struct apk_repo_cache_pkg spkg = {
+			.installed_size = pkg->installed_size,
+			.size = pkg->size,
+			.build_time = pkg->build_time,
+			.name = apk_repo_cache_name_ndx(pkg->name),
+			.repos = pkg->repos,
+			.num_depends = apk_array_len(pkg->depends),
+			.num_install_if = apk_array_len(pkg->install_if),
+			.num_provides = apk_array_len(pkg->provides),
+			.num_recommends = apk_array_len(pkg->recommends),
+			.num_tags = apk_array_len(pkg->tags),
+			.provider_priority = pkg->provider_priority,
+			.uninstallable = pkg->uninstallable,
+			.digest_alg = pkg->digest_alg,
+		};
+		apk_ostream_write(os, &spkg, sizeof spkg);
+		apk_ostream_write_blob(os, apk_pkg_digest_blob(pkg));
+		apk_repo_cache_write_str(os, *pkg->version);
+		apk_repo_cache_write_str(os, *pkg->arch);
+		apk_repo_cache_write_str(os, *pkg->license);
+		apk_repo_cache_write_str(os, *pkg->origin);
+		apk_repo_cache_write_str(os, *pkg->maintainer);
+		apk_repo_cache_write_str(os, *pkg->url);
+		apk_repo_cache_write_str(os, *pkg->description);
+		apk_repo_cache_write_str(os, *pkg->commit);
+		apk_array_foreach_item(tag, pkg->tags)
+			apk_repo_cache_write_str(os, *tag);
+		apk_repo_cache_write_deps(os, pkg->depends);
+		apk_repo_cache_write_deps(os, pkg->install_if);
+		apk_repo_cache_write_deps(os, pkg->provides);
+		apk_repo_cache_write_deps(os, pkg->recommends);
+	}
+	apk_ostream_write(os, &magic, sizeof magic);
+
+	apk_array_foreach_item(name, names) name->state_int = 0;
+	apk_name_array_free(&names);
+	return apk_ostream_error(os);
+}
+
+static int apk_repo_cache_write(struct apk_database *db, struct apk_repo_cache_header *hdr)
+{
+	struct apk_ostream *os;
+
+	os = apk_ostream_to_file(db->cache_fd, APK_REPO_CACHE_FILE, 0644);
+	if (IS_ERR(os)) return PTR_ERR(os);
+	apk_repo_cache_serialize(db, os, hdr, 0, db->num_repos);
+	return apk_ostream_close(os);
+}
+
+static bool apk_repo_cache_pull_struct(apk_blob_t *b, void *ptr, size_t len)
+{
+	apk_blob_t v = apk_db_snapshot_pull(b, len);
+
+	if (APK_BLOB_IS_NULL(v)) return false;
+	memcpy(ptr, v.ptr, len);
+	return true;
+}
+
+static apk_blob_t *apk_repo_cache_pull_atom(struct apk_database *db, apk_blob_t *b, bool apply)
+{
+	uint16_t len;
+	apk_blob_t v;
+
+	if (!apk_repo_cache_pull_struct(b, &len, sizeof len)) return &apk_atom_null;
+	v = apk_db_snapshot_pull(b, len);
+	if (!apply || APK_BLOB_IS_NULL(v)) return &apk_atom_null;
+	return apk_atomize_dup(&db->atoms, v);
+}
+
+static struct apk_name *apk_repo_cache_pull_name(apk_blob_t *b, struct apk_name_array *names, uint32_t num_names, bool apply)
+{
+	uint32_t ndx;
+
+	if (!apk_repo_cache_pull_struct(b, &ndx, sizeof ndx)) return NULL;
+	if (ndx >= num_names) {
+		*b = APK_BLOB_NULL;
+		return NULL;
+	}
+	return apply ? names->item[ndx] : NULL;
+}
+
+/* Appends the names not yet in the array, so that the reverse dependencies
+ * merged from several repositories are kept in repository order. */
+static void apk_repo_cache_pull_names(apk_blob_t *b, struct apk_name_array *names, uint32_t num_names,
+	uint32_t num, struct apk_name_array **a, bool apply)
+{
+	struct apk_name *name;
+
+	if (apply) {
+		apk_name_array_resize(a, apk_array_len(*a), apk_array_len(*a) + num);
+		apk_array_foreach_item(n, *a) n->state_int = 1;
+	}
+	for (uint32_t i = 0; i < num; i++) {
+		name = apk_repo_cache_pull_name(b, names, num_names, apply);
+		if (APK_BLOB_IS_NULL(*b)) break;
+		if (!apply || name->state_int) continue;
+		name->state_int = 1;
+		apk_name_array_add(a, name);
+	}
+	if (apply) apk_array_foreach_item(n, *a) n->state_int = 0;
+}
+
+static void apk_repo_cache_pull_deps(struct apk_database *db, apk_blob_t *b, struct apk_name_array *names,
+	uint32_t num_names, uint32_t num, struct apk_dependency_array **deps, bool apply)
+{
+	struct apk_repo_cache_dep sdep;
+	apk_blob_t *version;
+
+	for (uint32_t i = 0; i < num; i++) {
+		if (!apk_repo_cache_pull_struct(b, &sdep, sizeof sdep)) return;
+		version = apk_repo_cache_pull_atom(db, b, apply);
+		if (sdep.name >= num_names) *b = APK_BLOB_NULL;
+		if (APK_BLOB_IS_NULL(*b)) return;
+		if (!apply) continue;
+		apk_dependency_array_add(deps, (struct apk_dependency) {
+			.name = names->item[sdep.name],
+			.version = version,
+			.op = sdep.op,
+			.broken = sdep.broken,
+		});
+	}
+}
+
+static int apk_repo_cache_parse(struct apk_database *db, apk_blob_t b, struct apk_repo_cache_header *hdr,
+	unsigned first_repo, bool apply)
+{
+	struct apk_repo_cache_repo srepo;
+	struct apk_repo_cache_name sname;
+	struct apk_repo_cache_pkg spkg;
+	struct apk_package_tmpl tmpl;
+	struct apk_name_array *names;
+	struct apk_name *name = NULL;
+	apk_blob_t v, *description, *pkgname_spec;
+	uint32_t i, j;
+	int r = -APKE_FORMAT_INVALID;
+
+	apk_name_array_init(&names);
+	if (apply) {
+		apk_pkgtmpl_init(&tmpl, db);
+		apk_name_array_resize(&names, hdr->num_names, hdr->num_names);
+	}
+
+	for (i = 0; i < hdr->num_repos; i++) {
+		struct apk_repository *repo = &db->repos[first_repo + i];
+
+		if (!apk_repo_cache_pull_struct(&b, &srepo, sizeof srepo)) goto err;
+		description = apk_repo_cache_pull_atom(db, &b, apply);
+		pkgname_spec = apk_repo_cache_pull_atom(db, &b, apply);
+		if (APK_BLOB_IS_NULL(b)) goto err;
+		if (!apply) continue;
+		repo->description = *description;
+		repo->pkgname_spec = *pkgname_spec;
+		repo->absolute_pkgname = srepo.absolute_pkgname;
+	}
+
+	for (i = 0; i < hdr->num_names; i++) {
+		uint16_t len;
+		if (!apk_repo_cache_pull_struct(&b, &len, sizeof len)) goto err;
+		v = apk_db_snapshot_pull(&b, len);
+		if (APK_BLOB_IS_NULL(v) || v.len == 0) goto err;
+		if (!apply) continue;
+		names->item[i] = apk_db_get_name(db, v);
+		if (!names->item[i]) goto err;
+	}
+
+	for (i = 0; i < hdr->num_names; i++) {
+		if (!apk_repo_cache_pull_struct(&b, &sname, sizeof sname)) goto err;
+		if (apply) {
+			name = names->item[i];
+			name->is_dependency |= sname.is_dependency;
+		}
+		apk_repo_cache_pull_names(&b, names, hdr->num_names, sname.num_rdepends,
+			apply ? &name->rdepends : NULL, apply);
+		apk_repo_cache_pull_names(&b, names, hdr->num_names, sname.num_rinstall_if,
+			apply ? &name->rinstall_if : NULL, apply);
+		if (APK_BLOB_IS_NULL(b)) goto err;
 	}
-	if (r < 0) goto err;
-	r = load_index(db, apk_istream_from_fd_url(open_fd, open_url, apk_db_url_since(db, 0)), repo_num);
-err:
-	if (r || update_error) {
-		if (repo->is_remote) {
-			if (r) db->repositories.unavailable++;
-			else db->repositories.stale++;
+
+	for (i = 0; i < hdr->num_packages; i++) {
+		if (!apk_repo_cache_pull_struct(&b, &spkg, sizeof spkg)) goto err;
+		if (spkg.name >= hdr->num_names) goto err;
+		if (apk_digest_alg_len(spkg.digest_alg) < APK_DIGEST_LENGTH_SHA1) goto err;
+		v = apk_db_snapshot_pull(&b, apk_digest_alg_len(spkg.digest_alg));
+		if (APK_BLOB_IS_NULL(v)) goto err;
+		if (apply) {
+			apk_digest_set(&tmpl.id, spkg.digest_alg);
+			memcpy(tmpl.id.data, v.ptr, v.len);
 		}
-		if (update_error)
-			error_action = r ? "updating and opening" : "updating";
-		else
-			update_error = r;
-		apk_warn(out, "%s " BLOB_FMT ": %s",
-			error_action, BLOB_PRINTF(repo->url_index_printable), apk_error_str(update_error));
+
+		tmpl.pkg.version = apk_repo_cache_pull_atom(db, &b, apply);
+		tmpl.pkg.arch = apk_repo_cache_pull_atom(db, &b, apply);
+		tmpl.pkg.license = apk_repo_cache_pull_atom(db, &b, apply);
+		tmpl.pkg.origin = apk_repo_cache_pull_atom(db, &b, apply);
+		tmpl.pkg.maintainer = apk_repo_cache_pull_atom(db, &b, apply);
+		tmpl.pkg.url = apk_repo_cache_pull_atom(db, &b, apply);
+		tmpl.pkg.description = apk_repo_cache_pull_atom(db, &b, apply);
+		tmpl.pkg.commit = apk_repo_cache_pull_atom(db, &b, apply);
+		for (j = 0; j < spkg.num_tags; j++) {
+			apk_blob_t *tag = apk_repo_cache_pull_atom(db, &b, apply);
+			if (APK_BLOB_IS_NULL(b)) goto err;
+			if (apply) apk_blobptr_array_add(&tmpl.pkg.tags, tag);
+		}
+		apk_repo_cache_pull_deps(db, &b, names, hdr->num_names, spkg.num_depends, &tmpl.pkg.depends, apply);
+		apk_repo_cache_pull_deps(db, &b, names, hdr->num_names, spkg.num_install_if, &tmpl.pkg.install_if, apply);
+		apk_repo_cache_pull_deps(db, &b, names, hdr->num_names, spkg.num_provides, &tmpl.pkg.provides, apply);
+		apk_repo_cache_pull_deps(db, &b, names, hdr->num_names, spkg.num_recommends, &tmpl.pkg.recommends, apply);
+		if (APK_BLOB_IS_NULL(b)) goto err;
+		if (!apply) continue;
+
+		tmpl.pkg.name = names->item[spkg.name];
+		tmpl.pkg.installed_size = spkg.installed_size;
+		tmpl.pkg.size = spkg.size;
+		tmpl.pkg.build_time = spkg.build_time;
+		tmpl.pkg.repos = spkg.repos;
+		tmpl.pkg.provider_priority = spkg.provider_priority;
+		tmpl.pkg.uninstallable = spkg.uninstallable;
+		if (!apk_db_pkg_add(db, &tmpl)) goto err;
 	}
-	if (r == 0) {
-		repo->available = 1;
-		db->available_repos |= available_repos;
-		for (unsigned int tag_id = 0, mask = repo->tag_mask; mask; mask >>= 1, tag_id++)
-			if (mask & 1) db->repo_tags[tag_id].allowed_repos |= repo_mask;
+	if (b.len != 0) goto err;
+
+	if (apply) {
+		db->compat_newfeatures |= hdr->compat_newfeatures;
+		db->compat_notinstallable |= hdr->compat_notinstallable;
+		db->compat_depversions |= hdr->compat_depversions;
 	}
+	r = 0;
+err:
+	if (apply) apk_pkgtmpl_free(&tmpl);
+	apk_name_array_free(&names);
+	return r;
 }
 
-static int add_repository(struct apk_database *db, apk_blob_t line)
+/* Loads the packages of num_repos repositories starting from first_repo.
+ * Returns zero on success, a positive value if the data is not valid for
+ * them, and a negative error if loading failed after some packages were
+ * added. */
+static int apk_repo_cache_load(struct apk_database *db, apk_blob_t b, struct apk_digest *key,
+	unsigned first_repo, unsigned num_repos)
 {
-	return apk_repoparser_parse(&db->repoparser, line, true);
+	struct apk_repo_cache_header hdr;
+	uint32_t magic;
+
+	if (b.len < sizeof hdr + sizeof magic) return 1;
+	memcpy(&hdr, b.ptr, sizeof hdr);
+	memcpy(&magic, b.ptr + b.len - sizeof magic, sizeof magic);
+	if (hdr.magic != APK_REPO_CACHE_MAGIC || hdr.version != APK_REPO_CACHE_VERSION ||
+	    magic != APK_REPO_CACHE_MAGIC || hdr.num_repos != num_repos) return 1;
+	if (key && memcmp(hdr.key, key->data, sizeof hdr.key) != 0) return 1;
+
+	b = APK_BLOB_PTR_LEN(b.ptr + sizeof hdr, b.len - sizeof hdr - sizeof magic);
+	if (apk_repo_cache_parse(db, b, &hdr, first_repo, false) != 0) return 1;
+	return apk_repo_cache_parse(db, b, &hdr, first_repo, true);
 }
 
-static int add_repos_from_file(void *ctx, int dirfd, const char *path, const char *file)
+/* Returns zero if the repositories were loaded from the cache, a positive
+ * value if the cache is missing, stale or otherwise unusable, and a negative
+ * error if loading it failed part way. */
+static int apk_repo_cache_read(struct apk_database *db, struct apk_digest *key)
 {
-	struct apk_database *db = (struct apk_database *) ctx;
-	struct apk_out *out = &db->ctx->out;
+	struct apk_istream *is;
 	int r;
 
-	apk_repoparser_set_file(&db->repoparser, file);
-	r = apk_db_parse_istream(db, apk_istream_from_file(dirfd, file), add_repository);
-	if (r != 0) {
-		if (dirfd != AT_FDCWD) return 0;
-		apk_err(out, "failed to read repositories: %s: %s", file, apk_error_str(r));
-		return r;
-	}
-	return 0;
+	is = apk_istream_from_file_mmap(db->cache_fd, APK_REPO_CACHE_FILE);
+	if (IS_ERR(is)) return 1;
+	r = apk_repo_cache_load(db, apk_istream_mmap(is), key, 0, db->num_repos);
+	apk_istream_close(is);
+	return r;
 }
 
-static void setup_cache_repository(struct apk_database *db, apk_blob_t cache_dir)
+struct repository_worker {
+	pid_t pid;
+	int fd, status;
+	struct apk_out_capture cap;
+};
+
+static void repository_worker_wait(struct repository_worker *w)
 {
-	db->filename_repository = (struct apk_repository) {};
-	db->cache_repository = (struct apk_repository) {
-		.url_base = cache_dir,
-		.url_printable = cache_dir,
-		.pkgname_spec = db->ctx->default_cachename_spec,
-		.absolute_pkgname = 1,
-	};
-	db->num_repo_tags = 1;
+	if (w->pid <= 0) return;
+	while (waitpid(w->pid, &w->status, 0) < 0 && errno == EINTR);
+	w->pid = 0;
 }
 
-static int apk_db_name_rdepends(apk_hash_item item, void *pctx)
+static bool repository_needs_update(struct apk_database *db, struct apk_repository *repo)
 {
-	struct apk_name *name = item, *rname;
-	struct apk_name *touched[128];
-	unsigned num_touched = 0;
+	return repo->is_remote && repo->stale && !(db->ctx->flags & APK_NO_CACHE);
+}
 
-	apk_array_foreach(p, name->providers) {
-		apk_array_foreach(dep, p->pkg->depends) {
-			rname = dep->name;
-			rname->is_dependency |= !apk_dep_conflict(dep);
-			if (!(rname->state_int & 1)) {
-				if (!rname->state_int) {
-					if (num_touched < ARRAY_SIZE(touched))
-						touched[num_touched] = rname;
-					num_touched++;
-				}
-				rname->state_int |= 1;
-				apk_name_array_add(&rname->rdepends, name);
+/* Downloads the stale indexes to the cache. With multiple stale indexes the
+ * downloads are done concurrently in forked workers, which pass the result
+ * back via shared memory. The results and the output of the workers are
+ * reported in repository order as before. */
+static void update_repositories(struct apk_database *db, int *update_error)
+{
+	struct repository_worker w[APK_MAX_REPOS];
+	unsigned i, oldest = 0, running = 0, num_stale = 0, max_jobs = db->ctx->jobs;
+	int *results = MAP_FAILED;
+
+	for (i = 0; i < db->num_repos; i++) {
+		w[i] = (struct repository_worker) { .fd = -1, .status = -1, .cap = APK_OUT_CAPTURE_INIT };
+		update_error[i] = 0;
+		if (repository_needs_update(db, &db->repos[i])) num_stale++;
+	}
+
+	if (num_stale > 1 && max_jobs > 1)
+		results = mmap(NULL, sizeof(int[APK_MAX_REPOS]), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (results != MAP_FAILED) {
+		fflush(NULL);
+		for (i = 0; i < db->num_repos; i++) {
+			if (!repository_needs_update(db, &db->repos[i])) continue;
+			if (running >= max_jobs) {
+				while (w[oldest].pid <= 0) oldest++;
+				repository_worker_wait(&w[oldest]);
+				running--;
+			}
+			apk_out_capture_init(&w[i].cap);
+			w[i].pid = fork();
+			if (w[i].pid == 0) {
+				apk_out_capture_start(&w[i].cap, &db->ctx->out);
+				results[i] = apk_cache_download(db, &db->repos[i], NULL, NULL);
+				fflush(NULL);
+				_exit(0);
+			}
+			if (w[i].pid < 0) {
+				apk_out_capture_free(&w[i].cap);
+				break;
 			}
+			running++;
 		}
-		apk_array_foreach(dep, p->pkg->install_if) {
-			rname = dep->name;
-			if (!(rname->state_int & 2)) {
-				if (!rname->state_int) {
-					if (num_touched < ARRAY_SIZE(touched))
-						touched[num_touched] = rname;
-					num_touched++;
-				}
-				rname->state_int |= 2;
-				apk_name_array_add(&rname->rinstall_if, name);
+		for (i = 0; i < db->num_repos; i++) repository_worker_wait(&w[i]);
+	}
+
+	for (i = 0; i < db->num_repos; i++) {
+		if (!repository_needs_update(db, &db->repos[i])) continue;
+		if (WIFEXITED(w[i].status) && WEXITSTATUS(w[i].status) == 0) {
+			apk_out_capture_flush(&w[i].cap, &db->ctx->out);
+			update_error[i] = results[i];
+			continue;
+		}
+		apk_out_capture_free(&w[i].cap);
+		update_error[i] = apk_cache_download(db, &db->repos[i], NULL, NULL);
+	}
+	if (results != MAP_FAILED) munmap(results, sizeof(int[APK_MAX_REPOS]));
+}
+
+/* Precedes the packages passed back by a worker */
+struct repository_worker_result {
+	int32_t r;
+	uint8_t rdepends;
+} __attribute__((packed));
+
+static void load_repository_worker(struct apk_database *db, int repo_num, struct apk_repository_open *ro, struct repository_worker *w)
+{
+	struct apk_repo_cache_header hdr = {
+		.magic = APK_REPO_CACHE_MAGIC,
+		.version = APK_REPO_CACHE_VERSION,
+	};
+	struct repository_worker_result res;
+	struct apk_ostream *os;
+	int r;
+
+	apk_out_capture_start(&w->cap, &db->ctx->out);
+	apk_array_truncate(db->repositories.packages, 0);
+	open_repository_load(db, repo_num, ro);
+
+	res = (struct repository_worker_result) {
+		.r = ro->r,
+		.rdepends = !!(db->rdepends_repos & BIT(repo_num)),
+	};
+	hdr.compat_newfeatures = db->compat_newfeatures;
+	hdr.compat_notinstallable = db->compat_notinstallable;
+	hdr.compat_depversions = db->compat_depversions;
+	os = apk_ostream_to_fd(w->fd);
+	apk_ostream_write(os, &res, sizeof res);
+	apk_repo_cache_serialize(db, os, &hdr, repo_num, 1);
+	r = apk_ostream_close(os);
+	fflush(NULL);
+	_exit(r < 0 ? 1 : 0);
+}
+
+/* Merges the packages passed back by a worker. Returns a positive value if
+ * the worker failed, and the index needs to be loaded in place instead. */
+static int load_repository_result(struct apk_database *db, int repo_num, struct apk_repository_open *ro, struct repository_worker *w)
+{
+	struct repository_worker_result res;
+	struct stat st;
+	char *ptr;
+	int ret = 1;
+
+	if (!WIFEXITED(w->status) || WEXITSTATUS(w->status) != 0) goto done;
+	if (fstat(w->fd, &st) < 0 || st.st_size < (off_t) sizeof res) goto done;
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, w->fd, 0);
+	if (ptr == MAP_FAILED) goto done;
+
+	memcpy(&res, ptr, sizeof res);
+	ret = apk_repo_cache_load(db, APK_BLOB_PTR_LEN(ptr + sizeof res, st.st_size - sizeof res), NULL, repo_num, 1);
+	if (ret <= 0) ro->r = res.r ?: ret;
+	if (ret == 0 && res.rdepends) db->rdepends_repos |= BIT(repo_num);
+	munmap(ptr, st.st_size);
+done:
+	close(w->fd);
+	return ret > 0;
+}
+
+/* Decompresses and decodes the indexes concurrently in forked workers. Each
+ * worker passes the packages of its index back in the repository cache
+ * format, and they are merged in repository order so that the packages and
+ * providers are in the same order as when loading the indexes serially.
+ * The output of the workers is replayed in the same order. */
+static void load_repositories(struct apk_database *db, struct apk_repository_open *ro)
+{
+	struct repository_worker w[APK_MAX_REPOS];
+	unsigned i, oldest = 0, running = 0, max_jobs = db->ctx->jobs;
+
+	for (i = 0; i < db->num_repos; i++)
+		w[i] = (struct repository_worker) { .fd = -1, .status = -1, .cap = APK_OUT_CAPTURE_INIT };
+
+	if (db->num_repos > 1 && max_jobs > 1) {
+		fflush(NULL);
+		for (i = 0; i < db->num_repos; i++) {
+			if (ro[i].r) continue;
+			if (running >= max_jobs) {
+				while (w[oldest].pid <= 0) oldest++;
+				repository_worker_wait(&w[oldest]);
+				running--;
+			}
+			w[i].fd = memfd_create("apk-index", MFD_CLOEXEC);
+			if (w[i].fd < 0) break;
+			apk_out_capture_init(&w[i].cap);
+			w[i].pid = fork();
+			if (w[i].pid == 0) load_repository_worker(db, i, &ro[i], &w[i]);
+			if (w[i].pid < 0) {
+				close(w[i].fd);
+				w[i].fd = -1;
+				apk_out_capture_free(&w[i].cap);
+				break;
 			}
+			running++;
 		}
+		for (i = 0; i < db->num_repos; i++) repository_worker_wait(&w[i]);
 	}
 
-	if (num_touched > ARRAY_SIZE(touched)) {
-		apk_array_foreach(p, name->providers) {
-			apk_array_foreach(dep, p->pkg->depends)
-				dep->name->state_int = 0;
-			apk_array_foreach(dep, p->pkg->install_if)
-				dep->name->state_int = 0;
+	for (i = 0; i < db->num_repos; i++) {
+		if (w[i].fd >= 0 && load_repository_result(db, i, &ro[i], &w[i]) == 0) {
+			apk_out_capture_flush(&w[i].cap, &db->ctx->out);
+			continue;
 		}
-	} else for (unsigned i = 0; i < num_touched; i++)
-		touched[i]->state_int = 0;
+		/* the output is repeated when loading in place */
+		apk_out_capture_free(&w[i].cap);
+		open_repository_load(db, i, &ro[i]);
+	}
+}
 
-	return 0;
+/* Opens all repositories. The reverse dependencies of the packages in them
+ * are built here only when writing the repository cache. */
+static void open_repositories(struct apk_database *db)
+{
+	struct apk_repository_open ro[APK_MAX_REPOS];
+	struct apk_repo_cache_header hdr = {
+		.magic = APK_REPO_CACHE_MAGIC,
+		.version = APK_REPO_CACHE_VERSION,
+	};
+	struct apk_digest key;
+	unsigned int loaded = 0;
+	bool cacheable, compat_newfeatures, compat_notinstallable, compat_depversions;
+	int update_error[APK_MAX_REPOS];
+	unsigned i;
+	int r;
+
+	update_repositories(db, update_error);
+	for (i = 0; i < db->num_repos; i++) open_repository_prepare(db, i, &ro[i], update_error[i]);
+
+	cacheable = db->cache_fd >= 0 && apk_repo_cache_key(db, ro, &key) == 0;
+	r = cacheable ? apk_repo_cache_read(db, &key) : 1;
+	if (r == 0) {
+		loaded = BIT(db->num_repos) - 1;
+		db->rdepends_repos = loaded;
+		goto done;
+	}
+	if (r < 0) {
+		/* Loading the indexes now would add the providers and reverse
+		 * dependencies of the packages already loaded again */
+		apk_warn(&db->ctx->out, "%s: %s", APK_REPO_CACHE_FILE, apk_error_str(r));
+		unlinkat(db->cache_fd, APK_REPO_CACHE_FILE, 0);
+		for (i = 0; i < db->num_repos; i++) ro[i].r = ro[i].r ?: r;
+		goto done;
+	}
+
+	/* Track the compatibility flags set by the indexes for the cache */
+	compat_newfeatures = db->compat_newfeatures;
+	compat_notinstallable = db->compat_notinstallable;
+	compat_depversions = db->compat_depversions;
+	db->compat_newfeatures = db->compat_notinstallable = db->compat_depversions = 0;
+
+	load_repositories(db, ro);
+	for (i = 0; i < db->num_repos; i++)
+		if (!ro[i].r) loaded |= BIT(i);
+
+	if (cacheable && loaded == BIT(db->num_repos) - 1) {
+		struct rdepends_ctx rctx = { .done = db->rdepends_repos, .todo = loaded };
+
+		apk_hash_foreach(&db->available.names, apk_db_name_rdepends_cb, &rctx);
+		db->rdepends_repos = loaded;
+		memcpy(hdr.key, key.data, sizeof hdr.key);
+		hdr.compat_newfeatures = db->compat_newfeatures;
+		hdr.compat_notinstallable = db->compat_notinstallable;
+		hdr.compat_depversions = db->compat_depversions;
+		/* The cache is not used unless it is complete and valid,
+		 * so errors writing it are not fatal. */
+		apk_repo_cache_write(db, &hdr);
+	}
+	db->compat_newfeatures |= compat_newfeatures;
+	db->compat_notinstallable |= compat_notinstallable;
+	db->compat_depversions |= compat_depversions;
+done:
+	for (i = 0; i < db->num_repos; i++) open_repository_complete(db, i, &ro[i]);
+	apk_package_array_free(&db->repositories.packages);
+	apk_name_array_free(&db->repositories.names);
 }
 
 #ifdef __linux__
@@ -1954,6 +3773,7 @@ void apk_db_init(struct apk_database *db, struct apk_ctx *ac)
 	apk_balloc_init(&db->ba_pkgs, sizeof(struct apk_package) * 256);
 	apk_balloc_init(&db->ba_deps, sizeof(struct apk_dependency) * 256);
 	apk_balloc_init(&db->ba_files, (sizeof(struct apk_db_file) + 32) * 256);
+	db->ba_files.hugepages = 1;
 	apk_hash_init(&db->available.names, &pkg_name_hash_ops, 20000);
 	apk_hash_init(&db->available.packages, &pkg_info_hash_ops, 10000);
 	apk_hash_init(&db->installed.dirs, &dir_hash_ops, 20000);
@@ -1964,6 +3784,15 @@ void apk_db_init(struct apk_database *db, struct apk_ctx *ac)
 	apk_db_dir_instance_array_init(&db->ic.diris);
 	apk_db_file_array_init(&db->ic.files);
 	apk_protected_path_array_init(&db->ic.ppaths);
+	apk_db_prefetch_array_init(&db->prefetch);
+	apk_db_lazy_files_array_init(&db->installed.lazy_files);
+	for (int i = 0; i < APK_DB_LAYER_NUM; i++) {
+		apk_db_journal_entry_array_init(&db->installed.journal[i].entries);
+		apk_package_array_init(&db->installed.journal[i].packages);
+		db->installed.scripts[i].fd = -1;
+	}
+	apk_package_array_init(&db->repositories.packages);
+	apk_name_array_init(&db->repositories.names);
 	list_init(&db->installed.packages);
 	list_init(&db->installed.triggers);
 	apk_protected_path_array_init(&db->protected_paths);
@@ -2145,14 +3974,12 @@ int apk_db_open(struct apk_database *db)
 			add_repos_from_file(db, AT_FDCWD, NULL, ac->repositories_file);
 		}
 	}
-	for (i = 0; i < db->num_repos; i++) open_repository(db, i);
+	open_repositories(db);
 	apk_out_progress_note(out, NULL);
 
 	if (!(ac->open_flags & APK_OPENF_NO_SYS_REPOS) && db->repositories.updated > 0)
 		apk_db_index_write_nr_cache(db);
 
-	apk_hash_foreach(&db->available.names, apk_db_name_rdepends, db);
-
 	if (apk_db_cache_active(db) && (ac->open_flags & (APK_OPENF_NO_REPOS|APK_OPENF_NO_INSTALLED)) == 0)
 		apk_db_cache_foreach_item(db, mark_in_cache);
 
@@ -2191,25 +4018,75 @@ static int apk_db_write_layers(struct apk_database *db)
 {
 	struct layer_data {
 		int fd;
-		struct apk_ostream *installed, *scripts, *triggers;
+		bool journal;
+		uint64_t journal_size;
+		struct apk_ostream *installed, *triggers;
 	} layers[APK_DB_LAYER_NUM] = {0};
+	struct fdb_digest {
+		uint8_t digest[APK_DIGEST_LENGTH_SHA1];
+		bool changed;
+	} *digests;
+	struct apk_digest_ctx dctx;
 	struct apk_ostream *os;
 	struct apk_package_array *pkgs;
+	struct stat st;
 	int i, r, rr = 0;
 
+	r = apk_db_load_files(db);
+	if (r < 0) return r;
+	pkgs = apk_db_sorted_installed_packages(db);
+
+	/* Find the packages changed since the database was written. Only
+	 * the packages modified since are serialized to compare the entry
+	 * digest, and only the changed entries are appended to the journal
+	 * when journaling. */
+	digests = calloc(apk_array_len(pkgs) ?: 1, sizeof *digests);
+	if (!digests) return -ENOMEM;
+	for (i = 0; i < APK_DB_LAYER_NUM; i++)
+		layers[i].journal = (db->ctx->flags & APK_JOURNAL) && db->installed.journal[i].base_size;
+	apk_digest_ctx_init(&dctx, APK_DIGEST_SHA1);
+	for (i = 0; i < apk_array_len(pkgs); i++) {
+		struct apk_installed_package *ipkg = pkgs->item[i]->ipkg;
+		struct layer_data *ld = &layers[pkgs->item[i]->layer];
+		uint64_t size;
+
+		if (!ipkg->fdb_dirty) continue;
+		if (apk_db_fdb_digest(db, ipkg, &dctx, digests[i].digest, &size) < 0) {
+			ld->journal = false;
+		} else if (memcmp(digests[i].digest, ipkg->fdb_digest, sizeof ipkg->fdb_digest) != 0) {
+			digests[i].changed = true;
+			ld->journal_size += size;
+		}
+	}
+	apk_digest_ctx_free(&dctx);
+
 	for (i = 0; i < APK_DB_LAYER_NUM; i++) {
 		struct layer_data *ld = &layers[i];
+		struct apk_db_journal *j = &db->installed.journal[i];
 		if (!(db->active_layers & BIT(i))) continue;
 
 		ld->fd = openat(db->root_fd, apk_db_layer_name(i), O_DIRECTORY | O_RDONLY | O_CLOEXEC);
 		if (ld->fd < 0) {
-			if (i == APK_DB_LAYER_ROOT) return -errno;
+			if (i == APK_DB_LAYER_ROOT) {
+				free(digests);
+				return -errno;
+			}
 			continue;
 		}
-		ld->installed = apk_ostream_to_file(ld->fd, "installed", 0644);
+
+		/* Merge the journal when it has grown to a quarter of the
+		 * installed database, or it cannot be appended to */
+		apk_array_foreach_item(pkg, j->packages)
+			if (!pkg->ipkg || pkg->layer != i) ld->journal_size += APK_BLOB_DIGEST_BUF;
+		if (ld->journal && !apk_db_journal_appendable(db, ld->fd, i, ld->journal_size)) ld->journal = false;
+		if (ld->journal && ld->journal_size) {
+			ld->installed = apk_db_journal_append(db, ld->fd, i);
+			if (IS_ERR(ld->installed)) ld->journal = false;
+			else apk_db_journal_write_removed(db, i, ld->installed);
+		}
+		if (!ld->journal) ld->installed = apk_ostream_to_file(ld->fd, "installed", 0644);
+
 		ld->triggers  = apk_ostream_to_file(ld->fd, "triggers", 0644);
-		if (db->scripts_tar) ld->scripts = apk_ostream_to_file(ld->fd, "scripts.tar", 0644);
-		else ld->scripts = apk_ostream_gzip(apk_ostream_to_file(ld->fd, "scripts.tar.gz", 0644));
 
 		if (i == APK_DB_LAYER_ROOT)
 			os = apk_ostream_to_file(db->root_fd, apk_world_file, 0644);
@@ -2225,28 +4102,47 @@ static int apk_db_write_layers(struct apk_database *db)
 		if (!rr) rr = r;
 	}
 
-	pkgs = apk_db_sorted_installed_packages(db);
-	apk_array_foreach_item(pkg, pkgs) {
+	for (i = 0; i < apk_array_len(pkgs); i++) {
+		struct apk_package *pkg = pkgs->item[i];
 		struct layer_data *ld = &layers[pkg->layer];
 		if (!ld->fd) continue;
-		apk_db_fdb_write(db, pkg->ipkg, ld->installed);
-		apk_db_scriptdb_write(db, pkg->ipkg, ld->scripts);
+		if (!ld->journal || digests[i].changed)
+			apk_db_fdb_write(db, pkg->ipkg, ld->installed);
 		apk_db_triggers_write(db, pkg->ipkg, ld->triggers);
 	}
 
 	for (i = 0; i < APK_DB_LAYER_NUM; i++) {
 		struct layer_data *ld = &layers[i];
+		struct apk_db_journal *j = &db->installed.journal[i];
 		if (!(db->active_layers & BIT(i))) continue;
 
-		if (!IS_ERR(ld->installed))
+		if (!ld->installed)
+			r = 0;
+		else if (!IS_ERR(ld->installed))
 			r = apk_ostream_close(ld->installed);
 		else	r = PTR_ERR(ld->installed);
 		if (!rr) rr = r;
+		if (r == 0) {
+			for (int k = 0; k < apk_array_len(pkgs); k++) {
+				struct apk_package *pkg = pkgs->item[k];
+				if (pkg->layer != i || !pkg->ipkg->fdb_dirty) continue;
+				memcpy(pkg->ipkg->fdb_digest, digests[k].digest, sizeof digests[k].digest);
+				pkg->ipkg->fdb_dirty = 0;
+			}
+			apk_db_journal_set_packages(db, i);
+		}
+		if (r == 0 && ld->journal) {
+			if (fstatat(ld->fd, APK_DB_JOURNAL_FILE, &st, 0) == 0) j->size = st.st_size;
+		} else if (r == 0) {
+			/* The snapshot is only a cache, and is not used unless it
+			 * matches the installed db just written. */
+			apk_db_snapshot_write(db, ld->fd, i, pkgs);
+			if (unlinkat(ld->fd, APK_DB_JOURNAL_FILE, 0) < 0 && errno != ENOENT && !rr) rr = -errno;
+			j->size = 0;
+			if (fstatat(ld->fd, "installed", &st, 0) == 0) j->base_size = st.st_size;
+		}
 
-		if (!IS_ERR(ld->scripts)) {
-			apk_tar_write_entry(ld->scripts, NULL, NULL);
-			r = apk_ostream_close(ld->scripts);
-		} else	r = PTR_ERR(ld->scripts);
+		r = apk_db_scriptdb_write(db, ld->fd, i, pkgs);
 		if (!rr) rr = r;
 
 		if (!IS_ERR(ld->triggers))
@@ -2256,6 +4152,7 @@ static int apk_db_write_layers(struct apk_database *db)
 
 		close(ld->fd);
 	}
+	free(digests);
 	return rr;
 }
 
@@ -2288,6 +4185,10 @@ int apk_db_write_config(struct apk_database *db)
 		apk_err(out, "Refusing to write db without write lock!");
 		return -1;
 	}
+	if (apk_db_load_files(db) < 0) {
+		apk_err(out, "Refusing to write db without installed files!");
+		return -1;
+	}
 
 	if (db->write_arch) {
 		r = apk_db_write_arch(db);
@@ -2320,7 +4221,19 @@ void apk_db_close(struct apk_database *db)
 	apk_db_dir_instance_array_free(&db->ic.diris);
 	apk_db_file_array_free(&db->ic.files);
 	apk_protected_path_array_free(&db->ic.ppaths);
+	apk_db_prefetch_cancel(db);
+	apk_db_prefetch_array_free(&db->prefetch);
 	apk_dependency_array_free(&db->world);
+	apk_db_lazy_files_array_free(&db->installed.lazy_files);
+	apk_db_lazy_files_close(db);
+	for (int i = 0; i < APK_DB_LAYER_NUM; i++) {
+		apk_db_journal_entry_array_free(&db->installed.journal[i].entries);
+		apk_package_array_free(&db->installed.journal[i].packages);
+		free(db->installed.journal[i].data.ptr);
+		if (db->installed.scripts[i].fd >= 0) close(db->installed.scripts[i].fd);
+	}
+	apk_package_array_free(&db->repositories.packages);
+	apk_name_array_free(&db->repositories.names);
 
 	apk_repoparser_free(&db->repoparser);
 	apk_name_array_free(&db->available.sorted_names);
@@ -2407,6 +4320,7 @@ static int fire_triggers(apk_hash_item item, void *ctx)
 
 int apk_db_fire_triggers(struct apk_database *db)
 {
+	apk_db_load_files(db);
 	apk_hash_foreach(&db->installed.dirs, fire_triggers, db);
 	return db->pending_triggers;
 }
@@ -2470,6 +4384,7 @@ int apk_db_run_script(struct apk_database *db, const char *hook_type, const char
 		execve(path, argv, envp);
 		script_panic("execve");
 	}
+	db->scripts_run = 1;
 	r = apk_process_run(&p);
 err:
 	apk_array_truncate(ac->script_environment, env_size_save);
@@ -2599,6 +4514,7 @@ struct apk_package *apk_db_get_file_owner(struct apk_database *db,
 	struct apk_db_file *dbf;
 	struct apk_db_file_hash_key key;
 
+	apk_db_load_files(db);
 	filename = apk_blob_trim_start(filename, '/');
 	if (!apk_blob_rsplit(filename, '/', &key.dirname, &key.filename)) {
 		key.dirname = APK_BLOB_NULL;
@@ -2663,6 +4579,9 @@ struct install_ctx {
 
 	struct apk_extract_ctx ectx;
 
+	apk_blob_t staged;
+	const char *staged_file;
+	struct apk_digest staged_digest;
 	uint64_t installed_size;
 };
 
@@ -2673,6 +4592,55 @@ static void apk_db_run_pending_script(struct install_ctx *ctx)
 	apk_ipkg_run_script(ctx->ipkg, ctx->db, ctx->script, ctx->script_args);
 }
 
+static void apk_db_cancel_staged(struct apk_database *db, struct apk_package *pkg, const char *name);
+
+/* Each staged file is listed by its name, followed by the digest of the
+ * extracted data once the extraction is done. The digest is left out if
+ * the worker was interrupted, and is empty if the extraction failed. */
+static bool apk_db_staged_next(apk_blob_t *staged, const char **name, struct apk_digest *digest)
+{
+	char *end = memchr(staged->ptr, 0, staged->len);
+	size_t len;
+
+	if (!end) return false;
+	*name = staged->ptr;
+	len = end + 1 - staged->ptr;
+	if (staged->len - len >= sizeof *digest) {
+		memcpy(digest, &staged->ptr[len], sizeof *digest);
+		len += sizeof *digest;
+	} else {
+		apk_digest_reset(digest);
+		len = staged->len;
+	}
+	*staged = APK_BLOB_PTR_LEN(staged->ptr + len, staged->len - len);
+	return true;
+}
+
+/* The files staged by the prefetch worker are listed in the archive order.
+ * A staged file not used by the install is removed. */
+static void apk_db_take_staged(struct install_ctx *ctx, const char *name)
+{
+	apk_blob_t staged = ctx->staged;
+	const char *staged_name;
+
+	if (ctx->staged_file) apk_db_cancel_staged(ctx->db, ctx->pkg, ctx->staged_file);
+	ctx->staged_file = NULL;
+	if (!apk_db_staged_next(&staged, &staged_name, &ctx->staged_digest) || strcmp(staged_name, name) != 0) return;
+	ctx->staged_file = staged_name;
+	ctx->staged = staged;
+}
+
+static bool apk_db_use_staged(struct install_ctx *ctx, const struct apk_file_info *ae)
+{
+	struct apk_database *db = ctx->db;
+
+	if (!ctx->staged_file) return false;
+	if (apk_digest_cmp_blob(&ae->digest, ctx->staged_digest.alg, APK_DIGEST_BLOB(ctx->staged_digest)) != 0) return false;
+	if (apk_fs_check_staged(db->ctx, ae, db->extract_flags, apk_pkg_ctx(ctx->pkg)) != 0) return false;
+	apk_dbg2(&db->ctx->out, "%s: using staged file", ae->name);
+	return true;
+}
+
 static int read_info_line(void *_ctx, apk_blob_t line)
 {
 	struct install_ctx *ctx = (struct install_ctx *) _ctx;
@@ -2707,6 +4675,16 @@ static int contains_control_character(const char *str)
 	return 0;
 }
 
+static bool apk_db_file_name_valid(const char *name)
+{
+	static const char dot1[] = "/./", dot2[] = "/../";
+
+	return !(name[0] == '/' || contains_control_character(name) ||
+		 strncmp(name, &dot1[1], 2) == 0 ||
+		 strncmp(name, &dot2[1], 3) == 0 ||
+		 strstr(name, dot1) || strstr(name, dot2));
+}
+
 static int apk_db_install_v2meta(struct apk_extract_ctx *ectx, struct apk_istream *is)
 {
 	struct install_ctx *ctx = container_of(ectx, struct install_ctx, ectx);
@@ -2775,7 +4753,6 @@ static int apk_db_install_script(struct apk_extract_ctx *ectx, unsigned int type
 static int apk_db_install_file(struct apk_extract_ctx *ectx, const struct apk_file_info *ae, struct apk_istream *is)
 {
 	struct install_ctx *ctx = container_of(ectx, struct install_ctx, ectx);
-	static const char dot1[] = "/./", dot2[] = "/../";
 	struct apk_database *db = ctx->db;
 	struct apk_ctx *ac = db->ctx;
 	struct apk_out *out = &ac->out;
@@ -2787,12 +4764,10 @@ static int apk_db_install_file(struct apk_extract_ctx *ectx, const struct apk_fi
 	int ret = 0, r;
 
 	apk_db_run_pending_script(ctx);
+	apk_db_take_staged(ctx, ae->name);
 
 	/* Sanity check the file name */
-	if (ae->name[0] == '/' || contains_control_character(ae->name) ||
-	    strncmp(ae->name, &dot1[1], 2) == 0 ||
-	    strncmp(ae->name, &dot2[1], 3) == 0 ||
-	    strstr(ae->name, dot1) || strstr(ae->name, dot2)) {
+	if (!apk_db_file_name_valid(ae->name)) {
 		apk_warn(out, PKG_VER_FMT": ignoring malicious file %s",
 			PKG_VER_PRINTF(pkg), ae->name);
 		ipkg->broken_files = 1;
@@ -2860,7 +4835,11 @@ static int apk_db_install_file(struct apk_extract_ctx *ectx, const struct apk_fi
 		apk_dbg2(out, "%s", ae->name);
 
 		file->acl = apk_db_acl_atomize_digest(db, ae->mode, ae->uid, ae->gid, &ae->xattr_digest);
-		r = apk_fs_extract(ac, ae, is, db->extract_flags, apk_pkg_ctx(pkg));
+		if (apk_db_use_staged(ctx, ae))
+			r = 0;
+		else
+			r = apk_fs_extract(ac, ae, is, db->extract_flags, apk_pkg_ctx(pkg));
+		ctx->staged_file = NULL;
 		if (r > 0) {
 			char buf[APK_EXTRACTW_BUFSZ];
 			if (r & APK_EXTRACTW_XATTR) ipkg->broken_xattr = 1;
@@ -3113,6 +5092,218 @@ static void apk_db_migrate_files(struct apk_database *db,
 		prio = apk_db_migrate_files_for_priority(db, ipkg, prio, fileids);
 }
 
+struct stage_ctx {
+	struct apk_database *db;
+	struct apk_package *pkg;
+	struct apk_extract_ctx ectx;
+	int fd;
+	bool disabled;
+};
+
+static int apk_db_stage_v2meta(struct apk_extract_ctx *ectx, struct apk_istream *is)
+{
+	return 0;
+}
+
+static int apk_db_stage_v3meta(struct apk_extract_ctx *ectx, struct adb_obj *pkg)
+{
+	struct stage_ctx *ctx = container_of(ectx, struct stage_ctx, ectx);
+	struct adb_obj scripts;
+
+	adb_ro_obj(pkg, ADBI_PKG_SCRIPTS, &scripts);
+	if (!APK_BLOB_IS_NULL(adb_ro_blob(&scripts, ADBI_SCRPT_PREINST)) ||
+	    !APK_BLOB_IS_NULL(adb_ro_blob(&scripts, ADBI_SCRPT_PREUPGRADE)))
+		ctx->disabled = true;
+	return 0;
+}
+
+static int apk_db_stage_script(struct apk_extract_ctx *ectx, unsigned int type, uint64_t size, struct apk_istream *is)
+{
+	struct stage_ctx *ctx = container_of(ectx, struct stage_ctx, ectx);
+
+	if (type == APK_SCRIPT_PRE_INSTALL || type == APK_SCRIPT_PRE_UPGRADE) ctx->disabled = true;
+	return 0;
+}
+
+static void apk_db_cancel_staged(struct apk_database *db, struct apk_package *pkg, const char *name)
+{
+	apk_blob_t bdir, bfile, bname = APK_BLOB_STR(name);
+	struct apk_fsdir d;
+
+	if (!apk_blob_rsplit(bname, '/', &bdir, &bfile)) {
+		bdir = APK_BLOB_PTR_LEN(bname.ptr, 0);
+		bfile = bname;
+	}
+	apk_fsdir_get(&d, bdir, db->extract_flags, db->ctx, apk_pkg_ctx(pkg));
+	apk_fsdir_file_control(&d, bfile, APK_FS_CTRL_CANCEL);
+}
+
+/* Extracts the regular files to their temporary names. The name is recorded
+ * before the extraction so that an interrupted worker can be cleaned up, and
+ * the digest of the verified data after it. */
+static int apk_db_stage_file(struct apk_extract_ctx *ectx, const struct apk_file_info *ae, struct apk_istream *is)
+{
+	struct stage_ctx *ctx = container_of(ectx, struct stage_ctx, ectx);
+	struct apk_database *db = ctx->db;
+	struct apk_digest digest = { .alg = APK_DIGEST_NONE };
+
+	if (ctx->disabled || !is || !apk_db_file_name_valid(ae->name) || !apk_fs_can_stage(ae)) return 0;
+	if (apk_write_fully(ctx->fd, ae->name, strlen(ae->name) + 1) < 0) {
+		ctx->disabled = true;
+		return 0;
+	}
+	if (apk_fs_extract(db->ctx, ae, is, db->extract_flags, apk_pkg_ctx(ctx->pkg)) == 0)
+		digest = ae->digest;
+	else
+		apk_db_cancel_staged(db, ctx->pkg, ae->name);
+	if (apk_write_fully(ctx->fd, &digest, sizeof digest) < 0) ctx->disabled = true;
+	return 0;
+}
+
+static const struct apk_extract_ops extract_stager = {
+	.v2meta = apk_db_stage_v2meta,
+	.v3meta = apk_db_stage_v3meta,
+	.script = apk_db_stage_script,
+	.file = apk_db_stage_file,
+};
+
+static void apk_db_prefetch_worker(struct apk_database *db, struct apk_db_prefetch *pf)
+{
+	struct apk_out *out = &db->ctx->out;
+	struct apk_package *pkg = pf->pkg;
+	struct stage_ctx ctx = {
+		.db = db,
+		.pkg = pkg,
+		.fd = pf->staged_fd,
+	};
+	struct apk_istream *is;
+	char file_url[PATH_MAX];
+	int r, file_fd;
+
+	apk_out_capture_start(&pf->cap, out);
+	out->log = NULL;
+	r = apk_repo_package_url(db, apk_db_select_repo(db, pkg), pkg, &file_fd, file_url, sizeof file_url);
+	if (r == 0) {
+		is = apk_istream_from_fd_url(file_fd, file_url, apk_db_url_since(db, 0));
+		if (pf->fd >= 0) is = apk_istream_tee(is, apk_ostream_to_fd(pf->fd), 0);
+		apk_extract_init(&ctx.ectx, db->ctx, pf->staged_fd >= 0 ? &extract_stager : NULL);
+		apk_extract_verify_identity(&ctx.ectx, pkg->digest_alg, apk_pkg_digest_blob(pkg));
+		r = apk_extract(&ctx.ectx, is);
+	}
+	_exit(r == 0 ? 0 : 1);
+}
+
+/* Starts a forked worker which downloads and verifies the package, and
+ * stores it in a memfd for apk_db_unpack_pkg to consume later. The output
+ * of the worker is written out when the package is installed. With
+ * APK_DB_PREFETCH_STAGE, the worker also extracts the regular files of
+ * the package to their temporary names unless the package has a script
+ * which needs to run before the files are extracted. */
+int apk_db_prefetch_pkg(struct apk_database *db, struct apk_package *pkg, unsigned int flags)
+{
+	struct apk_db_prefetch pf = { .pkg = pkg, .fd = -1, .staged_fd = -1, .cap = APK_OUT_CAPTURE_INIT };
+	int r;
+
+	if (flags & APK_DB_PREFETCH_DOWNLOAD) {
+		pf.fd = memfd_create("apk-pkg", MFD_CLOEXEC);
+		if (pf.fd < 0) return -errno;
+	}
+	if (flags & APK_DB_PREFETCH_STAGE) {
+		pf.staged_fd = memfd_create("apk-staged", MFD_CLOEXEC);
+		if (pf.staged_fd < 0) {
+			r = -errno;
+			goto err;
+		}
+	}
+	apk_io_url_close_connections();
+	apk_out_capture_init(&pf.cap);
+	fflush(NULL);
+	pf.pid = fork();
+	if (pf.pid == 0) apk_db_prefetch_worker(db, &pf);
+	if (pf.pid < 0) {
+		r = -errno;
+		goto err;
+	}
+	apk_db_prefetch_array_add(&db->prefetch, pf);
+	return 0;
+err:
+	if (pf.fd >= 0) close(pf.fd);
+	if (pf.staged_fd >= 0) close(pf.staged_fd);
+	apk_out_capture_free(&pf.cap);
+	return r;
+}
+
+static apk_blob_t apk_db_prefetch_staged(struct apk_db_prefetch *pf)
+{
+	apk_blob_t b = APK_BLOB_NULL;
+	off_t size;
+
+	if (pf->staged_fd < 0) return b;
+	size = lseek(pf->staged_fd, 0, SEEK_END);
+	if (size > 0 && (b.ptr = malloc(size)) != NULL) {
+		if (pread(pf->staged_fd, b.ptr, size, 0) == size) b.len = size;
+	}
+	close(pf->staged_fd);
+	pf->staged_fd = -1;
+	return b;
+}
+
+static void apk_db_cancel_all_staged(struct apk_database *db, struct apk_package *pkg, apk_blob_t staged)
+{
+	struct apk_digest digest;
+	const char *name;
+
+	while (apk_db_staged_next(&staged, &name, &digest))
+		apk_db_cancel_staged(db, pkg, name);
+}
+
+static void apk_db_prefetch_free(struct apk_database *db, struct apk_db_prefetch *pf)
+{
+	apk_blob_t staged = apk_db_prefetch_staged(pf);
+	apk_db_cancel_all_staged(db, pf->pkg, staged);
+	free(staged.ptr);
+	if (pf->fd >= 0) close(pf->fd);
+	apk_out_capture_free(&pf->cap);
+}
+
+void apk_db_prefetch_cancel(struct apk_database *db)
+{
+	apk_array_foreach(pf, db->prefetch) {
+		kill(pf->pid, SIGTERM);
+		while (waitpid(pf->pid, NULL, 0) < 0 && errno == EINTR);
+		apk_db_prefetch_free(db, pf);
+	}
+	apk_array_truncate(db->prefetch, 0);
+}
+
+/* Waits for the package prefetch to complete. Returns NULL if the package
+ * was not downloaded or the prefetch failed, and the package needs to be
+ * streamed from the repository instead. The names of the staged files are
+ * returned in the staged blob. */
+static struct apk_istream *apk_db_prefetched_istream(struct apk_database *db, struct apk_package *pkg, apk_blob_t *staged)
+{
+	struct apk_istream *is = NULL;
+	int status = -1;
+
+	apk_array_foreach(pf, db->prefetch) {
+		if (pf->pkg != pkg) continue;
+		while (waitpid(pf->pid, &status, 0) < 0 && errno == EINTR);
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			apk_out_capture_flush(&pf->cap, &db->ctx->out);
+			*staged = apk_db_prefetch_staged(pf);
+			if (pf->fd >= 0 && lseek(pf->fd, 0, SEEK_SET) == 0) {
+				is = apk_istream_from_fd(pf->fd);
+				pf->fd = -1;
+			}
+		}
+		apk_db_prefetch_free(db, pf);
+		*pf = db->prefetch->item[apk_array_len(db->prefetch) - 1];
+		apk_array_truncate(db->prefetch, apk_array_len(db->prefetch) - 1);
+		break;
+	}
+	return is;
+}
+
 static int apk_db_unpack_pkg(struct apk_database *db,
 			     struct apk_installed_package *ipkg,
 			     int upgrade, struct apk_progress *prog,
@@ -3124,6 +5315,7 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 	struct apk_istream *is = NULL;
 	struct apk_repository *repo;
 	struct apk_package *pkg = ipkg->pkg;
+	apk_blob_t staged = APK_BLOB_NULL;
 	char file_url[PATH_MAX], cache_url[NAME_MAX];
 	int r, file_fd = AT_FDCWD, cache_fd = AT_FDCWD;
 	bool need_copy = false;
@@ -3137,12 +5329,20 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 	if (r < 0) goto err_msg;
 	if (apk_db_cache_active(db) && !pkg->cached && !(pkg->repos & db->local_repos)) need_copy = true;
 
-	is = apk_istream_from_fd_url(file_fd, file_url, apk_db_url_since(db, 0));
+	is = apk_db_prefetched_istream(db, pkg, &staged);
+	if (!is) {
+		// Cached packages are mapped so that uncompressed file data
+		// can be copied directly from the package file. Other files
+		// are streamed as truncating a mapped file raises SIGBUS.
+		const char *fn = repo != &db->cache_repository ? NULL : apk_url_local_file(file_url, sizeof file_url);
+		if (fn) is = apk_istream_from_file_mmap(file_fd, fn);
+		else is = apk_istream_from_fd_url(file_fd, file_url, apk_db_url_since(db, 0));
+	}
 	if (IS_ERR(is)) {
 		r = PTR_ERR(is);
 		if (r == -ENOENT && !pkg->filename_ndx)
 			r = -APKE_INDEX_STALE;
-		goto err_msg;
+		goto err_staged;
 	}
 	is = apk_progress_istream(&pis, is, prog);
 	if (need_copy) {
@@ -3163,14 +5363,21 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 		.script = upgrade ?
 			APK_SCRIPT_PRE_UPGRADE : APK_SCRIPT_PRE_INSTALL,
 		.script_args = script_args,
+		.staged = staged,
 	};
 	apk_extract_init(&ctx.ectx, db->ctx, &extract_installer);
 	apk_extract_verify_identity(&ctx.ectx, pkg->digest_alg, apk_pkg_digest_blob(pkg));
 	r = apk_extract(&ctx.ectx, is);
+	if (ctx.staged_file) apk_db_cancel_staged(db, pkg, ctx.staged_file);
+	apk_db_cancel_all_staged(db, pkg, ctx.staged);
+	free(staged.ptr);
 	if (need_copy && r == 0) pkg->cached = 1;
 	if (r != 0) goto err_msg;
 	apk_db_run_pending_script(&ctx);
 	return 0;
+err_staged:
+	apk_db_cancel_all_staged(db, pkg, staged);
+	free(staged.ptr);
 err_msg:
 	apk_err(out, PKG_VER_FMT": %s", PKG_VER_PRINTF(pkg), apk_error_str(r));
 	return r;
@@ -3184,6 +5391,7 @@ int apk_db_install_pkg(struct apk_database *db, struct apk_package *oldpkg,
 	struct fileid_array *fileids;
 	int r = 0;
 
+	apk_db_load_files(db);
 	fileid_array_init(&fileids);
 
 	/* Upgrade script gets two args: <new-pkg> <old-pkg> */
@@ -3208,6 +5416,7 @@ int apk_db_install_pkg(struct apk_database *db, struct apk_package *oldpkg,
 
 	/* Install the new stuff */
 	ipkg = apk_db_ipkg_create(db, newpkg);
+	ipkg->fdb_dirty = 1;
 	ipkg->run_all_triggers = 1;
 	ipkg->broken_script = 0;
 	ipkg->broken_files = 0;
@@ -10,6 +10,11 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include "apk_fs.h"
 #include "apk_xattr.h"
 #include "apk_extract.h"
@@ -92,6 +97,44 @@ static int is_system_xattr(const char *name)
 	return strncmp(name, "user.", 5) != 0;
 }
 
+/* Places the file data from a memory mapped, uncompressed package file
+ * by cloning the extents or copying it in the kernel. Returns 1 if the
+ * data needs to be written from the stream instead. */
+static int fsys_copy_mapped(int fd, struct apk_istream *is, uint64_t size)
+{
+	uint64_t left = size;
+	off_t src_off;
+	ssize_t r;
+	int src_fd;
+
+	if (apk_istream_mapped_range(is, size, &src_fd, &src_off) != 0) return 1;
+#ifdef FICLONERANGE
+	// Extents can be shared only if the data is block aligned
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_blksize > 0 &&
+	    src_off % st.st_blksize == 0 && size % st.st_blksize == 0) {
+		struct file_clone_range fcr = {
+			.src_fd = src_fd,
+			.src_offset = src_off,
+			.src_length = size,
+		};
+		if (ioctl(fd, FICLONERANGE, &fcr) == 0) goto done;
+	}
+#endif
+	while (left) {
+		r = copy_file_range(src_fd, &src_off, fd, NULL, left, 0);
+		if (r <= 0) goto fallback;
+		left -= r;
+	}
+done:
+	r = apk_istream_skip(is, size);
+	return r < 0 ? r : 0;
+fallback:
+	if (left == size) return 1;
+	if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) return -errno;
+	return 1;
+}
+
 static int fsys_file_extract(struct apk_ctx *ac, const struct apk_file_info *fi, struct apk_istream *is, unsigned int extract_flags, apk_blob_t pkgctx)
 {
 	char tmpname_file[TMPNAME_MAX], tmpname_linktarget[TMPNAME_MAX];
@@ -117,10 +160,17 @@ static int fsys_file_extract(struct apk_ctx *ac, const struct apk_file_info *fi,
 			int fd = openat(atfd, fn, flags, fi->mode & 07777);
 			if (fd < 0) return -errno;
 
-			struct apk_ostream *os = apk_ostream_to_fd(fd);
-			if (IS_ERR(os)) return PTR_ERR(os);
-			apk_stream_copy(is, os, fi->size, 0);
-			r = apk_ostream_close(os);
+			r = fsys_copy_mapped(fd, is, fi->size);
+			if (r == 0) {
+				if (close(fd) != 0) r = -errno;
+			} else if (r < 0) {
+				close(fd);
+			} else {
+				struct apk_ostream *os = apk_ostream_to_fd(fd);
+				if (IS_ERR(os)) return PTR_ERR(os);
+				apk_stream_copy(is, os, fi->size, 0);
+				r = apk_ostream_close(os);
+			}
 			if (r < 0) {
 				unlinkat(atfd, fn, 0);
 				return r;
@@ -246,6 +296,28 @@ static int fsys_file_info(struct apk_fsdir *d, apk_blob_t filename,
 	return r;
 }
 
+/* Checks that the file extracted earlier to the temporary name is still
+ * there with the expected metadata and data */
+static int fsys_file_check_staged(struct apk_ctx *ac, const struct apk_file_info *fi, unsigned int extract_flags, apk_blob_t pkgctx)
+{
+	char tmpname[TMPNAME_MAX];
+	struct apk_file_info sfi;
+	const char *fn;
+	int r;
+
+	fn = format_tmpname(&ac->dctx, pkgctx, get_dirname(fi->name), APK_BLOB_STR(fi->name), tmpname);
+	r = apk_fileinfo_get(apk_ctx_fd_dest(ac), fn, APK_FI_NOFOLLOW | APK_FI_DIGEST(fi->digest.alg), &sfi, &ac->db->atoms);
+	if (r != 0) return r;
+	if (!S_ISREG(sfi.mode) || (sfi.mode & 07777) != (fi->mode & 07777) ||
+	    sfi.size != fi->size || sfi.mtime != fi->mtime)
+		return -ESTALE;
+	if (!(extract_flags & APK_FSEXTRACTF_NO_CHOWN) && (sfi.uid != fi->uid || sfi.gid != fi->gid))
+		return -ESTALE;
+	if (apk_digest_cmp_blob(&fi->digest, sfi.digest.alg, APK_DIGEST_BLOB(sfi.digest)) != 0)
+		return -ESTALE;
+	return 0;
+}
+
 static const struct apk_fsdir_ops fsdir_ops_fsys = {
 	.priority = APK_FS_PRIO_DISK,
 	.dir_create = fsys_dir_create,
@@ -255,6 +327,7 @@ static const struct apk_fsdir_ops fsdir_ops_fsys = {
 	.file_extract = fsys_file_extract,
 	.file_control = fsys_file_control,
 	.file_info = fsys_file_info,
+	.file_check_staged = fsys_file_check_staged,
 };
 
 static const struct apk_fsdir_ops *apk_fsops_get(apk_blob_t dir)
@@ -294,6 +367,24 @@ int apk_fs_extract(struct apk_ctx *ac, const struct apk_file_info *fi, struct ap
 	}
 }
 
+/* Regular files can be extracted to their temporary names ahead of the
+ * install, and picked up later with apk_fs_check_staged() */
+bool apk_fs_can_stage(const struct apk_file_info *fi)
+{
+	const struct apk_fsdir_ops *ops;
+
+	if (!S_ISREG(fi->mode) || fi->link_target || fi->digest.alg == APK_DIGEST_NONE) return false;
+	ops = apk_fsops_get(APK_BLOB_PTR_LEN((char*)fi->name, strnlen(fi->name, 5)));
+	return ops->file_check_staged != NULL;
+}
+
+int apk_fs_check_staged(struct apk_ctx *ac, const struct apk_file_info *fi, unsigned int extract_flags, apk_blob_t pkgctx)
+{
+	const struct apk_fsdir_ops *ops = apk_fsops_get(APK_BLOB_PTR_LEN((char*)fi->name, strnlen(fi->name, 5)));
+	if (!ops->file_check_staged) return -ENOTSUP;
+	return ops->file_check_staged(ac, fi, extract_flags, pkgctx);
+}
+
 void apk_fsdir_get(struct apk_fsdir *d, apk_blob_t dir, unsigned int extract_flags, struct apk_ctx *ac, apk_blob_t pkgctx)
 {
 	d->ac = ac;
@@ -7,16 +7,258 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "apk_defines.h"
 #include "apk_hash.h"
 
+/* The number of buckets is kept a power of two, and doubled when there are
+ * more items than buckets. */
+#define APK_HASH_MIN_BUCKETS	16
+
+static inline struct hlist_head *apk_hash_bucket(struct apk_hash *h, unsigned long hash)
+{
+	return &h->buckets->item[hash & (apk_array_len(h->buckets) - 1)];
+}
+
+static void apk_hash_alloc_buckets(struct apk_hash *h, size_t num_buckets)
+{
+	apk_hash_array_init(&h->buckets);
+	apk_hash_array_resize(&h->buckets, num_buckets, num_buckets);
+}
+
+/* The item nodes are relinked to the new buckets, so the items stay where
+ * they are and pointers to them remain valid. */
+static void apk_hash_grow(struct apk_hash *h)
+{
+	struct apk_hash_array *old = h->buckets;
+	ptrdiff_t offset = h->ops->node_offset;
+	apk_hash_node *pos, *n;
+
+	apk_hash_alloc_buckets(h, apk_array_len(old) * 2);
+	apk_array_foreach(bucket, old) {
+		hlist_for_each_safe(pos, n, bucket)
+			hlist_add_head(pos, apk_hash_bucket(h, apk_hash_from_item(h, ((void *) pos) - offset)));
+	}
+	apk_hash_array_free(&old);
+}
+
+/* Open addressing tables keep the item pointers in groups of 16 slots, with
+ * a control byte per slot: the low 7 bits of the hash for a used slot, or a
+ * marker for an empty or deleted one. A group is probed by matching all of
+ * its control bytes at once, so most mismatching slots are rejected without
+ * dereferencing the item, and the slot is next to its control byte. */
+#define CTRL_EMPTY		0x80
+#define CTRL_DELETED		0xfe
+#define CTRL_GROUP		16
+
+struct apk_hash_group {
+	uint8_t ctrl[CTRL_GROUP];
+	apk_hash_item items[CTRL_GROUP];
+};
+
+/* A table replaced while it is being enumerated is kept on the retired list
+ * of its replacement until the enumeration completes */
+struct apk_hash_table {
+	size_t num_groups;
+	size_t growth_left;
+	struct apk_hash_table *retired;
+	struct apk_hash_group groups[];
+};
+
+static inline uint8_t ctrl_tag(unsigned long hash) { return hash & 0x7f; }
+static inline size_t ctrl_group(unsigned long hash) { return hash >> 7; }
+static inline size_t max_load(size_t capacity) { return capacity - capacity / 8; }
+
+#ifdef __SSE2__
+static inline uint32_t group_match(const struct apk_hash_group *grp, uint8_t tag)
+{
+	__m128i g = _mm_loadu_si128((const __m128i *) grp->ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(tag)));
+}
+
+static inline uint32_t group_match_free(const struct apk_hash_group *grp)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) grp->ctrl));
+}
+#else
+static inline uint32_t group_match(const struct apk_hash_group *grp, uint8_t tag)
+{
+	uint32_t m = 0;
+	for (int i = 0; i < CTRL_GROUP; i++) m |= (uint32_t)(grp->ctrl[i] == tag) << i;
+	return m;
+}
+
+static inline uint32_t group_match_free(const struct apk_hash_group *grp)
+{
+	uint32_t m = 0;
+	for (int i = 0; i < CTRL_GROUP; i++) m |= (uint32_t)(grp->ctrl[i] >> 7) << i;
+	return m;
+}
+#endif
+
+static struct apk_hash_table *apk_hash_table_alloc(size_t capacity)
+{
+	size_t num_groups = capacity / CTRL_GROUP;
+	struct apk_hash_table *t;
+
+	t = malloc(sizeof *t + num_groups * sizeof(struct apk_hash_group));
+	if (!t) return NULL;
+	t->num_groups = num_groups;
+	t->growth_left = max_load(capacity);
+	t->retired = NULL;
+	for (size_t g = 0; g < num_groups; g++)
+		memset(t->groups[g].ctrl, CTRL_EMPTY, CTRL_GROUP);
+	return t;
+}
+
+/* Groups are visited in triangular order, which covers all of them when
+ * the number of groups is a power of two */
+#define for_each_group(t, hash, grp) \
+	for (size_t _g = ctrl_group(hash) & ((t)->num_groups - 1), _n = 0; \
+	     _n < (t)->num_groups && (grp = &(t)->groups[_g]); \
+	     _n++, _g = (_g + _n) & ((t)->num_groups - 1))
+
+static struct apk_hash_group *apk_hash_table_find_free(struct apk_hash_table *t, unsigned long hash, int *idx)
+{
+	struct apk_hash_group *grp;
+
+	for_each_group(t, hash, grp) {
+		uint32_t m = group_match_free(grp);
+		if (m) {
+			*idx = __builtin_ctz(m);
+			return grp;
+		}
+	}
+	return NULL;
+}
+
+static void apk_hash_table_free(struct apk_hash_table *t)
+{
+	for (struct apk_hash_table *next; t; t = next) {
+		next = t->retired;
+		free(t);
+	}
+}
+
+/* Moves the items to a new table. It is twice the size, unless mostly
+ * deleted slots made the table full. */
+static void apk_hash_table_rehash(struct apk_hash *h)
+{
+	struct apk_hash_table *old = h->table, *t;
+	struct apk_hash_group *grp;
+	size_t capacity = old->num_groups * CTRL_GROUP;
+	unsigned long hash;
+	int idx = 0;
+
+	if ((size_t) h->num_items >= max_load(capacity) / 2) capacity *= 2;
+	t = apk_hash_table_alloc(capacity);
+	if (!t) return;
+	for (size_t g = 0; g < old->num_groups; g++) {
+		for (int i = 0; i < CTRL_GROUP; i++) {
+			if (old->groups[g].ctrl[i] & CTRL_EMPTY) continue;
+			hash = apk_hash_from_item(h, old->groups[g].items[i]);
+			grp = apk_hash_table_find_free(t, hash, &idx);
+			grp->ctrl[idx] = ctrl_tag(hash);
+			grp->items[idx] = old->groups[g].items[i];
+			t->growth_left--;
+		}
+	}
+	h->table = t;
+	if (h->num_foreach) t->retired = old;
+	else free(old);
+}
+
+static struct apk_hash_group *apk_hash_table_get(struct apk_hash *h, struct apk_hash_table *t, apk_blob_t key, unsigned long hash, int *idx)
+{
+	struct apk_hash_group *grp;
+	uint8_t tag = ctrl_tag(hash);
+
+	for_each_group(t, hash, grp) {
+		for (uint32_t m = group_match(grp, tag); m; m &= m - 1) {
+			apk_hash_item item = grp->items[__builtin_ctz(m)];
+			if (h->ops->compare_item ? h->ops->compare_item(item, key) == 0 :
+			    h->ops->compare(key, h->ops->get_key(item)) == 0) {
+				*idx = __builtin_ctz(m);
+				return grp;
+			}
+		}
+		if (group_match(grp, CTRL_EMPTY)) break;
+	}
+	return NULL;
+}
+
+static void apk_hash_table_insert(struct apk_hash *h, apk_hash_item item, unsigned long hash)
+{
+	struct apk_hash_table *t = h->table;
+	struct apk_hash_group *grp;
+	int idx;
+
+	/* Grow when the empty slots run out, but not while enumerating
+	 * unless there is no room left at all. The enumeration continues
+	 * on the old table then. */
+	grp = apk_hash_table_find_free(t, hash, &idx);
+	if (!grp || (grp->ctrl[idx] == CTRL_EMPTY && !t->growth_left && !h->num_foreach)) {
+		apk_hash_table_rehash(h);
+		t = h->table;
+		grp = apk_hash_table_find_free(t, hash, &idx);
+		if (!grp) abort();
+	}
+	if (grp->ctrl[idx] == CTRL_EMPTY && t->growth_left) t->growth_left--;
+	grp->ctrl[idx] = ctrl_tag(hash);
+	grp->items[idx] = item;
+}
+
+static void apk_hash_table_delete(struct apk_hash *h, struct apk_hash_group *grp, int idx)
+{
+	/* A probe sequence continues past a group only if it has no empty
+	 * slots, so the slot can be made empty again if the group has one */
+	if (group_match(grp, CTRL_EMPTY)) {
+		grp->ctrl[idx] = CTRL_EMPTY;
+		h->table->growth_left++;
+	} else {
+		grp->ctrl[idx] = CTRL_DELETED;
+	}
+}
+
+/* Hides a deleted item from the enumerations of the retired tables */
+static void apk_hash_table_retire_item(struct apk_hash_table *t, apk_hash_item item, unsigned long hash)
+{
+	struct apk_hash_group *grp;
+
+	for (; t; t = t->retired) {
+		for_each_group(t, hash, grp) {
+			for (uint32_t m = group_match(grp, ctrl_tag(hash)); m; m &= m - 1) {
+				if (grp->items[__builtin_ctz(m)] != item) continue;
+				grp->ctrl[__builtin_ctz(m)] = CTRL_DELETED;
+				goto next;
+			}
+			if (group_match(grp, CTRL_EMPTY)) break;
+		}
+	next:;
+	}
+}
+
 void apk_hash_init(struct apk_hash *h, const struct apk_hash_ops *ops,
 		   int num_buckets)
 {
+	size_t n = APK_HASH_MIN_BUCKETS;
+
 	h->ops = ops;
-	apk_hash_array_init(&h->buckets);
-	apk_hash_array_resize(&h->buckets, num_buckets, num_buckets);
 	h->num_items = 0;
+	h->num_foreach = 0;
+	h->num_lookups = h->num_misses = 0;
+	if (ops->open_addressing) {
+		while (max_load(n) < (size_t) num_buckets) n <<= 1;
+		h->table = apk_hash_table_alloc(n);
+		if (!h->table) abort();
+	} else {
+		while (n < (size_t) num_buckets) n <<= 1;
+		apk_hash_alloc_buckets(h, n);
+	}
 }
 
 static int apk_hash_free_item_enumerator(apk_hash_item item, void *ctx)
@@ -28,41 +270,120 @@ static int apk_hash_free_item_enumerator(apk_hash_item item, void *ctx)
 void apk_hash_free(struct apk_hash *h)
 {
 	if (h->ops->delete_item) apk_hash_foreach(h, apk_hash_free_item_enumerator, h->ops->delete_item);
-	apk_hash_array_free(&h->buckets);
+	if (h->ops->open_addressing) {
+		apk_hash_table_free(h->table);
+		h->table = NULL;
+	} else {
+		apk_hash_array_free(&h->buckets);
+	}
+}
+
+static size_t apk_hash_table_probe_length(struct apk_hash *h, struct apk_hash_group *item_grp, unsigned long hash)
+{
+	struct apk_hash_group *grp;
+	size_t n = 0;
+
+	for_each_group(h->table, hash, grp) {
+		n++;
+		if (grp == item_grp) break;
+	}
+	return n;
+}
+
+void apk_hash_get_stats(struct apk_hash *h, struct apk_hash_stats *st)
+{
+	*st = (struct apk_hash_stats) {
+		.items = h->num_items,
+		.lookups = h->num_lookups,
+		.misses = h->num_misses,
+	};
+	if (h->ops->open_addressing) {
+		struct apk_hash_table *t = h->table;
+		st->buckets = t->num_groups * CTRL_GROUP;
+		for (size_t g = 0; g < t->num_groups; g++) {
+			struct apk_hash_group *grp = &t->groups[g];
+			for (int i = 0; i < CTRL_GROUP; i++) {
+				if (grp->ctrl[i] & CTRL_EMPTY) continue;
+				size_t n = apk_hash_table_probe_length(h, grp, apk_hash_from_item(h, grp->items[i]));
+				st->used_buckets++;
+				st->total_chain += n;
+				st->max_chain = max(st->max_chain, n);
+			}
+		}
+	} else {
+		apk_hash_node *pos;
+		st->buckets = apk_array_len(h->buckets);
+		apk_array_foreach(bucket, h->buckets) {
+			size_t n = 0;
+			hlist_for_each(pos, bucket) n++;
+			if (!n) continue;
+			st->used_buckets++;
+			st->total_chain += n;
+			st->max_chain = max(st->max_chain, n);
+		}
+	}
 }
 
 int apk_hash_foreach(struct apk_hash *h, apk_hash_enumerator_f e, void *ctx)
 {
 	apk_hash_node *pos, *n;
 	ptrdiff_t offset = h->ops->node_offset;
-	int r;
+	int r = 0;
 
-	apk_array_foreach(bucket, h->buckets) {
-		hlist_for_each_safe(pos, n, bucket) {
-			r = e(((void *) pos) - offset, ctx);
-			if (r != 0) return r;
+	/* The table is not grown while enumerating it */
+	h->num_foreach++;
+	if (h->ops->open_addressing) {
+		/* If an enumerator fills up the table, the items are moved to
+		 * a new one, and this one is enumerated until the end */
+		struct apk_hash_table *t = h->table;
+		for (size_t i = 0; i < t->num_groups * CTRL_GROUP; i++) {
+			struct apk_hash_group *grp = &t->groups[i / CTRL_GROUP];
+			if (grp->ctrl[i % CTRL_GROUP] & CTRL_EMPTY) continue;
+			r = e(grp->items[i % CTRL_GROUP], ctx);
+			if (r != 0) break;
+		}
+	} else {
+		apk_array_foreach(bucket, h->buckets) {
+			hlist_for_each_safe(pos, n, bucket) {
+				r = e(((void *) pos) - offset, ctx);
+				if (r != 0) goto done;
+			}
 		}
 	}
-
-	return 0;
+done:
+	if (--h->num_foreach == 0 && h->ops->open_addressing) {
+		apk_hash_table_free(h->table->retired);
+		h->table->retired = NULL;
+	}
+	return r;
 }
 
 apk_hash_item apk_hash_get_hashed(struct apk_hash *h, apk_blob_t key, unsigned long hash)
 {
 	ptrdiff_t offset = h->ops->node_offset;
+	struct hlist_head *bucket;
 	apk_hash_node *pos;
 	apk_hash_item item;
 	apk_blob_t itemkey;
+	int idx;
+
+	h->num_lookups++;
+	if (h->ops->open_addressing) {
+		struct apk_hash_group *grp = apk_hash_table_get(h, h->table, key, hash, &idx);
+		if (grp) return grp->items[idx];
+		h->num_misses++;
+		return NULL;
+	}
 
-	hash %= apk_array_len(h->buckets);
+	bucket = apk_hash_bucket(h, hash);
 	if (h->ops->compare_item != NULL) {
-		hlist_for_each(pos, &h->buckets->item[hash]) {
+		hlist_for_each(pos, bucket) {
 			item = ((void *) pos) - offset;
 			if (h->ops->compare_item(item, key) == 0)
 				return item;
 		}
 	} else {
-		hlist_for_each(pos, &h->buckets->item[hash]) {
+		hlist_for_each(pos, bucket) {
 			item = ((void *) pos) - offset;
 			itemkey = h->ops->get_key(item);
 			if (h->ops->compare(key, itemkey) == 0)
@@ -70,6 +391,7 @@ apk_hash_item apk_hash_get_hashed(struct apk_hash *h, apk_blob_t key, unsigned l
 		}
 	}
 
+	h->num_misses++;
 	return NULL;
 }
 
@@ -77,25 +399,44 @@ void apk_hash_insert_hashed(struct apk_hash *h, apk_hash_item item, unsigned lon
 {
 	apk_hash_node *node;
 
-	hash %= apk_array_len(h->buckets);
-	node = (apk_hash_node *) (item + h->ops->node_offset);
-	hlist_add_head(node, &h->buckets->item[hash]);
 	h->num_items++;
+	if (h->ops->open_addressing) {
+		apk_hash_table_insert(h, item, hash);
+		return;
+	}
+
+	node = (apk_hash_node *) (item + h->ops->node_offset);
+	hlist_add_head(node, apk_hash_bucket(h, hash));
+	if ((size_t) h->num_items > apk_array_len(h->buckets) && !h->num_foreach)
+		apk_hash_grow(h);
 }
 
 void apk_hash_delete_hashed(struct apk_hash *h, apk_blob_t key, unsigned long hash)
 {
 	ptrdiff_t offset = h->ops->node_offset;
+	struct hlist_head *bucket;
 	apk_hash_node *pos;
 	apk_hash_item item;
+	int idx;
 
 	assert(h->ops->compare_item != NULL);
 
-	hash %= apk_array_len(h->buckets);
-	hlist_for_each(pos, &h->buckets->item[hash]) {
+	if (h->ops->open_addressing) {
+		struct apk_hash_group *grp = apk_hash_table_get(h, h->table, key, hash, &idx);
+		if (!grp) return;
+		item = grp->items[idx];
+		apk_hash_table_delete(h, grp, idx);
+		apk_hash_table_retire_item(h->table->retired, item, hash);
+		if (h->ops->delete_item) h->ops->delete_item(item);
+		h->num_items--;
+		return;
+	}
+
+	bucket = apk_hash_bucket(h, hash);
+	hlist_for_each(pos, bucket) {
 		item = ((void *) pos) - offset;
 		if (h->ops->compare_item(item, key) == 0) {
-			hlist_del(pos, &h->buckets->item[hash]);
+			hlist_del(pos, bucket);
 			if (h->ops->delete_item) h->ops->delete_item(item);
 			h->num_items--;
 			break;
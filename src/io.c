@@ -486,9 +486,12 @@ err:
 
 struct apk_mmap_istream {
 	struct apk_istream is;
+	struct list_head mmap_list;
 	int fd;
 };
 
+static LIST_HEAD(mmap_istreams);
+
 static void mmap_get_meta(struct apk_istream *is, struct apk_file_meta *meta)
 {
 	struct apk_mmap_istream *mis = container_of(is, struct apk_mmap_istream, is);
@@ -505,6 +508,7 @@ static int mmap_close(struct apk_istream *is)
 	int r = is->err;
 	struct apk_mmap_istream *mis = container_of(is, struct apk_mmap_istream, is);
 
+	list_del(&mis->mmap_list);
 	munmap(mis->is.buf, mis->is.buf_size);
 	close(mis->fd);
 	free(mis);
@@ -544,9 +548,26 @@ static inline struct apk_istream *apk_mmap_istream_from_fd(int fd)
 		.is.end = ptr + st.st_size,
 		.fd = fd,
 	};
+	list_add_tail(&mis->mmap_list, &mmap_istreams);
 	return &mis->is;
 }
 
+/* Checks if the next size bytes of the stream are in a memory mapped file,
+ * and returns the file descriptor and the file offset of the data */
+int apk_istream_mapped_range(struct apk_istream *is, uint64_t size, int *fd, off_t *offset)
+{
+	struct apk_mmap_istream *mis;
+
+	if (!is || IS_ERR(is) || size == 0 || (uint64_t)(is->end - is->ptr) < size) return -ENOENT;
+	list_for_each_entry(mis, &mmap_istreams, mmap_list) {
+		if (is->ptr < mis->is.buf || is->ptr + size > mis->is.buf + mis->is.buf_size) continue;
+		*fd = mis->fd;
+		*offset = is->ptr - mis->is.buf;
+		return 0;
+	}
+	return -ENOENT;
+}
+
 struct apk_fd_istream {
 	struct apk_istream is;
 	int fd;
@@ -1232,6 +1253,90 @@ struct apk_ostream *apk_ostream_counter(off_t *counter)
 	return &cos->os;
 }
 
+struct apk_blob_ostream {
+	struct apk_ostream os;
+	apk_blob_t *blob;
+	size_t alloc;
+};
+
+static int bo_write(struct apk_ostream *os, const void *ptr, size_t size)
+{
+	struct apk_blob_ostream *bos = container_of(os, struct apk_blob_ostream, os);
+	apk_blob_t *b = bos->blob;
+
+	if (os->rc) return os->rc;
+	if (b->len + size > bos->alloc) {
+		size_t alloc = max(bos->alloc * 2, b->len + size);
+		char *ptr = realloc(b->ptr, alloc);
+		if (!ptr) return apk_ostream_cancel(os, -ENOMEM);
+		b->ptr = ptr;
+		bos->alloc = alloc;
+	}
+	memcpy(b->ptr + b->len, ptr, size);
+	b->len += size;
+	return 0;
+}
+
+static int bo_close(struct apk_ostream *os)
+{
+	struct apk_blob_ostream *bos = container_of(os, struct apk_blob_ostream, os);
+	int rc = os->rc;
+
+	if (rc) {
+		free(bos->blob->ptr);
+		*bos->blob = APK_BLOB_NULL;
+	}
+	free(bos);
+	return rc;
+}
+
+static const struct apk_ostream_ops blob_ostream_ops = {
+	.write = bo_write,
+	.close = bo_close,
+};
+
+/* Collects the written data to a newly allocated blob */
+struct apk_ostream *apk_ostream_to_blob(apk_blob_t *b)
+{
+	struct apk_blob_ostream *bos;
+
+	bos = malloc(sizeof(struct apk_blob_ostream));
+	if (bos == NULL) return ERR_PTR(-ENOMEM);
+
+	*b = APK_BLOB_NULL;
+	*bos = (struct apk_blob_ostream) {
+		.os.ops = &blob_ostream_ops,
+		.blob = b,
+	};
+	return &bos->os;
+}
+
+static int dos_write(struct apk_ostream *os, const void *ptr, size_t size)
+{
+	struct apk_digest_ostream *dos = container_of(os, struct apk_digest_ostream, os);
+	dos->size += size;
+	return apk_digest_ctx_update(dos->dctx, ptr, size);
+}
+
+static int dos_close(struct apk_ostream *os)
+{
+	return os->rc;
+}
+
+static const struct apk_ostream_ops digest_ostream_ops = {
+	.write = dos_write,
+	.close = dos_close,
+};
+
+struct apk_ostream *apk_ostream_digest(struct apk_digest_ostream *dos, struct apk_digest_ctx *dctx)
+{
+	*dos = (struct apk_digest_ostream) {
+		.os.ops = &digest_ostream_ops,
+		.dctx = dctx,
+	};
+	return &dos->os;
+}
+
 ssize_t apk_ostream_write_string(struct apk_ostream *os, const char *string)
 {
 	size_t len;
@@ -206,6 +206,13 @@ void apk_io_url_set_redirect_callback(void (*cb)(int, const char *))
 	io_url_redirect_callback = cb;
 }
 
+/* Closes the idle keep-alive connections so that forked workers do not
+ * share them. */
+void apk_io_url_close_connections(void)
+{
+	fetchConnectionCacheClose();
+}
+
 static void apk_io_url_fini(void)
 {
 	fetchConnectionCacheClose();
@@ -45,6 +45,7 @@ struct apk_installed_package *apk_pkg_install(struct apk_database *db,
 
 	pkg->ipkg = ipkg = calloc(1, sizeof(struct apk_installed_package));
 	ipkg->pkg = pkg;
+	ipkg->fdb_dirty = 1;
 	apk_string_array_init(&ipkg->triggers);
 	apk_string_array_init(&ipkg->pending_triggers);
 	apk_dependency_array_init(&ipkg->replaces);
@@ -702,6 +703,7 @@ int apk_ipkg_assign_script(struct apk_installed_package *ipkg, unsigned int type
 	}
 	if (ipkg->script[type].ptr) free(ipkg->script[type].ptr);
 	ipkg->script[type] = b;
+	ipkg->script_offset[type] = 0;
 	return 0;
 }
 
@@ -748,9 +750,15 @@ int apk_ipkg_run_script(struct apk_installed_package *ipkg,
 	int fd = -1, root_fd = db->root_fd, ret = 0, r;
 	bool created = false;
 
-	if (type >= APK_SCRIPT_MAX || ipkg->script[type].ptr == NULL) return 0;
+	if (type >= APK_SCRIPT_MAX || ipkg->script[type].len == 0) return 0;
 	if ((db->ctx->flags & (APK_NO_SCRIPTS | APK_SIMULATE)) != 0) return 0;
 
+	r = apk_db_read_script(db, ipkg, type);
+	if (r < 0) {
+		reason = "failed to read: ";
+		goto err_r;
+	}
+
 	r = apk_fmt(fn, sizeof fn, "%s/" PKG_VER_FMT ".%s", script_exec_dir, PKG_VER_PRINTF(pkg), apk_script_types[type]);
 	if (r < 0) goto err_r;
 
@@ -811,6 +819,7 @@ err_r:
 	apk_err(out, PKG_VER_FMT ".%s: %s%s", PKG_VER_PRINTF(pkg), apk_script_types[type], reason, apk_error_str(r));
 err:
 	ipkg->broken_script = 1;
+	ipkg->fdb_dirty = 1;
 	ret = 1;
 cleanup:
 	if (fd >= 0) close(fd);
@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "apk_defines.h"
 #include "apk_print.h"
@@ -291,6 +292,60 @@ void apk_out_log_argv(struct apk_out *out, char **argv)
 	fprintf(out->log, "` at %s\n", when);
 }
 
+void apk_out_capture_init(struct apk_out_capture *c)
+{
+	c->fd[0] = memfd_create("apk-out", MFD_CLOEXEC);
+	c->fd[1] = memfd_create("apk-err", MFD_CLOEXEC);
+}
+
+/* Called in the worker. Without the memfds it writes to the parent's
+ * output directly. */
+void apk_out_capture_start(struct apk_out_capture *c, struct apk_out *out)
+{
+	FILE *f;
+
+	out->progress = APK_NO;
+	out->progress_fd = 0;
+	if (c->fd[0] >= 0 && (f = fdopen(c->fd[0], "w")) != NULL) out->out = f;
+	if (c->fd[1] >= 0 && (f = fdopen(c->fd[1], "w")) != NULL) out->err = f;
+}
+
+static void apk_out_capture_copy(int fd, FILE *f)
+{
+	char buf[4096];
+	ssize_t n;
+
+	for (off_t off = 0; (n = pread(fd, buf, sizeof buf, off)) > 0; off += n)
+		fwrite(buf, 1, n, f);
+	fflush(f);
+}
+
+void apk_out_capture_flush(struct apk_out_capture *c, struct apk_out *out)
+{
+	bool captured = false;
+
+	for (int i = 0; i < ARRAY_SIZE(c->fd); i++)
+		if (c->fd[i] >= 0 && lseek(c->fd[i], 0, SEEK_END) > 0) captured = true;
+	if (captured) {
+		if (out->need_flush) {
+			fflush(out->out);
+			out->need_flush = 0;
+		}
+		if (c->fd[0] >= 0) apk_out_capture_copy(c->fd[0], out->out);
+		if (c->fd[1] >= 0) apk_out_capture_copy(c->fd[1], out->err);
+		apk_out_render_progress(out, true);
+	}
+	apk_out_capture_free(c);
+}
+
+void apk_out_capture_free(struct apk_out_capture *c)
+{
+	for (int i = 0; i < ARRAY_SIZE(c->fd); i++) {
+		if (c->fd[i] >= 0) close(c->fd[i]);
+		c->fd[i] = -1;
+	}
+}
+
 uint64_t apk_progress_weight(uint64_t bytes, unsigned int packages)
 {
 	return bytes + packages * 1024 * 64;
@@ -297,7 +297,7 @@ static void serialize_revdep_package(struct apk_package *pkg0, struct apk_depend
 static void serialize_revdep_origin(struct apk_package *pkg0, struct apk_dependency *dep0, struct apk_package *pkg, void *ctx)
 {
 	struct pkgser_ctx *pc = ctx;
-	if (pkg->origin->len) serialize_revdep_unique_name(pc, apk_db_get_name(pc->db, *pkg0->origin), pkg0->foreach_genid);
+	if (pkg->origin->len) serialize_revdep_unique_name(pc, apk_db_get_name_atom(pc->db, pkg0->origin), pkg0->foreach_genid);
 }
 
 static revdep_serializer_f revdep_serializer(uint8_t rev_field)
@@ -404,6 +404,8 @@ static int __apk_package_serialize(struct apk_package *pkg, struct pkgser_ctx *p
 		}
 	}
 
+	if ((BIT(APK_Q_FIELD_REV_DEPENDS) | BIT(APK_Q_FIELD_REV_INSTALL_IF)) & fields)
+		apk_db_load_rdepends(db);
 	if (BIT(APK_Q_FIELD_REV_DEPENDS) & fields) {
 		apk_ser_key(ser, apk_query_field(APK_Q_FIELD_REV_DEPENDS));
 		apk_ser_start_array(ser, -1);
@@ -441,6 +443,7 @@ static int __apk_package_serialize(struct apk_package *pkg, struct pkgser_ctx *p
 	if (BIT(APK_Q_FIELD_CONTENTS) & fields) {
 		struct apk_pathbuilder pb;
 
+		apk_db_load_files(db);
 		apk_ser_key(ser, apk_query_field(APK_Q_FIELD_CONTENTS));
 		apk_ser_start_array(ser, -1);
 		apk_array_foreach_item(diri, ipkg->diris) {
@@ -31,10 +31,10 @@
 struct apk_solver_state {
 	struct apk_database *db;
 	struct apk_changeset *changeset;
+	struct apk_solver_stats *stats;
 	struct list_head dirty_head;
-	struct list_head unresolved_head;
-	struct list_head selectable_head;
 	struct list_head resolvenow_head;
+	struct apk_name_array *queue;
 	unsigned int errors;
 	unsigned int solver_flags_inherit;
 	unsigned int pinning_inherit;
@@ -96,6 +96,7 @@ static void queue_dirty(struct apk_solver_state *ss, struct apk_name *name)
 		return;
 
 	dbg_printf("queue_dirty: %s\n", name->name);
+	ss->stats->queued_dirty++;
 	list_add_tail(&name->ss.dirty_list, &ss->dirty_head);
 }
 
@@ -105,28 +106,89 @@ static bool queue_resolvenow(struct apk_name *name)
 		name->ss.has_auto_selectable && !name->ss.has_options;
 }
 
-static void queue_insert(struct list_head *head, struct apk_name *name)
+/* Names waiting for selection are kept in a binary heap. Names having an
+ * auto selectable provider come first, and then the ones with the highest
+ * order_id. The queue_index is the 1-based position in the heap, or zero
+ * if the name is not queued. */
+static bool queue_before(struct apk_name *a, struct apk_name *b)
 {
-	struct apk_name *name0;
+	if (a->ss.queue_selectable != b->ss.queue_selectable) return a->ss.queue_selectable;
+	return a->ss.order_id > b->ss.order_id;
+}
 
-	list_for_each_entry(name0, head, ss.unresolved_list) {
-		if (name->ss.order_id < name0->ss.order_id) continue;
-		list_add_before(&name->ss.unresolved_list, &name0->ss.unresolved_list);
-		return;
+static void queue_set(struct apk_solver_state *ss, unsigned int i, struct apk_name *name)
+{
+	ss->queue->item[i] = name;
+	name->ss.queue_index = i + 1;
+}
+
+static void queue_sift_up(struct apk_solver_state *ss, unsigned int i, struct apk_name *name)
+{
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		if (!queue_before(name, ss->queue->item[parent])) break;
+		queue_set(ss, i, ss->queue->item[parent]);
+		i = parent;
+	}
+	queue_set(ss, i, name);
+}
+
+static void queue_sift_down(struct apk_solver_state *ss, unsigned int i, struct apk_name *name)
+{
+	unsigned int num = apk_array_len(ss->queue), child;
+
+	while ((child = 2 * i + 1) < num) {
+		if (child + 1 < num && queue_before(ss->queue->item[child + 1], ss->queue->item[child]))
+			child++;
+		if (!queue_before(ss->queue->item[child], name)) break;
+		queue_set(ss, i, ss->queue->item[child]);
+		i = child;
 	}
-	list_add_tail(&name->ss.unresolved_list, head);
+	queue_set(ss, i, name);
+}
+
+static void queue_insert(struct apk_solver_state *ss, struct apk_name *name, bool selectable)
+{
+	name->ss.queue_selectable = selectable;
+	apk_name_array_add(&ss->queue, name);
+	queue_sift_up(ss, apk_array_len(ss->queue) - 1, name);
+}
+
+static void queue_remove(struct apk_solver_state *ss, struct apk_name *name)
+{
+	unsigned int i = name->ss.queue_index - 1, num = apk_array_len(ss->queue) - 1;
+	struct apk_name *last = ss->queue->item[num];
+
+	name->ss.queue_index = 0;
+	apk_array_truncate(ss->queue, num);
+	if (last == name) return;
+	if (i > 0 && queue_before(last, ss->queue->item[(i - 1) / 2]))
+		queue_sift_up(ss, i, last);
+	else
+		queue_sift_down(ss, i, last);
+}
+
+static bool name_queued(struct apk_name *name)
+{
+	return list_hashed(&name->ss.unresolved_list) || name->ss.queue_index;
+}
+
+static void unqueue_name(struct apk_solver_state *ss, struct apk_name *name)
+{
+	if (name->ss.queue_index) queue_remove(ss, name);
+	else list_del_init(&name->ss.unresolved_list);
 }
 
 static void queue_unresolved(struct apk_solver_state *ss, struct apk_name *name, bool reevaluate)
 {
 	if (name->ss.locked) return;
-	if (list_hashed(&name->ss.unresolved_list)) {
+	if (name_queued(name)) {
 		if (name->ss.resolvenow) return;
 		if (queue_resolvenow(name) == 1)
 			name->ss.resolvenow = 1;
 		else if (!reevaluate)
 			return;
-		list_del_init(&name->ss.unresolved_list);
+		unqueue_name(ss, name);
 	} else {
 		if (name->ss.requirers == 0 && !name->ss.has_iif && !name->ss.iif_needed) return;
 		name->ss.resolvenow = queue_resolvenow(name);
@@ -134,15 +196,17 @@ static void queue_unresolved(struct apk_solver_state *ss, struct apk_name *name,
 
 	dbg_printf("queue_unresolved: %s, requirers=%d, has_iif=%d, resolvenow=%d\n",
 		name->name, name->ss.requirers, name->ss.has_iif, name->ss.resolvenow);
+	ss->stats->queued_unresolved++;
 	if (name->ss.resolvenow) {
 		list_add_tail(&name->ss.unresolved_list, &ss->resolvenow_head);
 		return;
 	}
-	queue_insert(name->ss.has_auto_selectable ? &ss->selectable_head : &ss->unresolved_head, name);
+	queue_insert(ss, name, name->ss.has_auto_selectable);
 }
 
 static void reevaluate_reverse_deps(struct apk_solver_state *ss, struct apk_name *name)
 {
+	ss->stats->reverse_dep_fanouts++;
 	apk_array_foreach_item(name0, name->rdepends) {
 		if (!name0->ss.seen) continue;
 		name0->ss.reevaluate_deps = 1;
@@ -171,6 +235,7 @@ static void disqualify_package(struct apk_solver_state *ss, struct apk_package *
 {
 	dbg_printf("disqualify_package: " PKG_VER_FMT " (%s)\n", PKG_VER_PRINTF(pkg), reason);
 	pkg->ss.pkg_selectable = 0;
+	ss->stats->packages_disqualified++;
 	reevaluate_reverse_deps(ss, pkg->name);
 	apk_array_foreach(p, pkg->provides)
 		reevaluate_reverse_deps(ss, p->name);
@@ -202,6 +267,7 @@ static void discover_name(struct apk_solver_state *ss, struct apk_name *name)
 
 	name->ss.seen = 1;
 	name->ss.no_iif = 1;
+	ss->stats->names_discovered++;
 	apk_array_foreach(p, name->providers) {
 		struct apk_package *pkg = p->pkg;
 		if (!pkg->ss.seen) {
@@ -390,6 +456,7 @@ static void reconsider_name(struct apk_solver_state *ss, struct apk_name *name)
 	bool reevaluate = false;
 
 	dbg_printf("reconsider_name: %s\n", name->name);
+	ss->stats->names_reconsidered++;
 
 	reevaluate_deps = name->ss.reevaluate_deps;
 	reevaluate_iif = name->ss.reevaluate_iif;
@@ -542,6 +609,8 @@ static int compare_providers(struct apk_solver_state *ss,
 	unsigned int solver_flags;
 	int r;
 
+	ss->stats->provider_comparisons++;
+
 	/* Prefer existing package */
 	if (pkgA == NULL || pkgB == NULL) {
 		dbg_printf("   prefer existing package\n");
@@ -707,8 +776,8 @@ static void assign_name(struct apk_solver_state *ss, struct apk_name *name, stru
 
 	name->ss.locked = 1;
 	name->ss.chosen = p;
-	if (list_hashed(&name->ss.unresolved_list))
-		list_del(&name->ss.unresolved_list);
+	if (name_queued(name))
+		unqueue_name(ss, name);
 	if (list_hashed(&name->ss.dirty_list))
 		list_del(&name->ss.dirty_list);
 
@@ -1057,40 +1126,48 @@ static struct apk_name *dequeue_next_name(struct apk_solver_state *ss)
 		dbg_printf("name <%s> selected from resolvenow list\n", name->name);
 		return name;
 	}
-	if (!list_empty(&ss->selectable_head)) {
-		struct apk_name *name = list_pop(&ss->selectable_head, struct apk_name, ss.unresolved_list);
-		dbg_printf("name <%s> selected from selectable list\n", name->name);
-		return name;
-	}
-	if (!list_empty(&ss->unresolved_head)) {
-		struct apk_name *name = list_pop(&ss->unresolved_head, struct apk_name, ss.unresolved_list);
-		dbg_printf("name <%s> selected from unresolved list\n", name->name);
+	if (apk_array_len(ss->queue)) {
+		struct apk_name *name = ss->queue->item[0];
+		queue_remove(ss, name);
+		dbg_printf("name <%s> selected from %s queue\n", name->name,
+			name->ss.queue_selectable ? "selectable" : "unresolved");
 		return name;
 	}
 	return NULL;
 }
 
-int apk_solver_solve(struct apk_database *db,
-		     unsigned short solver_flags,
-		     struct apk_dependency_array *world,
-		     struct apk_changeset *changeset)
+static uint64_t solver_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int solve(struct apk_database *db,
+		 unsigned short solver_flags,
+		 struct apk_dependency_array *world,
+		 struct apk_changeset *changeset)
 {
 	struct apk_name *name;
 	struct apk_package *pkg;
 	struct apk_solver_state ss_data, *ss = &ss_data;
+	struct apk_solver_stats *st = &changeset->stats;
+	uint64_t t0, t1;
 
-	apk_array_qsort(world, cmp_pkgname);
-
+	apk_db_load_rdepends(db);
 restart:
+	t0 = solver_clock();
 	memset(ss, 0, sizeof(*ss));
 	ss->db = db;
 	ss->changeset = changeset;
+	ss->stats = st;
 	ss->default_repos = apk_db_get_pinning_mask_repos(db, APK_DEFAULT_PINNING_MASK);
 	ss->ignore_conflict = !!(solver_flags & APK_SOLVERF_IGNORE_CONFLICT);
 	list_init(&ss->dirty_head);
-	list_init(&ss->unresolved_head);
-	list_init(&ss->selectable_head);
 	list_init(&ss->resolvenow_head);
+	apk_name_array_init(&ss->queue);
+	apk_name_array_resize(&ss->queue, 0, max(db->available.names.num_items, 1));
 
 	dbg_printf("discovering world\n");
 	ss->solver_flags_inherit = solver_flags;
@@ -1108,6 +1185,9 @@ restart:
 	ss->solver_flags_inherit = 0;
 	ss->pinning_inherit = 0;
 	dbg_printf("applying world [finished]\n");
+	t1 = solver_clock();
+	st->discover_ns += t1 - t0;
+	t0 = t1;
 
 	do {
 		while (!list_empty(&ss->dirty_head)) {
@@ -1119,8 +1199,13 @@ restart:
 			break;
 		select_package(ss, name);
 	} while (1);
+	apk_name_array_free(&ss->queue);
+	t1 = solver_clock();
+	st->resolve_ns += t1 - t0;
+	t0 = t1;
 
 	generate_changeset(ss, world);
+	st->changeset_ns += solver_clock() - t0;
 
 	if (ss->errors && (db->ctx->force & APK_FORCE_BROKEN_WORLD)) {
 		apk_array_foreach(d, world) {
@@ -1147,3 +1232,334 @@ restart:
 
 	return ss->errors;
 }
+
+/* The solver cache stores the changeset of the last successful solve in the
+ * cache directory. It is keyed by a digest of the solver flags, whether a
+ * preupgrade is being solved, the world, the architectures, the
+ * repositories and their index digests, the names given solver flags, and
+ * the state of every package. The names and packages are hashed in sorted
+ * order, so the key does not depend on the order they were loaded in.
+ * Values are in native byte order. After the header follow:
+ *   for each change: struct apk_solver_cache_change, old and new package
+ *     digests
+ *   for each world dependency: the layer as uint8_t
+ * The file ends with the magic value. */
+#define APK_SOLVER_CACHE_FILE		"solver.cache"
+#define APK_SOLVER_CACHE_MAGIC		0x766c6f73	// solv
+#define APK_SOLVER_CACHE_VERSION	1
+
+struct apk_solver_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t key[APK_DIGEST_LENGTH_SHA256];
+	uint32_t num_changes, num_world;
+	uint32_t num_install, num_remove, num_adjust;
+};
+
+struct apk_solver_cache_change {
+	uint16_t old_repository_tag, new_repository_tag;
+	uint8_t old_digest_alg, new_digest_alg;
+	uint8_t reinstall;
+} __attribute__((packed));
+
+static void solver_cache_key_blob(struct apk_digest_ctx *dctx, apk_blob_t b)
+{
+	uint32_t len = b.len;
+	apk_digest_ctx_update(dctx, &len, sizeof len);
+	apk_digest_ctx_update(dctx, b.ptr, b.len);
+}
+
+static int solver_cache_add_name(apk_hash_item item, void *ctx)
+{
+	struct apk_name_array **names = ctx;
+	struct apk_name *name = item;
+
+	if (name->solver_flags_set) apk_name_array_add(names, name);
+	return 0;
+}
+
+static int solver_cache_add_pkg(apk_hash_item item, void *ctx)
+{
+	struct apk_package_array **pkgs = ctx;
+	apk_package_array_add(pkgs, (struct apk_package *) item);
+	return 0;
+}
+
+static int solver_cache_name_cmp(const void *p1, const void *p2)
+{
+	const struct apk_name * const *n1 = p1, * const *n2 = p2;
+	return strcmp((*n1)->name, (*n2)->name);
+}
+
+static int solver_cache_pkg_cmp(const void *p1, const void *p2)
+{
+	const struct apk_package * const *pkg1 = p1, * const *pkg2 = p2;
+	return apk_blob_sort(apk_pkg_digest_blob(*pkg1), apk_pkg_digest_blob(*pkg2));
+}
+
+static void solver_cache_key_pkg(struct apk_digest_ctx *dctx, struct apk_package *pkg)
+{
+	struct {
+		uint32_t repos;
+		uint16_t solver_flags, solver_flags_inheritable;
+		uint16_t repository_tag;
+		uint8_t installed, layer, cached, cached_non_repository, uninstallable, file;
+	} __attribute__((packed)) state = {
+		.repos = pkg->repos,
+		.solver_flags = pkg->ss.solver_flags,
+		.solver_flags_inheritable = pkg->ss.solver_flags_inheritable,
+		.repository_tag = pkg->ipkg ? pkg->ipkg->repository_tag : 0,
+		.installed = pkg->ipkg != NULL,
+		.layer = pkg->layer,
+		.cached = pkg->cached,
+		.cached_non_repository = pkg->cached_non_repository,
+		.uninstallable = pkg->uninstallable,
+		.file = pkg->filename_ndx != 0,
+	};
+
+	apk_digest_ctx_update(dctx, pkg->digest, apk_digest_alg_len(pkg->digest_alg));
+	apk_digest_ctx_update(dctx, &state, sizeof state);
+}
+
+static int solver_cache_key(struct apk_database *db, unsigned short solver_flags,
+			    struct apk_dependency_array *world, struct apk_digest *key)
+{
+	struct apk_digest_ctx dctx;
+	struct apk_name_array *names;
+	struct apk_package_array *pkgs;
+	uint32_t v[5];
+	int r;
+
+	r = apk_digest_ctx_init(&dctx, APK_DIGEST_SHA256);
+	if (r < 0) return r;
+
+	v[0] = solver_flags;
+	v[1] = db->available_repos;
+	v[2] = db->active_layers;
+	v[3] = db->num_repos;
+	v[4] = db->performing_preupgrade;
+	apk_digest_ctx_update(&dctx, v, sizeof v);
+	apk_array_foreach_item(arch, db->arches)
+		solver_cache_key_blob(&dctx, *arch);
+	for (unsigned i = 0; i < db->num_repos; i++) {
+		apk_digest_ctx_update(&dctx, &db->repos[i].tag_mask, sizeof db->repos[i].tag_mask);
+		apk_digest_ctx_update(&dctx, db->repos[i].hash.data, db->repos[i].hash.len);
+	}
+	for (unsigned i = 0; i < db->num_repo_tags; i++) {
+		solver_cache_key_blob(&dctx, db->repo_tags[i].tag);
+		apk_digest_ctx_update(&dctx, &db->repo_tags[i].allowed_repos, sizeof db->repo_tags[i].allowed_repos);
+	}
+	apk_array_foreach(d, world) {
+		v[0] = d->op;
+		v[1] = d->repository_tag;
+		v[2] = d->broken;
+		solver_cache_key_blob(&dctx, APK_BLOB_STR(d->name->name));
+		solver_cache_key_blob(&dctx, *d->version);
+		apk_digest_ctx_update(&dctx, v, 3 * sizeof v[0]);
+	}
+
+	apk_name_array_init(&names);
+	apk_hash_foreach(&db->available.names, solver_cache_add_name, &names);
+	apk_array_qsort(names, solver_cache_name_cmp);
+	apk_array_foreach_item(name, names)
+		solver_cache_key_blob(&dctx, APK_BLOB_STR(name->name));
+	apk_name_array_free(&names);
+
+	apk_package_array_init(&pkgs);
+	apk_package_array_resize(&pkgs, 0, db->available.packages.num_items);
+	apk_hash_foreach(&db->available.packages, solver_cache_add_pkg, &pkgs);
+	apk_array_qsort(pkgs, solver_cache_pkg_cmp);
+	apk_array_foreach_item(pkg, pkgs) solver_cache_key_pkg(&dctx, pkg);
+	apk_package_array_free(&pkgs);
+
+	r = apk_digest_ctx_final(&dctx, key);
+	apk_digest_ctx_free(&dctx);
+	return r;
+}
+
+static apk_blob_t solver_cache_pull(apk_blob_t *b, size_t len)
+{
+	apk_blob_t v;
+
+	if (b->len < len) {
+		*b = APK_BLOB_NULL;
+		return APK_BLOB_NULL;
+	}
+	v = APK_BLOB_PTR_LEN(b->ptr, len);
+	b->ptr += len;
+	b->len -= len;
+	return v;
+}
+
+static struct apk_package *solver_cache_pull_pkg(struct apk_database *db, apk_blob_t *b, uint8_t alg)
+{
+	struct apk_digest id;
+	apk_blob_t v;
+
+	if (alg == APK_DIGEST_NONE) return NULL;
+	if (apk_digest_alg_len(alg) < APK_DIGEST_LENGTH_SHA1) goto err;
+	v = solver_cache_pull(b, apk_digest_alg_len(alg));
+	if (APK_BLOB_IS_NULL(v)) return NULL;
+	apk_digest_set(&id, alg);
+	memcpy(id.data, v.ptr, v.len);
+	return apk_db_get_pkg(db, &id);
+err:
+	*b = APK_BLOB_NULL;
+	return NULL;
+}
+
+/* Returns zero if the changeset was loaded from the cache, and a positive
+ * value if the cache does not have a valid entry for the key. */
+static int solver_cache_load(struct apk_database *db, apk_blob_t b, struct apk_digest *key,
+			     struct apk_dependency_array *world, struct apk_changeset *changeset)
+{
+	struct apk_solver_cache_header hdr;
+	struct apk_solver_cache_change sc;
+	struct apk_change *change;
+	uint32_t magic;
+	apk_blob_t v;
+
+	if (b.len < sizeof hdr + sizeof magic) return 1;
+	memcpy(&hdr, b.ptr, sizeof hdr);
+	memcpy(&magic, b.ptr + b.len - sizeof magic, sizeof magic);
+	if (hdr.magic != APK_SOLVER_CACHE_MAGIC || magic != APK_SOLVER_CACHE_MAGIC ||
+	    hdr.version != APK_SOLVER_CACHE_VERSION ||
+	    memcmp(hdr.key, key->data, sizeof hdr.key) != 0 ||
+	    hdr.num_world != apk_array_len(world)) return 1;
+	b = APK_BLOB_PTR_LEN(b.ptr + sizeof hdr, b.len - sizeof hdr - sizeof magic);
+
+	apk_array_truncate(changeset->changes, 0);
+	for (uint32_t i = 0; i < hdr.num_changes; i++) {
+		v = solver_cache_pull(&b, sizeof sc);
+		if (APK_BLOB_IS_NULL(v)) goto err;
+		memcpy(&sc, v.ptr, sizeof sc);
+		change = apk_change_array_add(&changeset->changes, (struct apk_change) {
+			.old_repository_tag = sc.old_repository_tag,
+			.new_repository_tag = sc.new_repository_tag,
+			.reinstall = sc.reinstall,
+		});
+		change->old_pkg = solver_cache_pull_pkg(db, &b, sc.old_digest_alg);
+		change->new_pkg = solver_cache_pull_pkg(db, &b, sc.new_digest_alg);
+		if (APK_BLOB_IS_NULL(b)) goto err;
+		if (!change->old_pkg != (sc.old_digest_alg == APK_DIGEST_NONE)) goto err;
+		if (!change->new_pkg != (sc.new_digest_alg == APK_DIGEST_NONE)) goto err;
+		if (change->old_pkg && !change->old_pkg->ipkg) goto err;
+	}
+	v = solver_cache_pull(&b, hdr.num_world);
+	if (APK_BLOB_IS_NULL(v) || b.len != 0) goto err;
+	for (uint32_t i = 0; i < hdr.num_world; i++)
+		world->item[i].layer = (uint8_t) v.ptr[i];
+
+	changeset->num_install = hdr.num_install;
+	changeset->num_remove = hdr.num_remove;
+	changeset->num_adjust = hdr.num_adjust;
+	changeset->num_total_changes = hdr.num_install + hdr.num_remove + hdr.num_adjust;
+	return 0;
+err:
+	apk_array_truncate(changeset->changes, 0);
+	return 1;
+}
+
+static int solver_cache_read(struct apk_database *db, struct apk_digest *key,
+			     struct apk_dependency_array *world, struct apk_changeset *changeset)
+{
+	struct apk_istream *is;
+	int r;
+
+	is = apk_istream_from_file_mmap(db->cache_fd, APK_SOLVER_CACHE_FILE);
+	if (IS_ERR(is)) return 1;
+	r = solver_cache_load(db, apk_istream_mmap(is), key, world, changeset);
+	apk_istream_close(is);
+	return r;
+}
+
+static void solver_cache_write_pkg(struct apk_ostream *os, struct apk_package *pkg)
+{
+	if (pkg) apk_ostream_write(os, pkg->digest, apk_digest_alg_len(pkg->digest_alg));
+}
+
+static int solver_cache_write(struct apk_database *db, struct apk_digest *key,
+			      struct apk_dependency_array *world, struct apk_changeset *changeset)
+{
+	struct apk_solver_cache_header hdr = {
+		.magic = APK_SOLVER_CACHE_MAGIC,
+		.version = APK_SOLVER_CACHE_VERSION,
+		.num_changes = apk_array_len(changeset->changes),
+		.num_world = apk_array_len(world),
+		.num_install = changeset->num_install,
+		.num_remove = changeset->num_remove,
+		.num_adjust = changeset->num_adjust,
+	};
+	uint32_t magic = APK_SOLVER_CACHE_MAGIC;
+	struct apk_ostream *os;
+
+	os = apk_ostream_to_file(db->cache_fd, APK_SOLVER_CACHE_FILE, 0644);
+	if (IS_ERR(os)) return PTR_ERR(os);
+
+	memcpy(hdr.key, key->data, sizeof hdr.key);
+	apk_ostream_write(os, &hdr, sizeof hdr);
+	apk_array_foreach(change, changeset->changes) {
+		struct apk_solver_cache_change sc = {
+			.old_repository_tag = change->old_repository_tag,
+			.new_repository_tag = change->new_repository_tag,
+			.old_digest_alg = change->old_pkg ? change->old_pkg->digest_alg : APK_DIGEST_NONE,
+			.new_digest_alg = change->new_pkg ? change->new_pkg->digest_alg : APK_DIGEST_NONE,
+			.reinstall = change->reinstall,
+		};
+		apk_ostream_write(os, &sc, sizeof sc);
+		solver_cache_write_pkg(os, change->old_pkg);
+		solver_cache_write_pkg(os, change->new_pkg);
+	}
+	apk_array_foreach(d, world) {
+		uint8_t layer = d->layer;
+		apk_ostream_write(os, &layer, sizeof layer);
+	}
+	apk_ostream_write(os, &magic, sizeof magic);
+	return apk_ostream_close(os);
+}
+
+static void solver_print_stats(struct apk_database *db, const struct apk_solver_stats *st)
+{
+	struct apk_out *out = &db->ctx->out;
+
+	if (st->cached) {
+		apk_out(out, "Solver: changeset loaded from cache");
+		return;
+	}
+	apk_out(out, "Solver: %lu names discovered, %lu reconsidered, %lu provider comparisons, "
+		"%lu packages disqualified",
+		st->names_discovered, st->names_reconsidered, st->provider_comparisons,
+		st->packages_disqualified);
+	apk_out(out, "Solver: %lu dirty and %lu unresolved names queued, %lu reverse dependency fan-outs",
+		st->queued_dirty, st->queued_unresolved, st->reverse_dep_fanouts);
+	apk_out(out, "Solver: discover %.3f ms, resolve %.3f ms, changeset %.3f ms",
+		st->discover_ns / 1e6, st->resolve_ns / 1e6, st->changeset_ns / 1e6);
+}
+
+int apk_solver_solve(struct apk_database *db,
+		     unsigned short solver_flags,
+		     struct apk_dependency_array *world,
+		     struct apk_changeset *changeset)
+{
+	struct apk_digest key;
+	bool cacheable;
+	int r;
+
+	apk_array_qsort(world, cmp_pkgname);
+	memset(&changeset->stats, 0, sizeof changeset->stats);
+
+	/* With a broken world the solver also marks the broken dependencies,
+	 * which are not cached */
+	cacheable = (db->ctx->flags & APK_SOLVER_CACHE) && db->cache_fd >= 0 &&
+		!(db->ctx->force & APK_FORCE_BROKEN_WORLD) &&
+		solver_cache_key(db, solver_flags, world, &key) == 0;
+	if (cacheable && solver_cache_read(db, &key, world, changeset) == 0) {
+		changeset->stats.cached = 1;
+		r = 0;
+	} else {
+		r = solve(db, solver_flags, world, changeset);
+		if (cacheable && r == 0) solver_cache_write(db, &key, world, changeset);
+	}
+	if (db->ctx->flags & APK_SOLVER_STATS) solver_print_stats(db, &changeset->stats);
+	return r;
+}
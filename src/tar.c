@@ -9,6 +9,7 @@
 
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include "apk_defines.h"
 #include "apk_tar.h"
@@ -260,6 +261,53 @@ ok:
 	return apk_istream_close_error(is, r);
 }
 
+/* Walks the headers of an uncompressed archive without reading the file
+ * data. Only the regular files and long names written by apk_tar_write_entry
+ * are supported. The offset of the end-of-archive record is returned in end. */
+int apk_tar_index(int fd, apk_tar_index_entry cb, void *ctx, uint64_t *end)
+{
+	struct tar_header buf;
+	char longname[PATH_MAX];
+	const char *name = NULL;
+	uint64_t pos = 0, size;
+	ssize_t n;
+	int r;
+
+	while (1) {
+		n = pread(fd, &buf, sizeof buf, pos);
+		if (n != sizeof buf) return n < 0 ? -errno : -APKE_EOF;
+		if (buf.name[0] == '\0') break;
+		if (memcmp(buf.magic, "ustar", 5) != 0) return -APKE_V2PKG_FORMAT;
+
+		r = 0;
+		size = GET_OCTAL(buf.size, &r);
+		if (r != 0 || size >= SSIZE_MAX-512) return -APKE_V2PKG_FORMAT;
+		if (buf.prefix[0]) return -APKE_FORMAT_NOT_SUPPORTED;
+
+		switch (buf.typeflag) {
+		case 'L': /* GNU long name extension */
+			if (size >= sizeof longname) return -ENAMETOOLONG;
+			n = pread(fd, longname, size, pos + 512);
+			if (n != (ssize_t) size) return n < 0 ? -errno : -APKE_EOF;
+			longname[size] = 0;
+			name = longname;
+			break;
+		case '0':
+		case '7': /* regular file */
+			buf.mode[0] = 0; /* to nul terminate 100-byte buf.name */
+			r = cb(ctx, name ?: buf.name, pos + 512, size);
+			if (r != 0) return r;
+			name = NULL;
+			break;
+		default:
+			return -APKE_FORMAT_NOT_SUPPORTED;
+		}
+		pos += 512 + ((size + 511) & -512);
+	}
+	*end = pos;
+	return 0;
+}
+
 static void apk_tar_fill_header(struct tar_header *hdr, char typeflag,
 				const char *name, int size,
 				const struct apk_file_info *ae)
@@ -347,6 +395,16 @@ int apk_tar_write_entry(struct apk_ostream *os, const struct apk_file_info *ae,
 	return 0;
 }
 
+/* Returns the size of the header records apk_tar_write_entry writes for ae */
+size_t apk_tar_header_size(const struct apk_file_info *ae)
+{
+	struct tar_header buf;
+	size_t len = ae->name ? strlen(ae->name) : 0;
+
+	if (len > sizeof buf.name - 1) return 512 + ((len + 1 + 511) & -512) + 512;
+	return 512;
+}
+
 int apk_tar_write_padding(struct apk_ostream *os, int size)
 {
 	static char padding[512];
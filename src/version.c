@@ -287,6 +287,8 @@ static int apk_version_compare_fuzzy(apk_blob_t a, apk_blob_t b, bool fuzzy)
 			return APK_VERSION_EQUAL;
 		return APK_VERSION_EQUAL | APK_VERSION_GREATER | APK_VERSION_LESS;
 	}
+	/* Versions are usually atoms, and equal ones are the same blob */
+	if (a.ptr == b.ptr && a.len == b.len) return APK_VERSION_EQUAL;
 
 	for (token_first(&ta, &a), token_first(&tb, &b);
 	     ta.token == tb.token && ta.token < TOKEN_END;
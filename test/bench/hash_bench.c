@@ -0,0 +1,91 @@
+/* Measures apk_hash insert and lookup latency at different table sizes */
+
+#include <stdio.h>
+#include <time.h>
+#include "apk_hash.h"
+
+struct bench_item {
+	apk_hash_node hash_node;
+	char key[16];
+	int len;
+};
+
+static apk_blob_t bench_item_get_key(apk_hash_item item)
+{
+	struct bench_item *bi = item;
+	return APK_BLOB_PTR_LEN(bi->key, bi->len);
+}
+
+static const struct apk_hash_ops bench_item_ops = {
+	.node_offset = offsetof(struct bench_item, hash_node),
+	.get_key = bench_item_get_key,
+	.hash_key = apk_blob_hash,
+	.compare = apk_blob_compare,
+};
+
+static const struct apk_hash_ops bench_item_open_ops = {
+	.get_key = bench_item_get_key,
+	.hash_key = apk_blob_hash,
+	.compare = apk_blob_compare,
+	.open_addressing = 1,
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench(const struct apk_hash_ops *ops, int num, int initial_buckets)
+{
+	const int lookups = 2000000;
+	struct bench_item *items;
+	struct apk_hash h;
+	struct bench_item miss;
+	double t0, t1, t2, t3;
+	int i, found = 0;
+
+	items = calloc(num, sizeof *items);
+	if (!items) return -1;
+	for (i = 0; i < num; i++) items[i].len = snprintf(items[i].key, sizeof items[i].key, "item-%d", i);
+
+	t0 = now();
+	apk_hash_init(&h, ops, initial_buckets);
+	for (i = 0; i < num; i++) apk_hash_insert(&h, &items[i]);
+	t1 = now();
+	/* Stride through the items to defeat the cache */
+	for (i = 0; i < lookups; i++) {
+		struct bench_item *bi = &items[(i * 7919L) % num];
+		if (apk_hash_get(&h, APK_BLOB_PTR_LEN(bi->key, bi->len)) == bi) found++;
+	}
+	t2 = now();
+	for (i = 0; i < lookups; i++) {
+		miss.len = snprintf(miss.key, sizeof miss.key, "miss-%d", i % num);
+		if (apk_hash_get(&h, APK_BLOB_PTR_LEN(miss.key, miss.len)) != NULL) found--;
+	}
+	t3 = now();
+
+	printf("%-8s %8d items %8d initial size: insert %6.1f ns, lookup %6.1f ns, miss %6.1f ns\n",
+		ops->open_addressing ? "open" : "chained", num, initial_buckets,
+		(t1 - t0) * 1e9 / num, (t2 - t1) * 1e9 / lookups, (t3 - t2) * 1e9 / lookups);
+
+	apk_hash_free(&h);
+	free(items);
+	return found == lookups ? 0 : -1;
+}
+
+int main(void)
+{
+	static const int sizes[] = { 10000, 100000, 1000000 };
+	static const struct apk_hash_ops *ops[] = { &bench_item_ops, &bench_item_open_ops };
+	int r = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (int j = 0; j < ARRAY_SIZE(ops); j++) {
+			r |= bench(ops[j], sizes[i], 1000);
+			r |= bench(ops[j], sizes[i], sizes[i]);
+		}
+	}
+	return r ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+/* Measures the solver phases against synthetic repositories of different sizes
+ *
+ * Each run prints one JSON object per line so results can be compared
+ * between builds. Without options a default set of sizes is measured. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "apk_context.h"
+#include "apk_database.h"
+#include "apk_solver.h"
+#include "apk_tar.h"
+
+struct bench_spec {
+	int names;
+	int provides;
+	int install_if;
+	int virtuals;
+	int conflicts;
+};
+
+static unsigned int bench_rand(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void write_pkg_header(struct apk_ostream *os, const char *name, const char *version)
+{
+	char buf[APK_BLOB_DIGEST_BUF], id[64];
+	struct apk_digest d;
+	apk_blob_t b = APK_BLOB_BUF(buf);
+	int n;
+
+	n = snprintf(id, sizeof id, "%s-%s", name, version);
+	apk_digest_calc(&d, APK_DIGEST_SHA1, id, n);
+	apk_blob_push_hash(&b, APK_DIGEST_BLOB(d));
+	b = apk_blob_pushed(APK_BLOB_BUF(buf), b);
+	apk_ostream_fmt(os, "C:" BLOB_FMT "\nP:%s\nV:%s\nA:noarch\nS:1024\nI:4096\nT:%s\n",
+		BLOB_PRINTF(b), name, version, name);
+}
+
+/* Generates the APKINDEX text:
+ *  - pkg-N in two versions each, depending on pkg-base and up to three
+ *    lower numbered packages, so-names and virtuals
+ *  - the first 'provides' packages provide so:libN.so.1
+ *  - each virtual virt-N is provided by three packages with different
+ *    provider priorities
+ *  - 'conflicts' packages carry a conflict which narrows the choice of versions
+ *  - 'install_if' packages iif-N form chains of ten, each link installed
+ *    if its base package and the previous link are installed */
+static void write_index(struct apk_ostream *os, const struct bench_spec *spec)
+{
+	unsigned int seed = 1;
+	char name[32];
+	int i, j, n;
+
+	write_pkg_header(os, "pkg-base", "1.0");
+	apk_ostream_fmt(os, "\n");
+	for (i = 0; i < spec->names; i++) {
+		snprintf(name, sizeof name, "pkg-%d", i);
+		for (int v = 0; v < 2; v++) {
+			write_pkg_header(os, name, v ? "2.0" : "1.0");
+			apk_ostream_fmt(os, "D:pkg-base");
+			n = i ? bench_rand(&seed) % 4 : 0;
+			for (j = 0; j < n; j++)
+				apk_ostream_fmt(os, " pkg-%d", bench_rand(&seed) % i);
+			if (spec->provides && i >= spec->provides && bench_rand(&seed) % 4 == 0)
+				apk_ostream_fmt(os, " so:lib%d.so.1", bench_rand(&seed) % spec->provides);
+			if (spec->virtuals && i % 8 == 1)
+				apk_ostream_fmt(os, " virt-%d", bench_rand(&seed) % spec->virtuals);
+			if (spec->conflicts && i > 0 && i <= spec->conflicts)
+				apk_ostream_fmt(os, " !pkg-%d<2.0", bench_rand(&seed) % i);
+			apk_ostream_fmt(os, "\n");
+			if (i < spec->provides || (spec->virtuals && i < 3 * spec->virtuals)) {
+				apk_ostream_fmt(os, "p:");
+				if (i < spec->provides)
+					apk_ostream_fmt(os, "so:lib%d.so.1=1 ", i);
+				if (spec->virtuals && i < 3 * spec->virtuals)
+					apk_ostream_fmt(os, "virt-%d", i % spec->virtuals);
+				apk_ostream_fmt(os, "\n");
+				if (spec->virtuals && i < 3 * spec->virtuals)
+					apk_ostream_fmt(os, "k:%d\n", i / spec->virtuals);
+			}
+			apk_ostream_fmt(os, "\n");
+		}
+	}
+	for (i = 0; i < spec->install_if; i++) {
+		snprintf(name, sizeof name, "iif-%d", i);
+		write_pkg_header(os, name, "1.0");
+		apk_ostream_fmt(os, "i:pkg-%d", (i * 10) % spec->names);
+		if (i % 10) apk_ostream_fmt(os, " iif-%d", i - 1);
+		apk_ostream_fmt(os, "\n\n");
+	}
+}
+
+static int write_repository(int dirfd, const struct bench_spec *spec)
+{
+	struct apk_file_info fi = {
+		.name = "APKINDEX",
+		.mode = 0644 | S_IFREG,
+	};
+	struct apk_ostream *os;
+	apk_blob_t index;
+	int r;
+
+	os = apk_ostream_to_blob(&index);
+	if (IS_ERR(os)) return PTR_ERR(os);
+	write_index(os, spec);
+	r = apk_ostream_close(os);
+	if (r < 0) return r;
+
+	fi.size = index.len;
+	os = apk_ostream_gzip(apk_ostream_to_file(dirfd, "APKINDEX.tar.gz", 0644));
+	if (IS_ERR(os)) {
+		free(index.ptr);
+		return PTR_ERR(os);
+	}
+	apk_tar_write_entry(os, &fi, index.ptr);
+	apk_tar_write_entry(os, NULL, NULL);
+	free(index.ptr);
+	return apk_ostream_close(os);
+}
+
+static double ms(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+static int bench(const char *dir, const struct bench_spec *spec, int rounds)
+{
+	struct apk_ctx ac;
+	struct apk_database db;
+	struct apk_dependency_array *world;
+	struct apk_changeset changeset = {};
+	struct apk_solver_stats best = {};
+	char repo[PATH_MAX];
+	int i, r;
+
+	snprintf(repo, sizeof repo, "%s/APKINDEX.tar.gz", dir);
+	apk_ctx_init(&ac);
+	ac.out.verbosity = 0;
+	ac.root = dir;
+	ac.flags |= APK_ALLOW_UNTRUSTED | APK_NO_NETWORK | APK_NO_CACHE;
+	ac.open_flags = APK_OPENF_READ | APK_OPENF_NO_STATE | APK_OPENF_NO_SYS_REPOS |
+		APK_OPENF_NO_INSTALLED_REPO;
+	apk_string_array_add(&ac.repository_list, repo);
+	apk_db_init(&db, &ac);
+	r = apk_ctx_prepare(&ac);
+	if (r == 0) r = apk_db_open(&db);
+	if (r != 0) {
+		fprintf(stderr, "solver_bench: unable to open database: %s\n", apk_error_str(r));
+		goto err;
+	}
+
+	apk_dependency_array_init(&world);
+	apk_change_array_init(&changeset.changes);
+	for (i = 0; i < spec->names; i += 10) {
+		char name[32];
+		int n = snprintf(name, sizeof name, "pkg-%d", i);
+		apk_dependency_array_add(&world, (struct apk_dependency) {
+			.name = apk_db_get_name(&db, APK_BLOB_PTR_LEN(name, n)),
+			.version = &apk_atom_null,
+			.op = APK_DEPMASK_ANY,
+		});
+	}
+
+	for (i = 0; i < rounds; i++) {
+		r = apk_solver_solve(&db, 0, world, &changeset);
+		if (r != 0) {
+			fprintf(stderr, "solver_bench: %d errors solving world\n", r);
+			break;
+		}
+		if (i == 0 || changeset.stats.discover_ns + changeset.stats.resolve_ns + changeset.stats.changeset_ns <
+			      best.discover_ns + best.resolve_ns + best.changeset_ns)
+			best = changeset.stats;
+	}
+	if (r == 0) {
+		printf("{\"bench\":\"solver\",\"names\":%d,\"provides\":%d,\"install_if\":%d,"
+			"\"virtuals\":%d,\"conflicts\":%d,\"packages\":%d,\"world\":%d,\"changes\":%d,"
+			"\"discover_ms\":%.3f,\"resolve_ms\":%.3f,\"changeset_ms\":%.3f,\"total_ms\":%.3f,"
+			"\"names_discovered\":%lu,\"names_reconsidered\":%lu,\"provider_comparisons\":%lu,"
+			"\"packages_disqualified\":%lu,\"queued_dirty\":%lu,\"queued_unresolved\":%lu,"
+			"\"reverse_dep_fanouts\":%lu}\n",
+			spec->names, spec->provides, spec->install_if, spec->virtuals, spec->conflicts,
+			db.available.packages.num_items, apk_array_len(world), changeset.num_total_changes,
+			ms(best.discover_ns), ms(best.resolve_ns), ms(best.changeset_ns),
+			ms(best.discover_ns + best.resolve_ns + best.changeset_ns),
+			best.names_discovered, best.names_reconsidered, best.provider_comparisons,
+			best.packages_disqualified, best.queued_dirty, best.queued_unresolved,
+			best.reverse_dep_fanouts);
+		fflush(stdout);
+	}
+
+	apk_change_array_free(&changeset.changes);
+	apk_dependency_array_free(&world);
+	apk_db_close(&db);
+err:
+	apk_ctx_free(&ac);
+	return r;
+}
+
+static int run(const struct bench_spec *spec, int rounds)
+{
+	char dir[] = "/tmp/apk-solver-bench.XXXXXX";
+	int dirfd, r;
+
+	if (!mkdtemp(dir)) return -errno;
+	dirfd = open(dir, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+	r = write_repository(dirfd, spec);
+	if (r == 0) r = bench(dir, spec, rounds);
+	unlinkat(dirfd, "APKINDEX.tar.gz", 0);
+	close(dirfd);
+	rmdir(dir);
+	return r;
+}
+
+static void default_spec(struct bench_spec *spec, int names)
+{
+	*spec = (struct bench_spec) {
+		.names = names,
+		.provides = names / 10,
+		.install_if = names / 10,
+		.virtuals = names / 100,
+		.conflicts = names / 20,
+	};
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1000, 10000, 100000 };
+	struct bench_spec spec = { .names = -1, .provides = -1, .install_if = -1, .virtuals = -1, .conflicts = -1 };
+	struct bench_spec def;
+	int opt, rounds = 3, r = 0;
+
+	while ((opt = getopt(argc, argv, "n:p:i:v:c:r:")) != -1) {
+		switch (opt) {
+		case 'n': spec.names = atoi(optarg); break;
+		case 'p': spec.provides = atoi(optarg); break;
+		case 'i': spec.install_if = atoi(optarg); break;
+		case 'v': spec.virtuals = atoi(optarg); break;
+		case 'c': spec.conflicts = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n names] [-p provides] [-i install_if] "
+				"[-v virtuals] [-c conflicts] [-r rounds]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (rounds < 1) rounds = 1;
+	apk_crypto_init();
+
+	if (spec.names <= 0) {
+		for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+			default_spec(&def, sizes[i]);
+			r |= run(&def, rounds);
+		}
+		return r ? 1 : 0;
+	}
+
+	default_spec(&def, spec.names);
+	if (spec.provides < 0) spec.provides = def.provides;
+	if (spec.install_if < 0) spec.install_if = def.install_if;
+	if (spec.virtuals < 0) spec.virtuals = def.virtuals;
+	if (spec.conflicts < 0) spec.conflicts = def.conflicts;
+	if (spec.provides > spec.names) spec.provides = spec.names;
+	return run(&spec, rounds) ? 1 : 0;
+}
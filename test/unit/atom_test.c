@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include "apk_test.h"
+#include "apk_atom.h"
+
+APK_TEST(atom_hash) {
+	struct apk_balloc ba;
+	struct apk_atom_pool atoms;
+	apk_blob_t *a;
+
+	apk_balloc_init(&ba, 1024);
+	apk_atom_init(&atoms, &ba);
+	for (int i = 0; i < 100000; i++) {
+		char buf[16];
+		a = apk_atomize_dup(&atoms, APK_BLOB_PTR_LEN(buf, snprintf(buf, sizeof buf, "%d", i)));
+		assert_int_equal(apk_atom_hash(a), apk_blob_hash(*a));
+	}
+	a = apk_atomize_dup(&atoms, APK_BLOB_STRLIT("42"));
+	assert_int_equal(apk_atom_hash(a), apk_blob_hash(APK_BLOB_STRLIT("42")));
+	assert_ptr_equal(apk_atomize_dup(&atoms, APK_BLOB_STRLIT("")), &apk_atom_null);
+	assert_int_equal(apk_atom_hash(&apk_atom_null), apk_blob_hash(APK_BLOB_STRLIT("")));
+	apk_atom_free(&atoms);
+	apk_balloc_destroy(&ba);
+}
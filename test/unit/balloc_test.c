@@ -0,0 +1,43 @@
+#include "apk_test.h"
+#include "apk_balloc.h"
+
+APK_TEST(balloc_reserve) {
+	struct apk_balloc ba;
+	void *p;
+
+	apk_balloc_init(&ba, 1024);
+	apk_balloc_reserve(&ba, 100 * 1024);
+	p = apk_balloc_aligned(&ba, 16, 8);
+	for (int i = 0; i < 900; i++) apk_balloc_aligned(&ba, 100, 8);
+	assert_int_equal(ba.num_pages, 1);
+	assert_true(ba.allocated >= 100 * 1024);
+
+	/* The reservation is used by one page only */
+	apk_balloc_aligned(&ba, 100 * 1024, 8);
+	assert_int_equal(ba.num_pages, 2);
+	apk_balloc_aligned(&ba, 1000, 8);
+	assert_int_equal(ba.num_pages, 3);
+	assert_non_null(p);
+	apk_balloc_destroy(&ba);
+}
+
+APK_TEST(balloc_hugepages) {
+	const size_t size = 3 * 1024 * 1024;
+	struct apk_balloc ba;
+	char *p;
+
+	apk_balloc_init(&ba, 1024);
+	ba.hugepages = 1;
+	p = apk_balloc_aligned(&ba, 1000, 8);
+	assert_int_equal(ba.num_huge_pages, 0);
+
+	apk_balloc_reserve(&ba, size);
+	p = apk_balloc_aligned(&ba, 1000, 8);
+	assert_int_equal(ba.num_huge_pages, 1);
+	assert_int_equal(ba.allocated % (2 * 1024 * 1024), 1024);
+	memset(p, 0xaa, 1000);
+	p = apk_balloc_aligned(&ba, size - 1024 * 1024, 8);
+	memset(p, 0x55, size - 1024 * 1024);
+	assert_int_equal(ba.num_pages, 2);
+	apk_balloc_destroy(&ba);
+}
@@ -0,0 +1,209 @@
+#include "apk_test.h"
+#include "apk_hash.h"
+
+struct test_item {
+	apk_hash_node hash_node;
+	unsigned long key;
+};
+
+static apk_blob_t test_item_get_key(apk_hash_item item)
+{
+	struct test_item *ti = item;
+	return APK_BLOB_PTR_LEN((char *) &ti->key, sizeof ti->key);
+}
+
+static int test_item_compare_item(apk_hash_item item, apk_blob_t key)
+{
+	return apk_blob_compare(test_item_get_key(item), key);
+}
+
+static const struct apk_hash_ops test_item_ops = {
+	.node_offset = offsetof(struct test_item, hash_node),
+	.get_key = test_item_get_key,
+	.hash_key = apk_blob_hash,
+	.compare = apk_blob_compare,
+	.compare_item = test_item_compare_item,
+};
+
+static const struct apk_hash_ops test_item_open_ops = {
+	.get_key = test_item_get_key,
+	.hash_key = apk_blob_hash,
+	.compare = apk_blob_compare,
+	.compare_item = test_item_compare_item,
+	.open_addressing = 1,
+};
+
+static apk_hash_item test_hash_get(struct apk_hash *h, unsigned long key)
+{
+	return apk_hash_get(h, APK_BLOB_PTR_LEN((char *) &key, sizeof key));
+}
+
+static int count_items(apk_hash_item item, void *ctx)
+{
+	(*(int *) ctx)++;
+	return 0;
+}
+
+static void test_hash_grow(const struct apk_hash_ops *ops)
+{
+	const int num = 10000;
+	struct test_item *items = calloc(num, sizeof *items);
+	struct apk_hash h;
+	int i, n = 0;
+
+	apk_hash_init(&h, ops, 1);
+	for (i = 0; i < num; i++) {
+		items[i].key = i;
+		apk_hash_insert(&h, &items[i]);
+	}
+	assert_int_equal(h.num_items, num);
+
+	for (i = 0; i < num; i++) assert_ptr_equal(test_hash_get(&h, i), &items[i]);
+	assert_null(test_hash_get(&h, num));
+
+	for (i = 0; i < num; i += 2)
+		apk_hash_delete_hashed(&h, test_item_get_key(&items[i]), apk_hash_from_item(&h, &items[i]));
+	for (i = 0; i < num; i++) {
+		if (i & 1) assert_ptr_equal(test_hash_get(&h, i), &items[i]);
+		else assert_null(test_hash_get(&h, i));
+	}
+	apk_hash_foreach(&h, count_items, &n);
+	assert_int_equal(n, num / 2);
+
+	/* Deleted slots are reused */
+	for (i = 0; i < num; i += 2) apk_hash_insert(&h, &items[i]);
+	for (i = 0; i < num; i++) assert_ptr_equal(test_hash_get(&h, i), &items[i]);
+
+	apk_hash_free(&h);
+	free(items);
+}
+
+APK_TEST(hash_grow) {
+	test_hash_grow(&test_item_ops);
+}
+
+APK_TEST(hash_open_grow) {
+	test_hash_grow(&test_item_open_ops);
+}
+
+struct insert_ctx {
+	struct apk_hash *h;
+	struct test_item *items;
+	int num, visited;
+};
+
+static int insert_items(apk_hash_item item, void *pctx)
+{
+	struct insert_ctx *ctx = pctx;
+	ctx->visited++;
+	for (; ctx->num < 100; ctx->num++) apk_hash_insert(ctx->h, &ctx->items[ctx->num]);
+	return 0;
+}
+
+static void test_hash_insert_in_foreach(const struct apk_hash_ops *ops)
+{
+	struct test_item items[100] = {};
+	struct apk_hash h;
+	struct insert_ctx ctx = { .h = &h, .items = items, .num = 1 };
+	int i, n = 0;
+
+	for (i = 0; i < 100; i++) items[i].key = i;
+	apk_hash_init(&h, ops, 1);
+	apk_hash_insert(&h, &items[0]);
+	apk_hash_foreach(&h, insert_items, &ctx);
+	assert_true(ctx.visited <= 100);
+
+	apk_hash_foreach(&h, count_items, &n);
+	assert_int_equal(n, 100);
+	for (i = 0; i < 100; i++) assert_ptr_equal(test_hash_get(&h, i), &items[i]);
+	apk_hash_free(&h);
+}
+
+APK_TEST(hash_insert_in_foreach) {
+	test_hash_insert_in_foreach(&test_item_ops);
+}
+
+APK_TEST(hash_open_insert_in_foreach) {
+	test_hash_insert_in_foreach(&test_item_open_ops);
+}
+
+struct rehash_ctx {
+	struct apk_hash *h;
+	struct test_item *items;
+	int visited[1000];
+	bool done;
+};
+
+static int rehash_items(apk_hash_item item, void *pctx)
+{
+	struct rehash_ctx *ctx = pctx;
+	struct test_item *ti = item;
+
+	if (ctx->visited[ti->key]++ || ctx->done) return 0;
+	ctx->done = true;
+	for (int i = 100; i < 1000; i++) apk_hash_insert(ctx->h, &ctx->items[i]);
+	for (int i = 0; i < 100; i++) {
+		if (i == ti->key) continue;
+		apk_hash_delete_hashed(ctx->h, test_item_get_key(&ctx->items[i]), apk_hash_from_item(ctx->h, &ctx->items[i]));
+	}
+	return 0;
+}
+
+APK_TEST(hash_open_rehash_in_foreach) {
+	struct test_item items[1000] = {};
+	struct apk_hash h;
+	struct rehash_ctx ctx = { .h = &h, .items = items };
+	int i, n = 0;
+
+	for (i = 0; i < 1000; i++) items[i].key = i;
+	apk_hash_init(&h, &test_item_open_ops, 1);
+	for (i = 0; i < 100; i++) apk_hash_insert(&h, &items[i]);
+	apk_hash_foreach(&h, rehash_items, &ctx);
+
+	/* The items are visited once, and the deleted ones not at all after
+	 * the table is replaced */
+	for (i = 0; i < 1000; i++) assert_true(ctx.visited[i] <= 1);
+	for (i = 0; i < 100; i++) n += ctx.visited[i];
+	assert_int_equal(n, 1);
+	n = 0;
+	apk_hash_foreach(&h, count_items, &n);
+	assert_int_equal(n, 901);
+	apk_hash_free(&h);
+}
+
+static void test_hash_stats(const struct apk_hash_ops *ops)
+{
+	const int num = 1000;
+	struct test_item *items = calloc(num, sizeof *items);
+	struct apk_hash_stats st;
+	struct apk_hash h;
+	int i;
+
+	apk_hash_init(&h, ops, 1);
+	for (i = 0; i < num; i++) {
+		items[i].key = i;
+		apk_hash_insert(&h, &items[i]);
+	}
+	for (i = 0; i < 2 * num; i++) test_hash_get(&h, i);
+
+	apk_hash_get_stats(&h, &st);
+	assert_int_equal(st.items, num);
+	assert_true(st.buckets >= num);
+	assert_true(st.used_buckets > 0 && st.used_buckets <= st.items);
+	assert_true(st.max_chain >= 1);
+	assert_true(st.total_chain >= st.used_buckets);
+	assert_true(st.total_chain <= st.used_buckets * st.max_chain);
+	assert_int_equal(st.lookups, 2 * num);
+	assert_int_equal(st.misses, num);
+
+	apk_hash_free(&h);
+	free(items);
+}
+
+APK_TEST(hash_stats) {
+	test_hash_stats(&test_item_ops);
+}
+
+APK_TEST(hash_open_stats) {
+	test_hash_stats(&test_item_open_ops);
+}
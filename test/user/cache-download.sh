@@ -0,0 +1,51 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_repo() {
+	local repo="$1" deps=""
+
+	mkdir -p "$repo"
+	for i in 1 2 3 4 5 6 7 8; do
+		mkdir -p files/$i
+		echo "package $i" > files/$i/data-$i
+		$APK mkpkg -I name:pkg-$i -I version:1.0 -F files/$i -o "$repo"/pkg-$i-1.0.apk
+		deps="$deps pkg-$i"
+	done
+	$APK mkpkg -I name:meta -I version:1.0 -I depends:"$deps" -o "$repo"/meta-1.0.apk
+	$APK mkndx "$repo"/*.apk -o "$repo"/index.adb
+}
+
+APK="$APK --allow-untrusted --no-interactive"
+setup_apkroot
+setup_repo "$PWD/repo"
+REPO="test:/$PWD/repo/index.adb"
+
+$APK add --initdb $TEST_USERMODE --parallel-downloads 3 --cache-predownload --repository "$REPO" meta > add.log 2>&1 || assert "add failed"
+grep -q "Downloading 8 packages" add.log || assert "packages not predownloaded"
+[ "$(grep -c ") Downloading" add.log)" = 8 ] || assert "wrong number of downloads"
+for i in 1 2 3 4 5 6 7 8; do
+	grep -q "^package $i$" "$TEST_ROOT"/data-$i || assert "pkg-$i not installed"
+	glob_one "$TEST_ROOT/etc/apk/cache/pkg-$i-1.0.*.apk" > /dev/null || assert "pkg-$i not cached"
+done
+
+# a failed download is reported for its package only
+rm -f "$TEST_ROOT"/etc/apk/cache/*.apk
+$APK del meta
+echo "corrupted" > repo/pkg-5-1.0.apk
+! $APK add --parallel-downloads 4 --cache-predownload --repository "$REPO" meta > add.log 2>&1 || assert "add succeeded unexpectedly"
+grep -q "ERROR: pkg-5-1.0: " add.log || assert "download error not reported"
+[ "$(grep -c "^ERROR: pkg-" add.log)" = 1 ] || assert "wrong errors reported"
+for i in 1 2 3 4 6 7 8; do
+	glob_one "$TEST_ROOT/etc/apk/cache/pkg-$i-1.0.*.apk" > /dev/null || assert "pkg-$i not cached"
+done
+
+# serial downloads
+rm -f "$TEST_ROOT"/etc/apk/cache/*.apk
+$APK mkpkg -I name:pkg-5 -I version:1.0 -F files/5 -o repo/pkg-5-1.0.apk
+$APK add --parallel-downloads 1 --cache-predownload --repository "$REPO" meta > add.log 2>&1 || assert "add failed"
+[ "$(grep -c ") Downloading" add.log)" = 8 ] || assert "wrong number of downloads"
+for i in 1 2 3 4 5 6 7 8; do
+	glob_one "$TEST_ROOT/etc/apk/cache/pkg-$i-1.0.*.apk" > /dev/null || assert "pkg-$i not cached"
+done
@@ -15,6 +15,16 @@ case "$($APK mkpkg --compression AAA 2>&1 >/dev/null)" in
 *'invalid argument'*'compression'*'AAA'*) ;;
 *) assert "expeected invalid argument error" ;;
 esac
+for jobs in 0 -1 4294967297 257 2x; do
+	case "$($APK --jobs "$jobs" version 2>&1 >/dev/null)" in
+	*'invalid argument'*'jobs'*"'$jobs'"*) ;;
+	*) assert "expected invalid jobs error for $jobs" ;;
+	esac
+	case "$($APK --parallel-downloads "$jobs" version 2>&1 >/dev/null)" in
+	*'invalid argument'*'parallel-downloads'*"'$jobs'"*) ;;
+	*) assert "expected invalid parallel-downloads error for $jobs" ;;
+	esac
+done
 case "$($APK --force- 2>&1 >/dev/null)" in
 *"ambiguous option 'force-'"*) ;;
 *) assert "expected ambiguous error" ;;
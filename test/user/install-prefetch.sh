@@ -0,0 +1,46 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_repo() {
+	local repo="$1" deps=""
+
+	mkdir -p "$repo"
+	for i in 1 2 3 4 5 6; do
+		mkdir -p files/$i
+		echo "package $i" > files/$i/data-$i
+		$APK mkpkg -I name:pkg-$i -I version:1.0 -F files/$i -o "$repo"/pkg-$i-1.0.apk
+		deps="$deps pkg-$i"
+	done
+	$APK mkpkg -I name:meta -I version:1.0 -I depends:"$deps" -o "$repo"/meta-1.0.apk
+	$APK mkndx "$repo"/*.apk -o "$repo"/index.adb
+}
+
+install_meta() {
+	$APK add --initdb $TEST_USERMODE --no-cache $1 --repository "$REPO" meta > "$2" 2>&1
+}
+
+APK="$APK --allow-untrusted --no-interactive"
+setup_apkroot
+setup_repo "$PWD/repo"
+REPO="test:/$PWD/repo/index.adb"
+
+install_meta "--prefetch --parallel-downloads 3" add.log || assert "add failed"
+for i in 1 2 3 4 5 6; do
+	grep -q "^package $i$" "$TEST_ROOT"/data-$i || assert "pkg-$i not installed"
+done
+[ -z "$(ls "$TEST_ROOT"/etc/apk/cache)" ] || assert "packages cached"
+$APK del meta > /dev/null
+
+# errors are reported in changeset order as with serial installation
+echo "corrupted" > repo/pkg-4-1.0.apk
+install_meta --no-prefetch serial.log && assert "add succeeded unexpectedly"
+$APK del meta > /dev/null
+install_meta "--prefetch --parallel-downloads 3" add.log && assert "add succeeded unexpectedly"
+diff -u serial.log add.log || assert "different result with prefetch"
+grep -q "^ERROR: pkg-4-1.0: " add.log || assert "error not reported"
+[ -e "$TEST_ROOT"/data-4 ] && assert "pkg-4 installed"
+for i in 1 2 3 5 6; do
+	grep -q "^package $i$" "$TEST_ROOT"/data-$i || assert "pkg-$i not installed"
+done
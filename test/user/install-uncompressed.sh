@@ -0,0 +1,43 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_apkroot
+APK="$APK --allow-untrusted --no-interactive --force-no-chroot"
+
+mkdir -p files/usr/share/data repo
+echo "small file" > files/usr/share/data/small
+: > files/usr/share/data/empty
+seq 1 100000 > files/usr/share/data/large
+ln -s large files/usr/share/data/link
+$APK mkpkg --compression none -I name:data -I version:1.0 -F files -o repo/data-1.0.apk
+[ "$(head -c 4 repo/data-1.0.apk)" = "ADB." ] || assert "package is compressed"
+$APK mkndx -q -o repo/index.adb repo/*.apk
+
+$APK add --initdb $TEST_USERMODE --repository "$PWD/repo/index.adb" data > add.log 2>&1 || assert "add failed"
+for f in small empty large; do
+	cmp files/usr/share/data/$f "$TEST_ROOT"/usr/share/data/$f || assert "$f differs"
+done
+[ "$(readlink "$TEST_ROOT"/usr/share/data/link)" = "large" ] || assert "wrong symlink"
+$APK audit --system > audit.log 2>&1 || true
+[ ! -s audit.log ] || assert "audit reports changes"
+$APK del data > /dev/null
+
+# file data is still verified
+sed 's/small file/SMALL FILE/' repo/data-1.0.apk > data-1.0.apk
+$APK add data-1.0.apk > add.log 2>&1 && assert "corrupted package installed"
+grep -q "^ERROR: data-1.0: " add.log || assert "error not reported"
+[ -e "$TEST_ROOT"/usr/share/data/small ] && assert "corrupted file installed"
+[ -z "$(find "$TEST_ROOT" -name '.apk.*')" ] || assert "temporary files left behind"
+
+# packages in the cache are mapped and copied from
+$APK add --cache-packages --repository "test:/$PWD/repo/index.adb" data > add.log 2>&1 || assert "add failed"
+glob_one "$TEST_ROOT/etc/apk/cache/data-1.0.*.apk" > /dev/null || assert "package not cached"
+rm -f "$TEST_ROOT"/usr/share/data/*
+$APK fix --reinstall --repository "test:/$PWD/repo/index.adb" data > add.log 2>&1 || assert "reinstall failed"
+for f in small empty large; do
+	cmp files/usr/share/data/$f "$TEST_ROOT"/usr/share/data/$f || assert "$f differs after reinstall"
+done
+
+exit 0
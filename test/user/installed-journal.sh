@@ -0,0 +1,96 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_apkroot
+APK="$APK --allow-untrusted --no-interactive"
+DB="$TEST_ROOT"/lib/apk/db
+
+mkdir -p files/a/etc files/a/usr/bin files/a2/etc files/b/usr/share/b files/c/usr/share/c
+echo a > files/a/etc/a.conf
+echo a > files/a/usr/bin/a
+echo a2 > files/a2/etc/a.conf
+echo b > files/b/usr/share/b/data
+echo c > files/c/usr/share/c/data
+mkdir -p files/big/usr/share/big
+for i in $(seq 1 200); do echo "$i" > files/big/usr/share/big/"$i"; done
+
+$APK mkpkg -I name:test-a -I version:1.0 -F files/a -o test-a-1.0.apk
+$APK mkpkg -I name:test-a -I version:1.1 -F files/a2 -o test-a-1.1.apk
+$APK mkpkg -I name:test-b -I version:1.0 -F files/b -o test-b-1.0.apk
+$APK mkpkg -I name:test-c -I version:1.0 -F files/c -o test-c-1.0.apk
+$APK mkpkg -I name:test-big -I version:1.0 -F files/big -o test-big-1.0.apk
+$APK add --initdb $TEST_USERMODE test-a-1.0.apk test-b-1.0.apk test-big-1.0.apk
+cp "$DB"/installed installed.orig
+
+# Changes are appended to the journal
+$APK add --journal test-c-1.0.apk
+[ -f "$DB"/installed.journal ] || assert "journal not written"
+cmp -s "$DB"/installed installed.orig || assert "installed db rewritten"
+$APK info -e test-c > /dev/null || assert "added package not found"
+$APK info -W /usr/share/c/data | grep -q "owned by test-c-1.0" || assert "owner not found"
+
+$APK del --journal test-b
+$APK add --journal test-a-1.1.apk
+cmp -s "$DB"/installed installed.orig || assert "installed db rewritten"
+$APK info -e test-b > /dev/null && assert "removed package found"
+$APK info -W /etc/a.conf | grep -q "owned by test-a-1.1" || assert "upgraded package not found"
+[ -f "$TEST_ROOT"/usr/share/b/data ] && assert "removed package files left"
+$APK info -L test-a test-c > contents.journal
+$APK info -vv | sort > packages.journal
+
+# Loading without the snapshot gives the same result
+mv "$DB"/installed.snapshot snapshot.saved
+$APK info -L test-a test-c | cmp -s - contents.journal || assert "contents differ without snapshot"
+$APK info -vv | sort | cmp -s - packages.journal || assert "packages differ without snapshot"
+mv snapshot.saved "$DB"/installed.snapshot
+
+# Partially written entry is ignored, and merged away on next commit
+printf 'C:Q1invalid=\nP:test-x\n' >> "$DB"/installed.journal
+$APK info -vv | sort | cmp -s - packages.journal || assert "partial entry used"
+$APK add --journal
+[ -f "$DB"/installed.journal ] && assert "journal not merged"
+$APK info -L test-a test-c | cmp -s - contents.journal || assert "contents differ after merge"
+$APK info -vv | sort | cmp -s - packages.journal || assert "packages differ after merge"
+
+# Entry without package id fails the load
+$APK del --journal test-c
+cp "$DB"/installed.journal journal.good
+printf 'P:test-x\nV:1.0\n\n' >> "$DB"/installed.journal
+$APK info -e test-a > /dev/null 2>&1 && assert "bad entry accepted"
+cat journal.good > "$DB"/installed.journal
+$APK info -e test-c > /dev/null && assert "journal not used"
+
+# Journal of an earlier installed database is ignored, and merged away
+$APK add
+$APK add test-c-1.0.apk
+cat journal.good > "$DB"/installed.journal
+$APK info -e test-c 2> info.err > /dev/null || assert "stale journal used"
+grep -q "WARNING: installed.journal: not written for the current installed database" info.err || assert "stale journal not reported"
+$APK add --journal
+[ -f "$DB"/installed.journal ] && assert "journal not merged"
+$APK info -e test-c > /dev/null || assert "stale journal merged"
+$APK info -L test-a test-c | cmp -s - contents.journal || assert "contents differ after merge"
+
+# Journal is merged on commit without journaling
+$APK add --journal test-b-1.0.apk
+[ -f "$DB"/installed.journal ] || assert "journal not written"
+$APK add
+[ -f "$DB"/installed.journal ] && assert "journal not merged"
+$APK info -e test-b > /dev/null || assert "package lost in merge"
+
+# Database is not written when the file entries cannot be loaded
+$APK del --journal test-c
+$APK add --journal test-c-1.0.apk
+cp "$DB"/installed installed.good
+cp "$DB"/installed.journal journal.good
+sed 's/^R:data$/R;data/' journal.good > journal.new
+cmp -s journal.new journal.good && assert "journal not damaged"
+cat journal.new > "$DB"/installed.journal
+$APK del test-b > del.log 2>&1 && assert "commit with damaged file entries"
+grep -q "Unable to load installed files" del.log || assert "file entry error not reported"
+cmp -s "$DB"/installed installed.good || assert "installed db written"
+cmp -s "$DB"/installed.journal journal.new || assert "journal written"
+[ -f "$TEST_ROOT"/usr/share/b/data ] || assert "package removed"
+exit 0
@@ -0,0 +1,62 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_apkroot
+APK="$APK --allow-untrusted --no-interactive"
+DB="$TEST_ROOT"/lib/apk/db
+
+mkdir -p files/a/etc files/a/usr/bin files/b/usr/share/b
+echo a > files/a/etc/a.conf
+echo a > files/a/usr/bin/a
+chmod 700 files/a/usr/bin/a
+echo b > files/b/usr/share/b/data
+
+$APK mkpkg -I name:test-a -I version:1.0 -F files/a -o test-a-1.0.apk
+$APK mkpkg -I name:test-b -I version:1.0 -F files/b -o test-b-1.0.apk
+$APK add --initdb $TEST_USERMODE test-a-1.0.apk test-b-1.0.apk
+
+[ -f "$DB"/installed.snapshot ] || assert "snapshot not written"
+cp "$DB"/installed installed.orig
+$APK info -L test-a test-b > contents.orig
+
+# Database loaded from the snapshot is written back identically
+$APK add
+cmp -s "$DB"/installed installed.orig || assert "installed db changed"
+$APK info -L test-a test-b | cmp -s - contents.orig || assert "contents differ"
+
+# File entries are loaded on demand
+$APK info -W /etc/a.conf | grep -q "owned by test-a-1.0" || assert "owner not found"
+$APK stats > stats.snapshot
+mv "$DB"/installed.snapshot snapshot.saved
+$APK stats | cmp -s - stats.snapshot || assert "stats differ"
+mv snapshot.saved "$DB"/installed.snapshot
+
+# Snapshot is used while the text db is unchanged
+touch -r "$DB"/installed timestamp
+sed 's/^P:test-a$/P:test-x/' installed.orig > installed.new
+cat installed.new > "$DB"/installed
+touch -r timestamp "$DB"/installed
+$APK info -e test-a > /dev/null || assert "snapshot not used"
+
+# Text db is used when it has been modified
+touch "$DB"/installed
+$APK info -e test-x > /dev/null || assert "stale snapshot used"
+$APK info -e test-a > /dev/null && assert "stale snapshot used"
+
+# Text db is used when the snapshot is damaged
+cat installed.orig > "$DB"/installed
+$APK add
+head -c 200 "$DB"/installed.snapshot > snapshot.new
+cat snapshot.new > "$DB"/installed.snapshot
+$APK info -L test-a test-b | cmp -s - contents.orig || assert "damaged snapshot used"
+
+# Damaged package fields are found before any package is loaded
+$APK add
+sed 's/^P:test-b$/P;test-b/' "$DB"/installed.snapshot > snapshot.new
+cmp -s snapshot.new "$DB"/installed.snapshot && assert "snapshot not damaged"
+cat snapshot.new > "$DB"/installed.snapshot
+$APK info -L test-a test-b | cmp -s - contents.orig || assert "damaged snapshot used"
+
+exit 0
@@ -0,0 +1,90 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_apkroot
+APK="$APK --allow-untrusted --no-interactive --force-no-chroot"
+
+$APK mkpkg -I name:lib -I version:1.0 -I provides:so:libx.so.1=1 -o lib-1.0.apk
+$APK mkpkg -I name:app-a -I version:1.0 -I "depends:so:libx.so.1 lib" -o app-a-1.0.apk
+$APK mkpkg -I name:app-b -I version:1.0 -I depends:lib -o app-b-1.0.apk
+$APK mkpkg -I name:plugin -I version:1.0 -I "install-if:app-a lib" -o plugin-1.0.apk
+$APK mkpkg -I name:other -I version:1.0 -I "depends:!app-b" -o other-1.0.apk
+
+$APK mkndx -q -o index.adb ./*.apk
+$APK adbdump index.adb | sed -n '/^reverse-dependencies:/,$p' | diff -u /dev/fd/4 4<<EOF - || assert "wrong reverse dependencies"
+reverse-dependencies: # 4 items
+  - name: app-a
+    install-if: # 1 items
+      - plugin
+  - name: app-b
+    depends: # 1 items
+      - other
+  - name: lib
+    depends: # 2 items
+      - app-a
+      - app-b
+    install-if: # 1 items
+      - plugin
+    required: 1
+  - name: so:libx.so.1
+    depends: # 1 items
+      - app-a
+    required: 1
+EOF
+
+$APK query --format yaml --repository index.adb --fields package,reverse-depends,reverse-install-if lib app-a 2>&1 | diff -u /dev/fd/4 4<<EOF - || assert "wrong query result"
+# 2 items
+- package: app-a-1.0
+  reverse-depends:
+  reverse-install-if:
+    - plugin
+- package: lib-1.0
+  reverse-depends:
+    - app-a
+    - app-b
+  reverse-install-if:
+    - plugin
+EOF
+
+# Tables from several indexes are merged
+$APK mkndx -q -o index-1.adb lib-1.0.apk app-a-1.0.apk plugin-1.0.apk
+$APK mkndx -q -o index-2.adb app-a-1.0.apk app-b-1.0.apk other-1.0.apk
+$APK query --format yaml --repository index-1.adb --repository index-2.adb --fields package,reverse-depends lib 2>&1 | diff -u /dev/fd/4 4<<EOF - || assert "wrong merged query result"
+# 1 items
+- package: lib-1.0
+  reverse-depends:
+    - app-a
+    - app-b
+EOF
+
+# Indexes loaded in parallel are merged in repository order
+$APK mkndx -q -o index-3.adb lib-1.0.apk app-a-1.0.apk
+$APK mkndx -q -o index-4.adb app-b-1.0.apk
+for jobs in 1 2; do
+	rm -f "$TEST_ROOT"/etc/apk/cache/repositories.cache
+	$APK query --jobs $jobs --format yaml --repository index-3.adb --repository index-4.adb \
+		--fields package,reverse-depends lib 2>&1 | diff -u /dev/fd/4 4<<EOF - || assert "wrong query result with $jobs jobs"
+# 1 items
+- package: lib-1.0
+  reverse-depends:
+    - app-a
+    - app-b
+EOF
+	rm -f "$TEST_ROOT"/etc/apk/cache/repositories.cache
+	$APK search --jobs $jobs --repository index-3.adb --repository index-4.adb -r lib 2>&1 | diff -u /dev/fd/4 4<<EOF - || assert "wrong search result with $jobs jobs"
+lib-1.0 is required by:
+app-a-1.0
+app-b-1.0
+EOF
+done
+
+$APK add --initdb $TEST_USERMODE --repository index.adb app-a > add.log 2>&1 || assert "add failed"
+grep -q "Installing plugin" add.log || assert "install-if package not installed"
+$APK query --format yaml --installed --fields package,reverse-depends lib 2>&1 | diff -u /dev/fd/4 4<<EOF - || assert "wrong installed query result"
+# 1 items
+- package: lib-1.0
+  reverse-depends:
+    - app-a
+EOF
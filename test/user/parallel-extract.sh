@@ -0,0 +1,75 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_repo() {
+	local repo="$1"
+
+	mkdir -p "$repo" files/base/usr/share/data files/base/etc
+	echo base > files/base/usr/share/data/base
+	$APK mkpkg -I name:base -I version:1.0 -F files/base -o "$repo"/base-1.0.apk
+	for i in 1 2 3 4 5; do
+		mkdir -p files/$i/usr/share/data files/$i/etc files/$i/usr/share/pkg-$i
+		for j in 1 2 3; do
+			echo "package $i file $j" > files/$i/usr/share/data/file-$i-$j
+		done
+		echo "package $i" > files/$i/etc/pkg-$i.conf
+		echo "new dir $i" > files/$i/usr/share/pkg-$i/file
+		$APK mkpkg -I name:pkg-$i -I version:1.0 -I depends:base -F files/$i -o "$repo"/pkg-$i-1.0.apk
+	done
+	cat > pre-install <<-EOF
+	#!/bin/sh
+	echo pre-install running
+	EOF
+	mkdir -p files/script/usr/share/data
+	echo script > files/script/usr/share/data/script
+	$APK mkpkg -I name:script -I version:1.0 -I depends:base -s pre-install:pre-install -F files/script -o "$repo"/script-1.0.apk
+	mkdir -p files/dep/usr/share/data files/conflict/usr/share/data
+	echo dep > files/dep/usr/share/data/dep
+	$APK mkpkg -I name:dep -I version:1.0 -I depends:base -F files/dep -o "$repo"/dep-1.0.apk
+	echo conflict > files/conflict/usr/share/data/file-1-1
+	echo conflict > files/conflict/usr/share/data/conflict
+	$APK mkpkg -I name:conflict -I version:1.0 -I depends:"base pkg-1 dep" -F files/conflict -o "$repo"/conflict-1.0.apk
+	$APK mkndx "$repo"/*.apk -o "$repo"/index.adb
+}
+
+tree_state() {
+	(cd "$1" && find usr etc -path etc/apk -prune -o -print | sort | while read -r f; do
+		if [ -f "$f" ]; then echo "$f $(cat "$f")"; else echo "$f"; fi
+	done)
+}
+
+APK="$APK --allow-untrusted --no-interactive --force-no-chroot"
+setup_apkroot
+setup_repo "$PWD/repo"
+REPO="$PWD/repo/index.adb"
+SERIAL_ROOT=$(mktemp -d -p /tmp apktest.XXXXXXXX)
+trap 'rm -rf -- "$TEST_ROOT" "$SERIAL_ROOT"' EXIT
+mkdir -p "$SERIAL_ROOT"/etc/apk "$SERIAL_ROOT"/lib/apk/db
+SERIAL_APK="$(echo "$APK" | sed "s|--root $TEST_ROOT|--root $SERIAL_ROOT|")"
+
+$SERIAL_APK add --initdb $TEST_USERMODE --no-parallel-extract --repository "$REPO" base pkg-1 pkg-2 pkg-3 pkg-4 pkg-5 script > serial.log 2>&1 || assert "serial add failed"
+$APK add --initdb $TEST_USERMODE --parallel-extract --jobs 3 --repository "$REPO" base pkg-1 pkg-2 pkg-3 pkg-4 pkg-5 script > add.log 2>&1 || assert "parallel add failed"
+diff -u serial.log add.log || assert "different output"
+grep -q "pre-install running" add.log || assert "pre-install script not run"
+tree_state "$SERIAL_ROOT" > serial.state
+tree_state "$TEST_ROOT" > add.state
+diff -u serial.state add.state || assert "different file system state"
+[ -z "$(find "$TEST_ROOT"/usr "$TEST_ROOT"/etc -name '.apk.*')" ] || assert "temporary files left behind"
+$APK audit --system > audit.log 2>&1 || true
+[ ! -s audit.log ] || assert "audit reports changes"
+
+# the staged files of the packages extracted ahead are used
+$APK del pkg-4 pkg-5 > /dev/null 2>&1 || assert "del failed"
+$APK add -vv --parallel-extract --jobs 3 --repository "$REPO" pkg-4 pkg-5 > add.log 2>&1 || assert "add failed"
+grep -q "usr/share/data/file-5-1: using staged file" add.log || assert "staged file not used"
+grep -q "^package 5 file 1$" "$TEST_ROOT"/usr/share/data/file-5-1 || assert "staged file not installed"
+[ -z "$(find "$TEST_ROOT"/usr "$TEST_ROOT"/etc -name '.apk.*')" ] || assert "temporary files left behind"
+
+# conflicting files are not installed, and their staged copies removed
+$APK add --parallel-extract --repository "$REPO" conflict > add.log 2>&1 && assert "conflicting add succeeded"
+grep -q "trying to overwrite usr/share/data/file-1-1" add.log || assert "conflict not reported"
+grep -q "^package 1 file 1$" "$TEST_ROOT"/usr/share/data/file-1-1 || assert "conflicting file overwritten"
+grep -q "^dep$" "$TEST_ROOT"/usr/share/data/dep || assert "dep not installed"
+[ -z "$(find "$TEST_ROOT"/usr "$TEST_ROOT"/etc -name '.apk.*')" ] || assert "temporary files left behind"
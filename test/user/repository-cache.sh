@@ -0,0 +1,64 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_repo() {
+	local repo="$1"
+
+	mkdir -p "$repo"
+	$APK mkpkg -I name:hello -I arch:noarch -I version:1.0 -o "$repo"/hello-1.0.apk
+	$APK mkpkg -I name:meta -I arch:noarch -I version:1.0 -I depends:hello -o "$repo"/meta-1.0.apk
+	$APK mkndx -d "test repo" "$repo"/*.apk -o "$repo"/index.adb
+}
+
+APK="$APK --allow-untrusted --no-interactive"
+
+setup_apkroot
+setup_repo "$PWD/repo"
+APK="$APK --repository test:/$PWD/repo/index.adb"
+CACHE="$TEST_ROOT"/etc/apk/cache/repositories.cache
+
+$APK update > update.orig
+[ -f "$CACHE" ] || assert "repository cache not written"
+$APK search -r hello > rdepends.orig
+grep -q "meta-1.0" rdepends.orig || assert "rdepends missing"
+$APK add --simulate meta > add.orig
+
+# Cached repositories give the same results
+$APK update | cmp -s - update.orig || assert "update differs"
+$APK search -r hello | cmp -s - rdepends.orig || assert "rdepends differ"
+$APK add --simulate meta | cmp -s - add.orig || assert "add differs"
+
+# Cache is used while the indexes are unchanged
+sed 's/test repo/TEST repo/' "$CACHE" > cache.new
+cat cache.new > "$CACHE"
+$APK update | grep -q "TEST repo" || assert "cache not used"
+
+# Cache is ignored when an index changes
+$APK mkpkg -I name:world -I arch:noarch -I version:1.0 -o repo/world-1.0.apk
+$APK mkndx -d "test repo" repo/*.apk -o repo/index.adb
+$APK update --update-cache | grep -q "test repo" || assert "stale cache used"
+$APK search -e world | grep -q "world-1.0" || assert "new package not found"
+
+# Damaged cache is ignored
+head -c 200 "$CACHE" > cache.new
+cat cache.new > "$CACHE"
+$APK search -e world | grep -q "world-1.0" || assert "damaged cache used"
+
+# Parallel loading gives the same results
+setup_repo "$PWD/repo2"
+APK2="$APK --repository test:/$PWD/repo2/index.adb"
+rm -f "$CACHE"
+$APK2 --jobs 1 update > update.serial
+$APK2 --jobs 1 search -r hello > rdepends.serial
+rm -f "$CACHE"
+$APK2 --jobs 2 update | cmp -s - update.serial || assert "parallel update differs"
+rm -f "$CACHE"
+$APK2 --jobs 2 search -r hello | cmp -s - rdepends.serial || assert "parallel rdepends differ"
+
+# Cache is kept on cache clean
+$APK update > /dev/null
+$APK cache clean
+[ -f "$CACHE" ] || assert "repository cache deleted"
+exit 0
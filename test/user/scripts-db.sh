@@ -0,0 +1,47 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_apkroot
+APK="$APK --allow-untrusted --no-interactive --force-no-chroot"
+DB="$TEST_ROOT"/lib/apk/db
+
+for p in a b c d e f; do
+	printf '#!/bin/sh\necho Bye from %s\n' "$p" > "$p".sh
+	$APK mkpkg -I name:test-"$p" -I version:1.0 -s post-deinstall:"$p".sh -o test-"$p"-1.0.apk
+done
+
+$APK add --initdb $TEST_USERMODE test-a-1.0.apk test-b-1.0.apk test-c-1.0.apk test-d-1.0.apk test-e-1.0.apk
+INODE=$(stat -c %i "$DB"/scripts.tar)
+
+# New scripts are appended
+$APK add test-f-1.0.apk > /dev/null
+[ "$(stat -c %i "$DB"/scripts.tar)" = "$INODE" ] || assert "scripts db rewritten"
+[ "$(tar -tf "$DB"/scripts.tar | wc -l)" = 6 ] || assert "scripts not appended"
+
+# Scripts are read on demand, and removed ones are kept until compacted
+$APK del test-a 2>&1 | grep -q "Bye from a" || assert "script not run"
+[ "$(stat -c %i "$DB"/scripts.tar)" = "$INODE" ] || assert "scripts db rewritten"
+[ "$(tar -tf "$DB"/scripts.tar | wc -l)" = 6 ] || assert "removed script not kept"
+$APK del test-f 2>&1 | grep -q "Bye from f" || assert "appended script not run"
+[ "$(stat -c %i "$DB"/scripts.tar)" = "$INODE" ] && assert "scripts db not compacted"
+[ "$(tar -tf "$DB"/scripts.tar | wc -l)" = 4 ] || assert "removed scripts left"
+
+# Interrupted update is ignored, and compacted on next commit
+INODE=$(stat -c %i "$DB"/scripts.tar)
+printf 'partial' >> "$DB"/scripts.tar
+$APK add test-a-1.0.apk > /dev/null
+[ "$(stat -c %i "$DB"/scripts.tar)" = "$INODE" ] && assert "scripts db not compacted"
+[ "$(tar -tf "$DB"/scripts.tar | wc -l)" = 5 ] || assert "wrong scripts db"
+$APK del test-c 2>&1 | grep -q "Bye from c" || assert "script not run"
+
+# Compressed scripts db is converted
+gzip -c "$DB"/scripts.tar > "$DB"/scripts.tar.gz
+rm "$DB"/scripts.tar
+$APK add test-f-1.0.apk > /dev/null
+[ -f "$DB"/scripts.tar.gz ] && assert "compressed scripts db left"
+$APK del test-d test-f > del.log 2>&1
+grep -q "Bye from d" del.log || assert "converted script not run"
+grep -q "Bye from f" del.log || assert "converted script not run"
+exit 0
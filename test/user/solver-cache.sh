@@ -0,0 +1,67 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+setup_repo() {
+	local repo="$1"
+
+	mkdir -p "$repo"
+	$APK mkpkg -I name:hello -I arch:noarch -I version:1.0 -o "$repo"/hello-1.0.apk
+	$APK mkpkg -I name:meta -I arch:noarch -I version:1.0 -I depends:hello -o "$repo"/meta-1.0.apk
+	$APK mkndx -d "test repo" "$repo"/*.apk -o "$repo"/index.adb
+}
+
+APK="$APK --allow-untrusted --no-interactive --force-no-chroot"
+
+setup_apkroot
+setup_repo "$PWD/repo"
+APK="$APK --repository test:/$PWD/repo/index.adb"
+CACHE="$TEST_ROOT"/etc/apk/cache/solver.cache
+$APK update > /dev/null
+
+$APK add --simulate meta > add.orig
+[ -f "$CACHE" ] && assert "solver cache written without --solver-cache"
+$APK add --simulate --solver-cache meta > add.cached
+[ -f "$CACHE" ] || assert "solver cache not written"
+cmp -s add.orig add.cached || assert "add differs"
+
+# Cache is used for the same world
+touch -d @0 "$CACHE"
+$APK add --simulate --solver-cache meta > add.cached
+cmp -s add.orig add.cached || assert "cached add differs"
+[ "$(stat -c %Y "$CACHE")" = 0 ] || assert "solver cache not used"
+
+# Cache is used whether the indexes or the repository cache are loaded
+for i in 1 2; do
+	rm -f "$TEST_ROOT"/etc/apk/cache/repositories.cache
+	$APK add --simulate --solver-cache meta | cmp -s - add.orig || assert "cached add differs"
+	[ "$(stat -c %Y "$CACHE")" = 0 ] || assert "solver cache not used with indexes"
+	$APK add --simulate --solver-cache meta | cmp -s - add.orig || assert "cached add differs"
+	[ "$(stat -c %Y "$CACHE")" = 0 ] || assert "solver cache not used with repository cache"
+done
+
+# Cache is not used for a different world or changed index
+$APK add --simulate --solver-cache hello > add.hello
+grep -q "meta" add.hello && assert "cached changes used for other world"
+$APK mkpkg -I name:hello -I arch:noarch -I version:1.1 -o repo/hello-1.1.apk
+$APK mkndx -d "test repo" repo/hello-1.1.apk repo/meta-1.0.apk -o repo/index.adb
+$APK update --update-cache > /dev/null
+$APK add --simulate --solver-cache meta > add.new
+grep -q "hello (1.1)" add.new || assert "stale cached changes used"
+
+# Installed packages are part of the key
+$APK add --initdb $TEST_USERMODE --solver-cache meta > /dev/null
+$APK add --simulate --solver-cache meta > add.installed
+grep -q "Installing" add.installed && assert "changes not solved again"
+
+# Damaged cache is ignored
+$APK upgrade --simulate --solver-cache > upgrade.orig
+head -c 50 "$CACHE" > cache.new
+cat cache.new > "$CACHE"
+$APK upgrade --simulate --solver-cache | cmp -s - upgrade.orig || assert "damaged cache used"
+
+# Cache is kept on cache clean
+$APK cache clean
+[ -f "$CACHE" ] || assert "solver cache deleted"
+exit 0
@@ -0,0 +1,25 @@
+#!/bin/sh
+
+TESTDIR=$(realpath "${TESTDIR:-"$(dirname "$0")"/..}")
+. "$TESTDIR"/testlib.sh
+
+APK="$APK --allow-untrusted --no-interactive --force-no-chroot"
+
+setup_apkroot
+mkdir -p repo
+$APK mkpkg -I name:hello -I arch:noarch -I version:1.0 -o repo/hello-1.0.apk
+$APK mkpkg -I name:meta -I arch:noarch -I version:1.0 -I depends:hello -o repo/meta-1.0.apk
+$APK mkndx repo/*.apk -o repo/index.adb
+APK="$APK --repository test:/$PWD/repo/index.adb"
+$APK update > /dev/null
+
+$APK add --simulate meta > add.orig
+grep -q "^Solver:" add.orig && assert "stats printed without --solver-stats"
+$APK add --simulate --solver-stats meta > add.stats
+grep -q "^Solver: 2 names discovered" add.stats || assert "names not counted"
+grep -q "^Solver: discover [0-9.]* ms, resolve [0-9.]* ms, changeset [0-9.]* ms" add.stats || assert "phases not timed"
+grep -v "^Solver:" add.stats | cmp -s - add.orig || assert "changes differ"
+
+$APK add --simulate --solver-cache meta > /dev/null
+$APK add --simulate --solver-cache --solver-stats meta | grep -q "^Solver: changeset loaded from cache" || assert "cache hit not reported"
+exit 0
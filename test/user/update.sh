@@ -33,3 +33,10 @@ OK: 1 distinct packages available" ] || assert "update fail"
 
 [ "$($APK update --no-cache 2>&1)" = "test repo [test:/$PWD/repo/index.adb]
 OK: 1 distinct packages available" ] || assert "update --no-cache fail"
+
+setup_repo "$PWD/repo2"
+APK="$APK --repository test:/$PWD/repo2/index.adb --repository test:/$PWD/missing/index.adb"
+$APK update --update-cache --jobs 1 > update.serial 2>&1 && assert "missing repository not reported"
+grep -q "missing/index.adb: No such file or directory" update.serial || assert "update error not reported"
+$APK update --update-cache --jobs 3 > update.parallel 2>&1 && assert "missing repository not reported"
+cmp -s update.parallel update.serial || assert "parallel update differs"